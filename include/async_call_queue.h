@@ -0,0 +1,265 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <iostream>
+
+#include <grpc++/grpc++.h>
+
+using grpc::CompletionQueue;
+
+using namespace std;
+
+#ifndef __WATFS_ASYNC_CALL_QUEUE__
+#define __WATFS_ASYNC_CALL_QUEUE__
+
+
+// most calls a client has in flight at once by default
+#define ASYNC_DEFAULT_MAX_IN_FLIGHT     64
+
+
+/*
+ * The operation a thread is waiting for on an AsyncCallQueue. Its address is
+ * the completion queue tag, and the poller fills in ok when it completes.
+ * One call can be reused for each step of a streaming RPC.
+ *
+ * The poller signals wakeup, which is the call's own condition unless it is
+ * pointed at another call's, so that a thread can wait for several calls.
+ */
+class PendingCall {
+public:
+    bool done;
+    bool ok;
+    pthread_cond_t completed;
+    pthread_cond_t *wakeup;
+
+    PendingCall() : done(false), ok(false), wakeup(&completed) {
+        pthread_cond_init(&completed, NULL);
+    }
+
+    ~PendingCall() {
+        pthread_cond_destroy(&completed);
+    }
+};
+
+
+/*
+ * One completion queue shared by every thread of a client, with a single
+ * thread polling it. Threads start their RPCs on the queue and sleep until
+ * the poller hands them the result, so any number of FUSE, readahead and
+ * write-behind threads can have calls outstanding on the channel at once
+ * without each of them running a queue of its own.
+ *
+ * The number of calls in flight is bounded: Begin blocks until there is
+ * room, so a burst of requests queues up here instead of in the server.
+ */
+class AsyncCallQueue {
+public:
+    unsigned long calls;
+    unsigned long waits;
+
+    AsyncCallQueue() : calls(0), waits(0), max_in_flight(
+                       ASYNC_DEFAULT_MAX_IN_FLIGHT), in_flight(0),
+                       poller_running(false) {
+
+        pthread_mutex_init(&queue_mutex, NULL);
+        pthread_cond_init(&slot_free, NULL);
+
+        int err = pthread_create(&poller, NULL, Poller, this);
+        if (err != 0) {
+            cerr << "failed to start completion queue thread: "
+                 << strerror(err) << endl;
+            exit(1);
+        }
+        poller_running = true;
+    }
+
+    ~AsyncCallQueue() {
+        cq.Shutdown();
+        if (poller_running) {
+            pthread_join(poller, NULL);
+        }
+
+        pthread_cond_destroy(&slot_free);
+        pthread_mutex_destroy(&queue_mutex);
+    }
+
+
+    /*
+     * allow at most max calls in flight, 0 for no limit
+     */
+    void SetLimit(int max) {
+        pthread_mutex_lock(&queue_mutex);
+        max_in_flight = max;
+        pthread_cond_broadcast(&slot_free);
+        pthread_mutex_unlock(&queue_mutex);
+    }
+
+
+    /*
+     * the queue to start calls on, between Begin and End
+     */
+    CompletionQueue *Queue() {
+        return &cq;
+    }
+
+
+    /*
+     * wait for room to start a call
+     */
+    void Begin() {
+        pthread_mutex_lock(&queue_mutex);
+
+        if (max_in_flight > 0 && in_flight >= max_in_flight) {
+            waits++;
+            do {
+                pthread_cond_wait(&slot_free, &queue_mutex);
+            } while (max_in_flight > 0 && in_flight >= max_in_flight);
+        }
+
+        in_flight++;
+        calls++;
+
+        pthread_mutex_unlock(&queue_mutex);
+    }
+
+
+    /*
+     * make room for a call like Begin, but only if there is some right now.
+     *
+     * returns whether the call can be started
+     */
+    bool TryBegin() {
+        bool room;
+
+        pthread_mutex_lock(&queue_mutex);
+
+        room = max_in_flight == 0 || in_flight < max_in_flight;
+        if (room) {
+            in_flight++;
+            calls++;
+        }
+
+        pthread_mutex_unlock(&queue_mutex);
+
+        return room;
+    }
+
+
+    /*
+     * a call started after Begin is finished
+     */
+    void End() {
+        pthread_mutex_lock(&queue_mutex);
+        in_flight--;
+        pthread_cond_signal(&slot_free);
+        pthread_mutex_unlock(&queue_mutex);
+    }
+
+
+    /*
+     * wait for the operation tagged with call to complete, and get it ready
+     * for the next one.
+     *
+     * returns the ok flag of the completion
+     */
+    bool Wait(PendingCall *call) {
+        bool ok;
+
+        pthread_mutex_lock(&queue_mutex);
+
+        while (!call->done) {
+            pthread_cond_wait(call->wakeup, &queue_mutex);
+        }
+        ok = call->ok;
+        call->done = false;
+
+        pthread_mutex_unlock(&queue_mutex);
+
+        return ok;
+    }
+
+
+    /*
+     * wait until one of the ncalls operations in calls has completed, or
+     * until deadline if it isn't NULL. The calls must share one wakeup
+     * condition. Completed calls are left for Wait to collect.
+     *
+     * returns the index of a completed call, or -1 at the deadline
+     */
+    int WaitAny(PendingCall *calls, int ncalls, 
+                const struct timespec *deadline) {
+        int index = -1;
+
+        pthread_mutex_lock(&queue_mutex);
+
+        for (;;) {
+            for (int i = 0; i < ncalls; i++) {
+                if (calls[i].done) {
+                    index = i;
+                    break;
+                }
+            }
+
+            if (index != -1) {
+                break;
+            }
+
+            if (deadline == NULL) {
+                pthread_cond_wait(calls[0].wakeup, &queue_mutex);
+            } else if (pthread_cond_timedwait(calls[0].wakeup, &queue_mutex,
+                                              deadline) == ETIMEDOUT) {
+                break;
+            }
+        }
+
+        pthread_mutex_unlock(&queue_mutex);
+
+        return index;
+    }
+
+
+    void PrintStats(ostream &out) {
+        pthread_mutex_lock(&queue_mutex);
+        out << "async calls: " << calls << " started, " << waits
+            << " waited for a slot" << endl;
+        pthread_mutex_unlock(&queue_mutex);
+    }
+
+
+private:
+    CompletionQueue cq;
+    pthread_t poller;
+
+    int max_in_flight;
+    int in_flight;
+    bool poller_running;
+
+    pthread_mutex_t queue_mutex;
+    pthread_cond_t slot_free;
+
+
+    /*
+     * body of the polling thread, which runs until the queue is shut down
+     */
+    static void *Poller(void *arg) {
+        AsyncCallQueue *queue = (AsyncCallQueue *)arg;
+        void *tag;
+        bool ok;
+
+        while (queue->cq.Next(&tag, &ok)) {
+            PendingCall *call = (PendingCall *)tag;
+
+            pthread_mutex_lock(&queue->queue_mutex);
+            call->ok = ok;
+            call->done = true;
+            pthread_cond_broadcast(call->wakeup);
+            pthread_mutex_unlock(&queue->queue_mutex);
+        }
+
+        return NULL;
+    }
+};
+
+#endif // __WATFS_ASYNC_CALL_QUEUE__
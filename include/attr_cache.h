@@ -0,0 +1,327 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <chrono>
+#include <iostream>
+#include <list>
+#include <string>
+#include <unordered_map>
+
+using namespace std;
+
+#ifndef __WATFS_ATTR_CACHE__
+#define __WATFS_ATTR_CACHE__
+
+
+#define ATTR_CACHE_DEFAULT_SIZE     65536
+#define ATTR_CACHE_DEFAULT_TTL_MS   1000
+
+
+/*
+ * A cached result of a getattr on a path. A negative entry (err != 0) records
+ * that the path did not exist (or could not be stat'd) on the server, so that
+ * repeated lookups of missing files (e.g. include path searches) are answered
+ * locally as well.
+ */
+class AttrCacheEntry {
+public:
+    string path;
+    struct stat attr;
+    int err;
+    chrono::steady_clock::time_point expiry;
+};
+
+
+/*
+ * getattrs of a path in flight, and the generation they were sent in. The
+ * generation changes whenever the path is invalidated, so that a reply sent
+ * before a change isn't cached after it.
+ */
+class AttrCacheFetch {
+public:
+    unsigned long generation;
+    int fetches;
+};
+
+
+/*
+ * Size-bounded LRU cache of file attributes keyed by path. Entries expire
+ * after a fixed TTL, and are dropped explicitly whenever this client mutates
+ * the object they describe. All methods are thread safe, since FUSE calls us
+ * from multiple threads.
+ *
+ * To cache the reply to a getattr, call StartFetch before sending it and
+ * hand the reply to FinishFetch.
+ */
+class AttrCache {
+public:
+    // statistics, used to tune the cache size and TTL
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    unsigned long invalidations;
+
+    AttrCache() {
+        Init(ATTR_CACHE_DEFAULT_SIZE, ATTR_CACHE_DEFAULT_TTL_MS);
+    }
+
+    AttrCache(size_t max_entries, long ttl_ms) {
+        Init(max_entries, ttl_ms);
+    }
+
+    ~AttrCache() {
+        pthread_mutex_destroy(&cache_mutex);
+    }
+
+
+    /*
+     * change the size limit and TTL of the cache. A TTL or size of 0 disables
+     * caching entirely.
+     */
+    void Configure(size_t max_entries, long ttl_ms) {
+        pthread_mutex_lock(&cache_mutex);
+
+        capacity = max_entries;
+        ttl = chrono::milliseconds(ttl_ms);
+        while (lru.size() > capacity) {
+            Evict();
+        }
+
+        pthread_mutex_unlock(&cache_mutex);
+    }
+
+
+    /*
+     * look up path in the cache.
+     *
+     * returns true on a hit, in which case statbuf and err are filled in from
+     * the cached entry. err is set to the cached errno for negative entries.
+     */
+    bool Lookup(const string &path, struct stat *statbuf, int *err) {
+        bool hit = false;
+
+        pthread_mutex_lock(&cache_mutex);
+
+        auto it = entries.find(path);
+        if (it != entries.end()) {
+            if (chrono::steady_clock::now() < it->second->expiry) {
+                // move to the front of the LRU list
+                lru.splice(lru.begin(), lru, it->second);
+                memcpy(statbuf, &it->second->attr, sizeof(struct stat));
+                *err = it->second->err;
+                hit = true;
+            } else {
+                // expired, drop it now so we don't keep stale data around
+                lru.erase(it->second);
+                entries.erase(it);
+            }
+        }
+
+        if (hit) {
+            hits++;
+        } else {
+            misses++;
+        }
+
+        pthread_mutex_unlock(&cache_mutex);
+
+        return hit;
+    }
+
+
+    /*
+     * note a getattr of path about to be sent.
+     *
+     * returns the generation to hand to FinishFetch
+     */
+    unsigned long StartFetch(const string &path) {
+        pthread_mutex_lock(&cache_mutex);
+
+        AttrCacheFetch &fetch = fetching[path];
+        if (fetch.fetches++ == 0) {
+            fetch.generation = next_generation++;
+        }
+        unsigned long generation = fetch.generation;
+
+        pthread_mutex_unlock(&cache_mutex);
+
+        return generation;
+    }
+
+
+    /*
+     * complete a getattr of path started with StartFetch: cache the
+     * attributes in statbuf, or a negative entry for err if it isn't 0,
+     * unless path was invalidated since. statbuf is NULL and err 0 if the
+     * call failed.
+     */
+    void FinishFetch(const string &path, unsigned long generation,
+                     const struct stat *statbuf, int err) {
+        pthread_mutex_lock(&cache_mutex);
+
+        auto fetch = fetching.find(path);
+        bool current = fetch->second.generation == generation;
+        if (--fetch->second.fetches == 0) {
+            fetching.erase(fetch);
+        }
+
+        if (current && (statbuf != NULL || err != 0)) {
+            AddLocked(path, statbuf, err);
+        }
+
+        pthread_mutex_unlock(&cache_mutex);
+    }
+
+
+    /*
+     * add or refresh a positive entry for path
+     */
+    void Insert(const string &path, const struct stat *statbuf) {
+        Add(path, statbuf, 0);
+    }
+
+
+    /*
+     * drop the entry for path, if there is one
+     */
+    void Invalidate(const string &path) {
+        pthread_mutex_lock(&cache_mutex);
+
+        auto fetch = fetching.find(path);
+        if (fetch != fetching.end()) {
+            fetch->second.generation = next_generation++;
+        }
+
+        auto it = entries.find(path);
+        if (it != entries.end()) {
+            lru.erase(it->second);
+            entries.erase(it);
+            invalidations++;
+        }
+
+        pthread_mutex_unlock(&cache_mutex);
+    }
+
+
+    /*
+     * drop the entry for path and for everything below it, used when a
+     * directory is renamed or removed
+     */
+    void InvalidateTree(const string &path) {
+        string prefix = path + "/";
+
+        pthread_mutex_lock(&cache_mutex);
+
+        for (auto &fetch : fetching) {
+            if (fetch.first == path ||
+                fetch.first.compare(0, prefix.size(), prefix) == 0) {
+
+                fetch.second.generation = next_generation++;
+            }
+        }
+
+        for (auto it = lru.begin(); it != lru.end(); ) {
+            if (it->path == path ||
+                it->path.compare(0, prefix.size(), prefix) == 0) {
+
+                entries.erase(it->path);
+                it = lru.erase(it);
+                invalidations++;
+            } else {
+                ++it;
+            }
+        }
+
+        pthread_mutex_unlock(&cache_mutex);
+    }
+
+
+    void PrintStats(ostream &out) {
+        pthread_mutex_lock(&cache_mutex);
+
+        unsigned long lookups = hits + misses;
+        out << "attr cache: " << lru.size() << " entries, "
+            << hits << " hits, " << misses << " misses ("
+            << (lookups ? (100.0 * hits / lookups) : 0.0) << "% hit rate), "
+            << evictions << " evictions, "
+            << invalidations << " invalidations" << endl;
+
+        pthread_mutex_unlock(&cache_mutex);
+    }
+
+
+private:
+    size_t capacity;
+    chrono::milliseconds ttl;
+
+    // most recently used entries are at the front
+    list<AttrCacheEntry> lru;
+    unordered_map<string, list<AttrCacheEntry>::iterator> entries;
+
+    // paths with getattrs in flight, and the generation to give the next one
+    unordered_map<string, AttrCacheFetch> fetching;
+    unsigned long next_generation;
+
+    pthread_mutex_t cache_mutex;
+
+
+    void Init(size_t max_entries, long ttl_ms) {
+        capacity = max_entries;
+        ttl = chrono::milliseconds(ttl_ms);
+        next_generation = 1;
+        hits = 0;
+        misses = 0;
+        evictions = 0;
+        invalidations = 0;
+
+        pthread_mutex_init(&cache_mutex, NULL);
+    }
+
+
+    void Add(const string &path, const struct stat *statbuf, int err) {
+        pthread_mutex_lock(&cache_mutex);
+        AddLocked(path, statbuf, err);
+        pthread_mutex_unlock(&cache_mutex);
+    }
+
+
+    // caller holds cache_mutex
+    void AddLocked(const string &path, const struct stat *statbuf, int err) {
+        if (capacity == 0 || ttl.count() == 0) {
+            return;
+        }
+
+        auto it = entries.find(path);
+        if (it != entries.end()) {
+            lru.splice(lru.begin(), lru, it->second);
+        } else {
+            while (lru.size() >= capacity) {
+                Evict();
+            }
+            lru.emplace_front();
+            lru.front().path = path;
+            entries[path] = lru.begin();
+        }
+
+        AttrCacheEntry &entry = lru.front();
+        if (statbuf != NULL) {
+            memcpy(&entry.attr, statbuf, sizeof(struct stat));
+        } else {
+            memset(&entry.attr, 0, sizeof(struct stat));
+        }
+        entry.err = err;
+        entry.expiry = chrono::steady_clock::now() + ttl;
+    }
+
+
+    // caller holds cache_mutex
+    void Evict() {
+        entries.erase(lru.back().path);
+        lru.pop_back();
+        evictions++;
+    }
+};
+
+#endif // __WATFS_ATTR_CACHE__
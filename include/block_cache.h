@@ -0,0 +1,337 @@
+#include <string.h>
+#include <pthread.h>
+
+#include <iostream>
+#include <list>
+#include <map>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+#ifndef __WATFS_BLOCK_CACHE__
+#define __WATFS_BLOCK_CACHE__
+
+
+// files are cached in blocks of this many bytes
+#define BLOCK_SZ                    (128 << 10)
+#define BLOCK_CACHE_DEFAULT_SIZE    (128 << 20)
+
+
+/*
+ * A cached block of file data. A block shorter than BLOCK_SZ is the last
+ * block of the file.
+ */
+class CachedBlock {
+public:
+    string path;
+    long block;
+    string data;
+};
+
+
+/*
+ * Bookkeeping for the cached blocks of one file. The epoch changes whenever
+ * the file's cached data is invalidated, so that fetches that were started
+ * before an invalidation don't put stale data back in the cache.
+ */
+class CachedFile {
+public:
+    unsigned long epoch;
+    map<long, list<CachedBlock>::iterator> blocks;
+    // blocks somebody is fetching from the server right now
+    set<long> fetching;
+};
+
+
+/*
+ * Thread safe LRU cache of file data blocks, keyed by path and block number,
+ * bounded by the total number of bytes cached. Blocks are filled by
+ * readahead and by sequential reads, and are dropped whenever this client
+ * changes the file.
+ *
+ * To fetch a block, call StartFetch, read the block from the server and hand
+ * it to FinishFetch. Readers that want a block that is being fetched wait for
+ * the fetch to finish instead of sending a request of their own.
+ */
+class BlockCache {
+public:
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+
+    BlockCache() {
+        capacity = BLOCK_CACHE_DEFAULT_SIZE;
+        size = 0;
+        next_epoch = 1;
+        hits = 0;
+        misses = 0;
+        evictions = 0;
+
+        pthread_mutex_init(&cache_mutex, NULL);
+        pthread_cond_init(&fetch_done, NULL);
+    }
+
+    ~BlockCache() {
+        pthread_cond_destroy(&fetch_done);
+        pthread_mutex_destroy(&cache_mutex);
+    }
+
+
+    /*
+     * change the size limit of the cache in bytes, 0 disables caching
+     */
+    void Configure(size_t max_bytes) {
+        pthread_mutex_lock(&cache_mutex);
+
+        capacity = max_bytes;
+        while (size > capacity) {
+            Evict();
+        }
+
+        pthread_mutex_unlock(&cache_mutex);
+    }
+
+
+    /*
+     * copy up to count bytes starting at offset within block into dest, waiting
+     * for the block if it is being fetched.
+     *
+     * returns the number of bytes copied, which is short at the end of the
+     * file, or -1 if the block isn't cached
+     */
+    int Read(const string &path, long block, size_t offset, size_t count,
+             char *dest) {
+
+        int res = -1;
+
+        pthread_mutex_lock(&cache_mutex);
+
+        for (;;) {
+            auto file = files.find(path);
+            if (file == files.end()) {
+                break;
+            }
+
+            auto it = file->second.blocks.find(block);
+            if (it != file->second.blocks.end()) {
+                const string &data = it->second->data;
+
+                res = 0;
+                if (offset < data.size()) {
+                    res = min(count, data.size() - offset);
+                    memcpy(dest, data.data() + offset, res);
+                }
+                lru.splice(lru.begin(), lru, it->second);
+                break;
+            }
+
+            if (file->second.fetching.count(block) == 0) {
+                break;
+            }
+
+            pthread_cond_wait(&fetch_done, &cache_mutex);
+        }
+
+        if (res >= 0) {
+            hits++;
+        } else {
+            misses++;
+        }
+
+        pthread_mutex_unlock(&cache_mutex);
+
+        return res;
+    }
+
+
+    /*
+     * claim block for fetching.
+     *
+     * returns false if the block is already cached or being fetched,
+     * otherwise stores the file's epoch in epoch for FinishFetch
+     */
+    bool StartFetch(const string &path, long block, unsigned long *epoch) {
+        bool started = false;
+
+        pthread_mutex_lock(&cache_mutex);
+
+        if (capacity > 0) {
+            CachedFile &file = GetFile(path);
+            if (file.blocks.count(block) == 0 &&
+                file.fetching.count(block) == 0) {
+
+                file.fetching.insert(block);
+                *epoch = file.epoch;
+                started = true;
+            }
+        }
+
+        pthread_mutex_unlock(&cache_mutex);
+
+        return started;
+    }
+
+
+    /*
+     * complete a fetch started with StartFetch. data is the block read from
+     * the server, or NULL if the read failed.
+     */
+    void FinishFetch(const string &path, long block, unsigned long epoch,
+                     const char *data, size_t count) {
+
+        pthread_mutex_lock(&cache_mutex);
+
+        auto file = files.find(path);
+        if (file != files.end()) {
+            file->second.fetching.erase(block);
+
+            // drop the data if the file changed while we were fetching it
+            if (data != NULL && file->second.epoch == epoch) {
+                while (size + count > capacity && !lru.empty()) {
+                    Evict();
+                }
+
+                lru.emplace_front();
+                lru.front().path = path;
+                lru.front().block = block;
+                lru.front().data.assign(data, count);
+                size += count;
+
+                // Evict may have dropped the file entry, look it up again
+                GetFile(path).blocks[block] = lru.begin();
+            } else {
+                ReleaseFile(path);
+            }
+        }
+
+        pthread_cond_broadcast(&fetch_done);
+        pthread_mutex_unlock(&cache_mutex);
+    }
+
+
+    /*
+     * drop all cached blocks of path
+     */
+    void Invalidate(const string &path) {
+        pthread_mutex_lock(&cache_mutex);
+
+        DropFile(path);
+
+        pthread_mutex_unlock(&cache_mutex);
+    }
+
+
+    /*
+     * drop all cached blocks of path and of everything below it
+     */
+    void InvalidateTree(const string &path) {
+        string prefix = path + "/";
+        vector<string> paths;
+
+        pthread_mutex_lock(&cache_mutex);
+
+        for (auto &file : files) {
+            if (file.first == path ||
+                file.first.compare(0, prefix.size(), prefix) == 0) {
+
+                paths.push_back(file.first);
+            }
+        }
+
+        for (auto &file_path : paths) {
+            DropFile(file_path);
+        }
+
+        pthread_mutex_unlock(&cache_mutex);
+    }
+
+
+    void PrintStats(ostream &out) {
+        pthread_mutex_lock(&cache_mutex);
+
+        unsigned long lookups = hits + misses;
+        out << "block cache: " << size << " bytes in " << lru.size()
+            << " blocks, " << hits << " hits, " << misses << " misses ("
+            << (lookups ? (100.0 * hits / lookups) : 0.0) << "% hit rate), "
+            << evictions << " evictions" << endl;
+
+        pthread_mutex_unlock(&cache_mutex);
+    }
+
+
+private:
+    size_t capacity;
+    size_t size;
+    unsigned long next_epoch;
+
+    // most recently used blocks are at the front
+    list<CachedBlock> lru;
+    unordered_map<string, CachedFile> files;
+
+    pthread_mutex_t cache_mutex;
+    pthread_cond_t fetch_done;
+
+
+    // caller holds cache_mutex
+    CachedFile &GetFile(const string &path) {
+        auto it = files.find(path);
+        if (it != files.end()) {
+            return it->second;
+        }
+
+        CachedFile &file = files[path];
+        file.epoch = next_epoch++;
+
+        return file;
+    }
+
+
+    // forget about a file that has nothing cached, caller holds cache_mutex
+    void ReleaseFile(const string &path) {
+        auto it = files.find(path);
+        if (it != files.end() && it->second.blocks.empty() &&
+            it->second.fetching.empty()) {
+
+            files.erase(it);
+        }
+    }
+
+
+    // caller holds cache_mutex
+    void DropFile(const string &path) {
+        auto it = files.find(path);
+        if (it == files.end()) {
+            return;
+        }
+
+        for (auto &block : it->second.blocks) {
+            size -= block.second->data.size();
+            lru.erase(block.second);
+        }
+        it->second.blocks.clear();
+
+        // anything being fetched now is out of date
+        it->second.epoch = next_epoch++;
+
+        ReleaseFile(path);
+    }
+
+
+    // caller holds cache_mutex
+    void Evict() {
+        CachedBlock &victim = lru.back();
+        string path = victim.path;
+
+        files[path].blocks.erase(victim.block);
+        size -= victim.data.size();
+        lru.pop_back();
+        evictions++;
+
+        ReleaseFile(path);
+    }
+};
+
+#endif // __WATFS_BLOCK_CACHE__
@@ -0,0 +1,136 @@
+#include <stdlib.h>
+#include <pthread.h>
+
+#include <atomic>
+#include <map>
+#include <vector>
+
+using namespace std;
+
+#ifndef __WATFS_BUFFER_POOL__
+#define __WATFS_BUFFER_POOL__
+
+
+// buffers are handed out in power of two sizes, starting here
+#define BUFFER_POOL_MIN_SZ          (64 << 10)
+// most memory we keep around in idle buffers
+#define BUFFER_POOL_DEFAULT_MAX     (64 << 20)
+
+
+class BufferPool;
+
+
+/*
+ * A buffer from a BufferPool. It is reference counted so that gRPC slices can
+ * point straight into it; the buffer goes back to the pool once the last
+ * slice is destroyed.
+ */
+class PooledBuffer {
+public:
+    char *data;
+    size_t size;
+    atomic<int> refs;
+    BufferPool *pool;
+};
+
+
+/*
+ * Thread safe pool of large I/O buffers, so bulk reads don't have to malloc
+ * and fault in fresh memory for every request.
+ */
+class BufferPool {
+public:
+    BufferPool(size_t max_idle = BUFFER_POOL_DEFAULT_MAX)
+        : max_idle_bytes(max_idle), idle_bytes(0) {
+
+        pthread_mutex_init(&pool_mutex, NULL);
+    }
+
+    ~BufferPool() {
+        for (auto &size_class : idle) {
+            for (auto buffer : size_class.second) {
+                free(buffer->data);
+                delete buffer;
+            }
+        }
+        pthread_mutex_destroy(&pool_mutex);
+    }
+
+
+    /*
+     * get a buffer of at least size bytes, holding one reference
+     */
+    PooledBuffer *Get(size_t size) {
+        PooledBuffer *buffer = NULL;
+        size_t class_size = BUFFER_POOL_MIN_SZ;
+
+        while (class_size < size) {
+            class_size <<= 1;
+        }
+
+        pthread_mutex_lock(&pool_mutex);
+
+        auto it = idle.find(class_size);
+        if (it != idle.end() && !it->second.empty()) {
+            buffer = it->second.back();
+            it->second.pop_back();
+            idle_bytes -= class_size;
+        }
+
+        pthread_mutex_unlock(&pool_mutex);
+
+        if (buffer == NULL) {
+            buffer = new PooledBuffer();
+            buffer->data = (char *)malloc(class_size);
+            buffer->size = class_size;
+            buffer->pool = this;
+        }
+
+        buffer->refs = 1;
+
+        return buffer;
+    }
+
+
+    /*
+     * drop a reference to buffer, returning it to its pool on the last one.
+     * The signature matches the destroy callback of grpc::Slice.
+     */
+    static void Unref(void *arg) {
+        PooledBuffer *buffer = (PooledBuffer *)arg;
+
+        if (--buffer->refs == 0) {
+            buffer->pool->Put(buffer);
+        }
+    }
+
+
+private:
+    size_t max_idle_bytes;
+    size_t idle_bytes;
+
+    // idle buffers by size
+    map<size_t, vector<PooledBuffer *>> idle;
+
+    pthread_mutex_t pool_mutex;
+
+
+    void Put(PooledBuffer *buffer) {
+        pthread_mutex_lock(&pool_mutex);
+
+        if (idle_bytes + buffer->size <= max_idle_bytes) {
+            idle[buffer->size].push_back(buffer);
+            idle_bytes += buffer->size;
+            buffer = NULL;
+        }
+
+        pthread_mutex_unlock(&pool_mutex);
+
+        if (buffer != NULL) {
+            free(buffer->data);
+            delete buffer;
+        }
+    }
+};
+
+#endif // __WATFS_BUFFER_POOL__
@@ -0,0 +1,164 @@
+#include <pthread.h>
+
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <grpc++/grpc++.h>
+#include <grpcpp/generic/generic_stub.h>
+
+#include "watfs.grpc.pb.h"
+
+using watfs::WatFS;
+
+using grpc::Channel;
+using grpc::GenericStub;
+
+using namespace std;
+
+#ifndef __WATFS_CHANNEL_POOL__
+#define __WATFS_CHANNEL_POOL__
+
+
+#define CHANNEL_POOL_DEFAULT_SIZE       4
+#define CHANNEL_POOL_DEFAULT_ADDRESS    "0.0.0.0:50051"
+
+
+/*
+ * Kinds of traffic that are kept on separate channels, so that a big copy
+ * doesn't hold up the small calls every stat and lookup is waiting for.
+ */
+enum ChannelLane {
+    // unary calls and directory listings
+    METADATA_LANE,
+    // read and write streams
+    BULK_LANE
+};
+
+
+/*
+ * A channel of the pool, with stubs for it and the number of calls using it.
+ */
+class PooledChannel {
+public:
+    shared_ptr<Channel> channel;
+    unique_ptr<WatFS::Stub> stub;
+    unique_ptr<GenericStub> generic_stub;
+    int in_flight;
+    unsigned long calls;
+
+    PooledChannel(shared_ptr<Channel> chan) : channel(chan),
+        stub(WatFS::NewStub(chan)), generic_stub(new GenericStub(chan)),
+        in_flight(0), calls(0) {}
+};
+
+
+/*
+ * Fixed set of channels to the server, each with its own HTTP/2 connection
+ * and so its own TCP congestion window. With more than one channel, the
+ * first carries the metadata lane and the rest the bulk lane. Calls take
+ * the channel of their lane with the fewest calls in flight, going round
+ * the channels on ties.
+ *
+ * Channels are added before the client starts making calls; after that the
+ * pool is thread safe.
+ */
+class ChannelPool {
+public:
+    ChannelPool() : next(0) {
+        pthread_mutex_init(&pool_mutex, NULL);
+    }
+
+    ~ChannelPool() {
+        pthread_mutex_destroy(&pool_mutex);
+    }
+
+
+    /*
+     * open size channels to address. Each one gets a subchannel pool of its
+     * own, or gRPC would put them all on one connection.
+     */
+    void Connect(const string &address, int size,
+                 grpc::ChannelArguments args) {
+        args.SetInt(GRPC_ARG_USE_LOCAL_SUBCHANNEL_POOL, 1);
+
+        for (int i = 0; i < size; i++) {
+            Add(grpc::CreateCustomChannel(address,
+                    grpc::InsecureChannelCredentials(), args));
+        }
+    }
+
+
+    void Add(shared_ptr<Channel> channel) {
+        channels.emplace_back(new PooledChannel(channel));
+    }
+
+
+    /*
+     * pick a channel for a call in lane, and count the call against it
+     * until Release
+     */
+    PooledChannel *Acquire(ChannelLane lane) {
+        size_t first = 0;
+        size_t count = channels.size();
+        PooledChannel *best = NULL;
+
+        if (count > 1) {
+            if (lane == METADATA_LANE) {
+                count = 1;
+            } else {
+                first = 1;
+                count--;
+            }
+        }
+
+        pthread_mutex_lock(&pool_mutex);
+
+        for (size_t i = 0; i < count; i++) {
+            PooledChannel *channel =
+                channels[first + (next + i) % count].get();
+            if (best == NULL || channel->in_flight < best->in_flight) {
+                best = channel;
+            }
+        }
+        next++;
+
+        best->in_flight++;
+        best->calls++;
+
+        pthread_mutex_unlock(&pool_mutex);
+
+        return best;
+    }
+
+
+    void Release(PooledChannel *channel) {
+        pthread_mutex_lock(&pool_mutex);
+        channel->in_flight--;
+        pthread_mutex_unlock(&pool_mutex);
+    }
+
+
+    void PrintStats(ostream &out) {
+        pthread_mutex_lock(&pool_mutex);
+
+        out << "channels:";
+        for (auto &channel : channels) {
+            out << " " << channel->calls;
+        }
+        out << " calls" << endl;
+
+        pthread_mutex_unlock(&pool_mutex);
+    }
+
+
+private:
+    vector<unique_ptr<PooledChannel>> channels;
+    // where the search for the least loaded channel starts
+    size_t next;
+
+    pthread_mutex_t pool_mutex;
+};
+
+#endif // __WATFS_CHANNEL_POOL__
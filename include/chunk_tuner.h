@@ -0,0 +1,189 @@
+#include <pthread.h>
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+
+using namespace std;
+
+#ifndef __WATFS_CHUNK_TUNER__
+#define __WATFS_CHUNK_TUNER__
+
+
+// smallest chunk we ever use, and what old servers that don't negotiate use
+#define CHUNK_MIN_SZ                8192
+// largest chunk we ask for unless told otherwise
+#define CHUNK_DEFAULT_MAX_SZ        (1 << 20)
+// where auto tuning starts before we have any measurements
+#define CHUNK_INITIAL_SZ            (64 << 10)
+// transfers smaller than this say more about latency than throughput
+#define CHUNK_MIN_SAMPLE_SZ         (64 << 10)
+// room for the other fields of a stream message around its data
+#define CHUNK_MESSAGE_OVERHEAD      4096
+// weight of a new sample in the moving averages
+#define CHUNK_EWMA_WEIGHT           0.125
+
+
+/*
+ * Picks the size of the messages we split read and write streams into. The
+ * upper limit is negotiated with the server when we connect. Within that, the
+ * chunk size follows the bandwidth-delay product of the link, estimated from
+ * the latency of small RPCs and the throughput of bulk transfers: big enough
+ * that per-message overhead doesn't dominate on fast links, while still
+ * leaving several messages in flight per round trip. Setting a fixed size
+ * turns tuning off.
+ */
+class ChunkTuner {
+public:
+    ChunkTuner() : max_chunk(CHUNK_DEFAULT_MAX_SZ), fixed_chunk(0),
+                   chunk(CHUNK_INITIAL_SZ), rtt(0), throughput(0) {
+
+        pthread_mutex_init(&tuner_mutex, NULL);
+    }
+
+    ~ChunkTuner() {
+        pthread_mutex_destroy(&tuner_mutex);
+    }
+
+
+    /*
+     * set the largest chunk size we want to use, and optionally a fixed chunk
+     * size (0 to tune automatically)
+     */
+    void Configure(long max_size, long fixed_size) {
+        pthread_mutex_lock(&tuner_mutex);
+
+        max_chunk = max(max_size, (long)CHUNK_MIN_SZ);
+        fixed_chunk = fixed_size;
+        Update();
+
+        pthread_mutex_unlock(&tuner_mutex);
+    }
+
+
+    /*
+     * apply the limit the server agreed to, 0 if it doesn't negotiate
+     */
+    void SetServerMax(long server_max) {
+        pthread_mutex_lock(&tuner_mutex);
+
+        if (server_max <= 0) {
+            server_max = CHUNK_MIN_SZ;
+        }
+        max_chunk = max(min(max_chunk, server_max), (long)CHUNK_MIN_SZ);
+        Update();
+
+        pthread_mutex_unlock(&tuner_mutex);
+    }
+
+
+    long MaxChunkSize() {
+        pthread_mutex_lock(&tuner_mutex);
+        long size = max_chunk;
+        pthread_mutex_unlock(&tuner_mutex);
+
+        return size;
+    }
+
+
+    /*
+     * the chunk size to use for a transfer of total bytes
+     */
+    int ChunkSize(long total) {
+        pthread_mutex_lock(&tuner_mutex);
+        long size = chunk;
+        pthread_mutex_unlock(&tuner_mutex);
+
+        return (int)max(min(size, total), 1L);
+    }
+
+
+    /*
+     * record the time taken by a small RPC, as an estimate of the round trip
+     */
+    void RecordLatency(chrono::steady_clock::duration elapsed) {
+        double seconds = chrono::duration<double>(elapsed).count();
+
+        pthread_mutex_lock(&tuner_mutex);
+
+        rtt = rtt == 0 ? seconds : Average(rtt, seconds);
+        Update();
+
+        pthread_mutex_unlock(&tuner_mutex);
+    }
+
+
+    /*
+     * record a read or write stream of bytes that took elapsed to complete
+     */
+    void RecordTransfer(long bytes, chrono::steady_clock::duration elapsed) {
+        double seconds = chrono::duration<double>(elapsed).count();
+
+        if (bytes < CHUNK_MIN_SAMPLE_SZ || seconds <= 0) {
+            return;
+        }
+
+        pthread_mutex_lock(&tuner_mutex);
+
+        throughput = throughput == 0 ? bytes / seconds :
+                                       Average(throughput, bytes / seconds);
+        Update();
+
+        pthread_mutex_unlock(&tuner_mutex);
+    }
+
+
+    void PrintStats(ostream &out) {
+        pthread_mutex_lock(&tuner_mutex);
+
+        out << "chunk size: " << chunk << " bytes (max " << max_chunk
+            << "), rtt " << rtt * 1000 << " ms, throughput "
+            << throughput / (1 << 20) << " MB/s" << endl;
+
+        pthread_mutex_unlock(&tuner_mutex);
+    }
+
+
+private:
+    long max_chunk;
+    long fixed_chunk;
+    long chunk;
+
+    // moving averages, in seconds and bytes per second
+    double rtt;
+    double throughput;
+
+    pthread_mutex_t tuner_mutex;
+
+
+    static double Average(double average, double sample) {
+        return (1 - CHUNK_EWMA_WEIGHT) * average + CHUNK_EWMA_WEIGHT * sample;
+    }
+
+
+    // caller holds tuner_mutex
+    void Update() {
+        long target;
+
+        if (fixed_chunk > 0) {
+            chunk = min(fixed_chunk, max_chunk);
+            return;
+        }
+
+        if (rtt == 0 || throughput == 0) {
+            target = CHUNK_INITIAL_SZ;
+        } else {
+            // keep about four chunks in flight per round trip
+            target = (long)(throughput * rtt / 4);
+        }
+
+        // round up to a power of two so we don't jitter between sizes
+        chunk = CHUNK_MIN_SZ;
+        while (chunk < target && chunk < max_chunk) {
+            chunk <<= 1;
+        }
+        chunk = min(chunk, max_chunk);
+    }
+};
+
+#endif // __WATFS_CHUNK_TUNER__
@@ -0,0 +1,64 @@
+#include "retry_policy.h"
+#include "watfs.pb.h"
+
+using watfs::WatFSCompoundOp;
+using watfs::WatFSCompoundResult;
+using watfs::WatFSCompoundArgs;
+using watfs::WatFSCompoundRet;
+
+using namespace std;
+
+#ifndef __WATFS_COMPOUND_CALL__
+#define __WATFS_COMPOUND_CALL__
+
+
+// writes up to this size go out with the commit that follows them
+#define COMPOUND_MAX_WRITE_SZ   (64 << 10)
+
+
+/*
+ * A sequence of operations sent to the server as one WatFSCompound call.
+ * Ops are added in the order the server should run them, each with the
+ * retry class of the call it stands for; the compound as a whole is only
+ * retried as far as its least repeatable op allows.
+ *
+ *     CompoundCall compound;
+ *     compound.Add(RETRY_NON_IDEMPOTENT)->mutable_mknod()->set_path(path);
+ *     compound.Add(RETRY_IDEMPOTENT)->mutable_open()->set_file_path(path);
+ *     status = client->RunCompound(&compound);
+ */
+class CompoundCall {
+public:
+    WatFSCompoundArgs args;
+    WatFSCompoundRet ret;
+    RetryClass retry_class;
+
+    CompoundCall() : retry_class(RETRY_IDEMPOTENT) {}
+
+
+    /*
+     * returns a new op at the end of the compound for the caller to fill in
+     */
+    WatFSCompoundOp *Add(RetryClass op_class) {
+        // a compound is never hedged, it may hold writes
+        if (op_class == RETRY_NON_IDEMPOTENT) {
+            retry_class = RETRY_NON_IDEMPOTENT;
+        }
+
+        return args.add_ops();
+    }
+
+
+    /*
+     * returns the result of op index, or NULL if the server stopped before
+     * running it
+     */
+    const WatFSCompoundResult *Result(int index) {
+        if (index >= ret.results_size()) {
+            return NULL;
+        }
+        return &ret.results(index);
+    }
+};
+
+#endif // __WATFS_COMPOUND_CALL__
@@ -0,0 +1,501 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/openat2.h>
+
+#include <list>
+#include <string>
+#include <unordered_map>
+
+using namespace std;
+
+#ifndef __WATFS_DIR_FD_CACHE__
+#define __WATFS_DIR_FD_CACHE__
+
+
+// directories held open at once, besides the root
+#define DIR_FD_CACHE_DEFAULT_SIZE   256
+
+
+/*
+ * Opens of a path that are in progress, and the generation they started in.
+ * Invalidating the path moves it to a new generation, so that a descriptor
+ * opened before an unlink or rename isn't cached after it.
+ */
+class PendingOpen {
+public:
+    unsigned long generation;
+    int opens;
+};
+
+
+/*
+ * An O_PATH descriptor for the directory at server path path. refs and stale
+ * work like they do for FdCacheEntry.
+ */
+class DirFdEntry {
+public:
+    string path;
+    int fd;
+    int refs;
+    bool stale;
+};
+
+
+/*
+ * Bounded, thread safe LRU cache of descriptors for directories under the
+ * export root, keyed by server path. The server resolves the last component
+ * of a path relative to its directory's descriptor with the *at system
+ * calls, so the kernel doesn't walk the whole path from / on every request,
+ * and a directory that isn't cached is opened relative to its closest cached
+ * ancestor.
+ *
+ * Directories are opened with openat2 and RESOLVE_BENEATH where the kernel
+ * has it, so neither .. nor a symbolic link can take a lookup out of the
+ * export, and paths with .. components are refused outright. Symbolic links
+ * in the last component of a path are followed as before.
+ *
+ * Like the FdCache, descriptors follow their directories when they are
+ * renamed, so the server invalidates them when it renames or removes a
+ * directory, or inotify tells the stat cache that somebody else did.
+ */
+class DirFdCache {
+public:
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+
+    DirFdCache() {
+        Init(DIR_FD_CACHE_DEFAULT_SIZE);
+    }
+
+    explicit DirFdCache(size_t max_entries) {
+        Init(max_entries);
+    }
+
+    ~DirFdCache() {
+        for (auto entry : lru) {
+            close(entry->fd);
+            delete entry;
+        }
+        if (root.fd != -1) {
+            close(root.fd);
+        }
+        pthread_mutex_destroy(&cache_mutex);
+    }
+
+
+    /*
+     * open the export root, root_dir, which everything is resolved under.
+     *
+     * returns 0 on success or -errno
+     */
+    int Open(const string &root_dir) {
+        // an export of / has an empty root path
+        root.path = root_dir;
+        root.fd = open(root_dir.empty() ? "/" : root_dir.c_str(),
+                       O_PATH | O_DIRECTORY | O_CLOEXEC);
+        if (root.fd == -1) {
+            return -errno;
+        }
+
+        return 0;
+    }
+
+
+    const string &Root() {
+        return root.path;
+    }
+
+
+    /*
+     * get a descriptor for the directory at server path dir, opening it if
+     * it isn't cached.
+     *
+     * returns the entry on success, or NULL on failure with errno set:
+     * EACCES if dir isn't the root or below it, or has a .. component
+     */
+    DirFdEntry *Acquire(const string &dir) {
+        DirFdEntry *entry;
+        DirFdEntry *base;
+        int fd;
+
+        if (root.fd == -1 || !Beneath(dir)) {
+            errno = EACCES;
+            return NULL;
+        }
+
+        for (;;) {
+            pthread_mutex_lock(&cache_mutex);
+
+            if (dir == root.path) {
+                root.refs++;
+                pthread_mutex_unlock(&cache_mutex);
+                return &root;
+            }
+
+            entry = Find(dir);
+            if (entry != NULL) {
+                hits++;
+                pthread_mutex_unlock(&cache_mutex);
+                return entry;
+            }
+
+            misses++;
+
+            // start from the deepest directory above it we have open
+            base = &root;
+            for (size_t pos = dir.find_last_of('/'); pos > root.path.size();
+                 pos = dir.find_last_of('/', pos - 1)) {
+
+                DirFdEntry *above = Find(dir.substr(0, pos));
+                if (above != NULL) {
+                    base = above;
+                    break;
+                }
+            }
+
+            unsigned long generation = StartOpen(dir);
+
+            pthread_mutex_unlock(&cache_mutex);
+
+            // don't hold the lock across the open, it can be slow
+            fd = OpenBeneath(base->fd, dir.c_str() + base->path.size() + 1);
+
+            // a symbolic link may lead out of base and back in under the
+            // root
+            if (fd == -1 && errno == EXDEV && base != &root) {
+                fd = OpenBeneath(root.fd, dir.c_str() + root.path.size() + 1);
+            }
+
+            int err = errno;
+
+            pthread_mutex_lock(&cache_mutex);
+
+            if (base != &root) {
+                Put(base);
+            }
+
+            bool current = FinishOpen(dir, generation);
+
+            if (fd == -1) {
+                pthread_mutex_unlock(&cache_mutex);
+                errno = err;
+                return NULL;
+            }
+
+            // the directory or one above it was renamed or removed while we
+            // were opening it, we may have the one that used to be there
+            if (!current) {
+                pthread_mutex_unlock(&cache_mutex);
+                close(fd);
+                continue;
+            }
+
+            // somebody may have opened the same directory while we weren't
+            // looking
+            entry = Find(dir);
+            if (entry != NULL) {
+                pthread_mutex_unlock(&cache_mutex);
+                close(fd);
+                return entry;
+            }
+
+            break;
+        }
+
+        EvictIdle(capacity > 0 ? capacity - 1 : 0);
+
+        entry = new DirFdEntry();
+        entry->path = dir;
+        entry->fd = fd;
+        entry->refs = 1;
+        entry->stale = false;
+
+        lru.push_front(entry);
+        entries[dir] = lru.begin();
+
+        pthread_mutex_unlock(&cache_mutex);
+
+        return entry;
+    }
+
+
+    /*
+     * give back an entry returned by Acquire
+     */
+    void Release(DirFdEntry *entry) {
+        pthread_mutex_lock(&cache_mutex);
+        Put(entry);
+        pthread_mutex_unlock(&cache_mutex);
+    }
+
+
+    /*
+     * drop the descriptors for dir and every directory below it, they are
+     * closed once no longer in use
+     */
+    void InvalidateTree(const string &dir) {
+        string prefix = dir + "/";
+
+        pthread_mutex_lock(&cache_mutex);
+
+        for (auto &pending : opening) {
+            if (pending.first == dir ||
+                pending.first.compare(0, prefix.size(), prefix) == 0) {
+
+                pending.second.generation = next_generation++;
+            }
+        }
+
+        for (auto it = lru.begin(); it != lru.end(); ) {
+            if ((*it)->path == dir ||
+                (*it)->path.compare(0, prefix.size(), prefix) == 0) {
+
+                it = Remove(it);
+            } else {
+                ++it;
+            }
+        }
+
+        pthread_mutex_unlock(&cache_mutex);
+    }
+
+
+private:
+    size_t capacity;
+
+    // never evicted, and not in lru
+    DirFdEntry root;
+
+    // most recently used entries are at the front
+    list<DirFdEntry *> lru;
+    unordered_map<string, list<DirFdEntry *>::iterator> entries;
+
+    // directories being opened
+    unordered_map<string, PendingOpen> opening;
+    unsigned long next_generation;
+
+    // cleared the first time openat2 turns out to be missing
+    bool have_openat2;
+
+    pthread_mutex_t cache_mutex;
+
+
+    void Init(size_t max_entries) {
+        capacity = max_entries;
+        next_generation = 1;
+        hits = 0;
+        misses = 0;
+        evictions = 0;
+
+        root.fd = -1;
+        root.refs = 0;
+        root.stale = false;
+
+        have_openat2 = true;
+
+        pthread_mutex_init(&cache_mutex, NULL);
+    }
+
+
+    /*
+     * returns whether dir is the root or a path below it without empty or ..
+     * components, so that what follows the root path of any ancestor is a
+     * relative path down to it
+     */
+    bool Beneath(const string &dir) {
+        if (dir.compare(0, root.path.size(), root.path) != 0) {
+            return false;
+        }
+        if (dir.size() == root.path.size()) {
+            return true;
+        }
+
+        string below = dir.substr(root.path.size()) + "/";
+        return below[0] == '/' && below.size() > 2 &&
+               below.find("//") == string::npos &&
+               below.find("/../") == string::npos;
+    }
+
+
+    /*
+     * open the directory at name below dirfd.
+     *
+     * returns the descriptor, or -1 with errno set
+     */
+    int OpenBeneath(int dirfd, const char *name) {
+#ifdef SYS_openat2
+        if (have_openat2) {
+            struct open_how how;
+
+            memset(&how, 0, sizeof how);
+            how.flags = O_PATH | O_DIRECTORY | O_CLOEXEC;
+            how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+
+            int fd = syscall(SYS_openat2, dirfd, name, &how, sizeof how);
+            if (fd != -1 || errno != ENOSYS) {
+                return fd;
+            }
+
+            // an older kernel, .. was ruled out by Beneath at least
+            have_openat2 = false;
+        }
+#endif
+
+        return openat(dirfd, name, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    }
+
+
+    /*
+     * note an open of dir, and return the generation it starts in. Caller
+     * holds cache_mutex.
+     */
+    unsigned long StartOpen(const string &dir) {
+        PendingOpen &pending = opening[dir];
+        if (pending.opens++ == 0) {
+            pending.generation = next_generation++;
+        }
+        return pending.generation;
+    }
+
+
+    /*
+     * note the end of an open of dir started in generation. Caller holds
+     * cache_mutex.
+     *
+     * returns false if dir was invalidated since
+     */
+    bool FinishOpen(const string &dir, unsigned long generation) {
+        auto pending = opening.find(dir);
+        bool current = pending->second.generation == generation;
+
+        if (--pending->second.opens == 0) {
+            opening.erase(pending);
+        }
+
+        return current;
+    }
+
+
+    // caller holds cache_mutex, takes a reference on a hit
+    DirFdEntry *Find(const string &dir) {
+        auto it = entries.find(dir);
+        if (it == entries.end()) {
+            return NULL;
+        }
+
+        lru.splice(lru.begin(), lru, it->second);
+        (*it->second)->refs++;
+
+        return *it->second;
+    }
+
+
+    // caller holds cache_mutex
+    void Put(DirFdEntry *entry) {
+        entry->refs--;
+        if (entry->refs == 0 && entry->stale) {
+            close(entry->fd);
+            delete entry;
+        } else if (entry->refs == 0 && lru.size() > capacity) {
+            EvictIdle(capacity);
+        }
+    }
+
+
+    // caller holds cache_mutex, returns the next position in lru
+    list<DirFdEntry *>::iterator Remove(list<DirFdEntry *>::iterator it) {
+        DirFdEntry *entry = *it;
+
+        entries.erase(entry->path);
+        if (entry->refs == 0) {
+            close(entry->fd);
+            delete entry;
+        } else {
+            entry->stale = true;
+        }
+
+        return lru.erase(it);
+    }
+
+
+    /*
+     * close least recently used descriptors that aren't in use until at most
+     * target remain. Caller holds cache_mutex.
+     */
+    void EvictIdle(size_t target) {
+        auto it = lru.end();
+        while (lru.size() > target && it != lru.begin()) {
+            --it;
+            if ((*it)->refs == 0) {
+                it = Remove(it);
+                evictions++;
+            }
+        }
+    }
+};
+
+
+/*
+ * The directory holding a server path, and the last component of the path
+ * to resolve relative to it, held for as long as this is in scope:
+ *
+ *     ParentDir parent(&dir_fds, path);
+ *     if (parent.fd == -1) {
+ *         return errno;
+ *     }
+ *     unlinkat(parent.fd, parent.name, 0);
+ *
+ * The root, with or without a trailing slash, resolves to itself and ".".
+ */
+class ParentDir {
+public:
+    int fd;
+    const char *name;
+
+    ParentDir(DirFdCache *dir_cache, const string &path) :
+        fd(-1), name(NULL), cache(dir_cache), dir(NULL) {
+
+        const string &root_dir = cache->Root();
+        size_t pos = path.find_last_of('/');
+
+        if (path == root_dir || path == root_dir + "/") {
+            dir = cache->Acquire(root_dir);
+            base = ".";
+        } else if (pos == string::npos || pos < root_dir.size() ||
+                   pos == path.size() - 1) {
+            errno = EACCES;
+            return;
+        } else {
+            base = path.substr(pos + 1);
+            if (base == "..") {
+                errno = EACCES;
+                return;
+            }
+            dir = cache->Acquire(path.substr(0, pos));
+        }
+
+        if (dir != NULL) {
+            fd = dir->fd;
+            name = base.c_str();
+        }
+    }
+
+    ~ParentDir() {
+        if (dir != NULL) {
+            cache->Release(dir);
+        }
+    }
+
+
+private:
+    DirFdCache *cache;
+    DirFdEntry *dir;
+    string base;
+};
+
+#endif // __WATFS_DIR_FD_CACHE__
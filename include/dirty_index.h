@@ -0,0 +1,510 @@
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "write_journal.h"
+
+using namespace std;
+
+#ifndef __WATFS_DIRTY_INDEX__
+#define __WATFS_DIRTY_INDEX__
+
+
+// number of independently locked parts of the index
+#define DIRTY_INDEX_SHARDS          16
+// cap on uncommitted data before writers have to commit, 0 for no cap
+#define DIRTY_DEFAULT_MAX           (256 << 20)
+// times a commit resends a file's writes to restarted servers before it
+// gives up
+#define DIRTY_MAX_RESENDS           4
+
+
+/*
+ * A run of dirty bytes of a file, held either in memory or in the journal.
+ */
+class DirtyRange {
+public:
+    long size;
+    string data;
+    // where the bytes are in the journal, -1 if they are in data
+    long journal_offset;
+
+    DirtyRange() : size(0), journal_offset(-1) {}
+};
+
+
+/*
+ * Uncommitted data of one file as non-overlapping ranges keyed by offset.
+ * A write replaces whatever it overlaps, so each byte is kept once, with the
+ * latest data written to it, and touching ranges are merged where that is
+ * cheap.
+ */
+class DirtyFile {
+public:
+    map<long, DirtyRange> ranges;
+    size_t bytes;
+    // bumped on every change, so a commit can tell if more data arrived
+    unsigned long version;
+    // verf of the server our writes went to, 0 before the first reply
+    long verf;
+    // set if the writes went to more than one server instance
+    bool verf_mixed;
+
+    DirtyFile() : bytes(0), version(0), verf(0), verf_mixed(false) {}
+};
+
+
+/*
+ * Thread safe index of the data this client has written but not committed,
+ * used to resend a file's writes after a server crash. Files are spread over
+ * shards by path, each with its own lock, so writers of different files
+ * don't contend.
+ *
+ * The data is kept on the heap, or in a WriteJournal if one is set, falling
+ * back to the heap when the journal is full.
+ */
+class DirtyIndex {
+public:
+    DirtyIndex() : journal(NULL), total_bytes(0) {
+        for (int i = 0; i < DIRTY_INDEX_SHARDS; i++) {
+            pthread_mutex_init(&shards[i].shard_mutex, NULL);
+        }
+    }
+
+    ~DirtyIndex() {
+        for (int i = 0; i < DIRTY_INDEX_SHARDS; i++) {
+            pthread_mutex_destroy(&shards[i].shard_mutex);
+        }
+    }
+
+
+    /*
+     * keep data in write_journal from now on, must be called before the first
+     * Add
+     */
+    void SetJournal(WriteJournal *write_journal) {
+        journal = write_journal;
+    }
+
+
+    /*
+     * returns the number of uncommitted bytes in the index
+     */
+    long Bytes() {
+        return total_bytes;
+    }
+
+
+    /*
+     * record a write of size bytes of data at offset into path
+     */
+    void Add(const string &path, long offset, const char *data, long size) {
+        Shard &shard = GetShard(path);
+
+        pthread_mutex_lock(&shard.shard_mutex);
+
+        DirtyFile &file = shard.files[path];
+        long end = offset + size;
+
+        file.version++;
+
+        // appends and overwrites within one range are done in place
+        auto next_range = file.ranges.upper_bound(offset);
+        if (next_range != file.ranges.begin() &&
+            (next_range == file.ranges.end() || next_range->first > end)) {
+
+            auto before = prev(next_range);
+            DirtyRange &range = before->second;
+            long range_end = before->first + range.size;
+
+            if (range.journal_offset == -1 && range_end >= offset) {
+                if (end > range_end) {
+                    Grow(file, end - range_end);
+                    range.size = end - before->first;
+                    range.data.resize(range.size);
+                }
+                memcpy(&range.data[offset - before->first], data, size);
+
+                pthread_mutex_unlock(&shard.shard_mutex);
+                return;
+            }
+
+            if (range.journal_offset != -1 && range_end == offset &&
+                journal->Extend(range.journal_offset + range.size, data,
+                                size)) {
+
+                Grow(file, size);
+                range.size += size;
+
+                pthread_mutex_unlock(&shard.shard_mutex);
+                return;
+            }
+        }
+
+        Punch(file, offset, end);
+
+        DirtyRange range;
+        range.size = size;
+        if (journal != NULL) {
+            range.journal_offset = journal->Append(data, size);
+        }
+        if (range.journal_offset == -1) {
+            range.data.assign(data, size);
+        }
+        Grow(file, size);
+
+        if (range.journal_offset == -1) {
+            // pull in a heap range that starts where we end
+            auto after = file.ranges.find(end);
+            if (after != file.ranges.end() &&
+                after->second.journal_offset == -1) {
+
+                range.data.append(after->second.data);
+                range.size += after->second.size;
+                file.ranges.erase(after);
+            }
+
+            // and append to one that ends where we start
+            auto before = file.ranges.lower_bound(offset);
+            if (before != file.ranges.begin()) {
+                before = prev(before);
+                if (before->second.journal_offset == -1 &&
+                    before->first + before->second.size == offset) {
+
+                    before->second.data.append(range.data);
+                    before->second.size += range.size;
+
+                    pthread_mutex_unlock(&shard.shard_mutex);
+                    return;
+                }
+            }
+        }
+
+        swap(file.ranges[offset], range);
+
+        pthread_mutex_unlock(&shard.shard_mutex);
+    }
+
+
+    /*
+     * remember the verf of the server that accepted a write to path
+     */
+    void RecordVerf(const string &path, long verf) {
+        Shard &shard = GetShard(path);
+
+        pthread_mutex_lock(&shard.shard_mutex);
+
+        auto it = shard.files.find(path);
+        if (it != shard.files.end()) {
+            DirtyFile &file = it->second;
+            if (file.verf != 0 && file.verf != verf) {
+                file.verf_mixed = true;
+            }
+            file.verf = verf;
+        }
+
+        pthread_mutex_unlock(&shard.shard_mutex);
+    }
+
+
+    /*
+     * returns whether path has uncommitted data, and if so its current
+     * version for Clean
+     */
+    bool Dirty(const string &path, unsigned long *version) {
+        Shard &shard = GetShard(path);
+        bool dirty = false;
+
+        pthread_mutex_lock(&shard.shard_mutex);
+
+        auto it = shard.files.find(path);
+        if (it != shard.files.end()) {
+            *version = it->second.version;
+            dirty = true;
+        }
+
+        pthread_mutex_unlock(&shard.shard_mutex);
+
+        return dirty;
+    }
+
+
+    /*
+     * returns whether all writes to path went to the server with this verf,
+     * so a commit it answered covers them. A file truncated down to no data
+     * has nothing left to resend, so any server covers it.
+     */
+    bool SentTo(const string &path, long verf) {
+        Shard &shard = GetShard(path);
+        bool sent = true;
+
+        pthread_mutex_lock(&shard.shard_mutex);
+
+        auto it = shard.files.find(path);
+        if (it != shard.files.end() && !it->second.ranges.empty()) {
+            sent = !it->second.verf_mixed && it->second.verf == verf;
+        }
+
+        pthread_mutex_unlock(&shard.shard_mutex);
+
+        return sent;
+    }
+
+
+    /*
+     * copy the dirty ranges of path into ranges for resending, and forget
+     * which server they were sent to
+     */
+    void TakeForResend(const string &path, vector<pair<long, string>> *ranges) {
+        Shard &shard = GetShard(path);
+
+        ranges->clear();
+
+        pthread_mutex_lock(&shard.shard_mutex);
+
+        auto it = shard.files.find(path);
+        if (it != shard.files.end()) {
+            for (auto &range : it->second.ranges) {
+                ranges->emplace_back(range.first,
+                                     string(Data(range.second),
+                                            range.second.size));
+            }
+            it->second.verf = 0;
+            it->second.verf_mixed = false;
+        }
+
+        pthread_mutex_unlock(&shard.shard_mutex);
+    }
+
+
+    /*
+     * forget the data of path after a commit, unless more was written since
+     * Dirty returned version
+     */
+    void Clean(const string &path, unsigned long version) {
+        Shard &shard = GetShard(path);
+
+        pthread_mutex_lock(&shard.shard_mutex);
+
+        auto it = shard.files.find(path);
+        if (it != shard.files.end() && it->second.version == version) {
+            DropFile(it->second);
+            shard.files.erase(it);
+        }
+
+        pthread_mutex_unlock(&shard.shard_mutex);
+    }
+
+
+    /*
+     * drop the data of path past size after a truncate
+     */
+    void Truncate(const string &path, long size) {
+        Shard &shard = GetShard(path);
+
+        pthread_mutex_lock(&shard.shard_mutex);
+
+        auto it = shard.files.find(path);
+        if (it != shard.files.end()) {
+            Punch(it->second, size, LONG_MAX);
+            it->second.version++;
+        }
+
+        pthread_mutex_unlock(&shard.shard_mutex);
+    }
+
+
+    /*
+     * drop the data of path, e.g. when it is unlinked
+     */
+    void Remove(const string &path) {
+        Shard &shard = GetShard(path);
+
+        pthread_mutex_lock(&shard.shard_mutex);
+
+        auto it = shard.files.find(path);
+        if (it != shard.files.end()) {
+            DropFile(it->second);
+            shard.files.erase(it);
+        }
+
+        pthread_mutex_unlock(&shard.shard_mutex);
+    }
+
+
+    /*
+     * move the data of from and everything below it to to, replacing what
+     * was there
+     */
+    void Rename(const string &from, const string &to) {
+        vector<pair<string, DirtyFile>> moved;
+
+        for (int i = 0; i < DIRTY_INDEX_SHARDS; i++) {
+            Shard &shard = shards[i];
+
+            pthread_mutex_lock(&shard.shard_mutex);
+
+            for (auto it = shard.files.begin(); it != shard.files.end();) {
+                if (InTree(it->first, from)) {
+                    moved.emplace_back(to + it->first.substr(from.size()),
+                                       it->second);
+                    it = shard.files.erase(it);
+                } else if (InTree(it->first, to)) {
+                    DropFile(it->second);
+                    it = shard.files.erase(it);
+                } else {
+                    it++;
+                }
+            }
+
+            pthread_mutex_unlock(&shard.shard_mutex);
+        }
+
+        for (auto &file : moved) {
+            Shard &shard = GetShard(file.first);
+
+            pthread_mutex_lock(&shard.shard_mutex);
+            DirtyFile &moved_file = shard.files[file.first];
+            moved_file = file.second;
+            moved_file.version++;
+            pthread_mutex_unlock(&shard.shard_mutex);
+        }
+    }
+
+
+    /*
+     * returns the paths with uncommitted data
+     */
+    vector<string> Paths() {
+        vector<string> paths;
+
+        for (int i = 0; i < DIRTY_INDEX_SHARDS; i++) {
+            pthread_mutex_lock(&shards[i].shard_mutex);
+            for (auto &file : shards[i].files) {
+                paths.push_back(file.first);
+            }
+            pthread_mutex_unlock(&shards[i].shard_mutex);
+        }
+
+        return paths;
+    }
+
+
+private:
+    class Shard {
+    public:
+        unordered_map<string, DirtyFile> files;
+        pthread_mutex_t shard_mutex;
+    };
+
+    Shard shards[DIRTY_INDEX_SHARDS];
+
+    WriteJournal *journal;
+    atomic<long> total_bytes;
+
+
+    const char *Data(const DirtyRange &range) {
+        if (range.journal_offset == -1) {
+            return range.data.data();
+        }
+        return journal->Get(range.journal_offset);
+    }
+
+
+    // caller holds the shard's lock for all of the below
+    void Grow(DirtyFile &file, long bytes) {
+        file.bytes += bytes;
+        total_bytes += bytes;
+    }
+
+
+    void Shrink(DirtyFile &file, DirtyRange &range, long bytes) {
+        file.bytes -= bytes;
+        total_bytes -= bytes;
+        if (range.journal_offset != -1) {
+            journal->Release(bytes);
+        }
+    }
+
+
+    void DropFile(DirtyFile &file) {
+        for (auto &range : file.ranges) {
+            Shrink(file, range.second, range.second.size);
+        }
+        file.ranges.clear();
+    }
+
+
+    /*
+     * remove [start, end) from the ranges of file, splitting the ones that
+     * stick out on either side
+     */
+    void Punch(DirtyFile &file, long start, long end) {
+        auto it = file.ranges.upper_bound(start);
+        if (it != file.ranges.begin()) {
+            auto before = prev(it);
+            if (before->first + before->second.size > start) {
+                it = before;
+            }
+        }
+
+        while (it != file.ranges.end() && it->first < end) {
+            long range_start = it->first;
+            DirtyRange &range = it->second;
+            long range_end = range_start + range.size;
+
+            if (range_end > end) {
+                // keep the part after end as a range of its own
+                DirtyRange &tail = file.ranges[end];
+                tail.size = range_end - end;
+                if (range.journal_offset != -1) {
+                    tail.journal_offset = range.journal_offset +
+                                          (end - range_start);
+                } else {
+                    tail.data = range.data.substr(end - range_start);
+                }
+
+                range.size -= tail.size;
+                if (range.journal_offset == -1) {
+                    range.data.resize(range.size);
+                }
+            }
+
+            if (range_start < start) {
+                // keep the part before start
+                Shrink(file, range, range.size - (start - range_start));
+                range.size = start - range_start;
+                if (range.journal_offset == -1) {
+                    range.data.resize(range.size);
+                }
+                it++;
+            } else {
+                Shrink(file, range, range.size);
+                it = file.ranges.erase(it);
+            }
+        }
+    }
+
+
+    static bool InTree(const string &path, const string &root) {
+        return path.compare(0, root.size(), root) == 0 &&
+               (path.size() == root.size() || path[root.size()] == '/');
+    }
+
+
+    Shard &GetShard(const string &path) {
+        return shards[hash<string>()(path) % DIRTY_INDEX_SHARDS];
+    }
+};
+
+#endif // __WATFS_DIRTY_INDEX__
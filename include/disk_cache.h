@@ -0,0 +1,550 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <iostream>
+#include <list>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "block_cache.h"
+#include "storage_backend.h"
+
+using namespace std;
+
+#ifndef __WATFS_DISK_CACHE__
+#define __WATFS_DISK_CACHE__
+
+
+#define DISK_CACHE_DEFAULT_SIZE     (1L << 30)
+
+// "WATFSDC" and the layout version, a mismatch starts the cache over
+#define DISK_CACHE_MAGIC            0x0043445346544157UL
+#define DISK_CACHE_VERSION          1
+
+// states of a slot in the index
+#define DISK_SLOT_FREE              0
+#define DISK_SLOT_VALID             1
+// being filled, treated as free after a restart
+#define DISK_SLOT_WRITING           2
+
+
+/*
+ * Layout of the start of the index file. Both structs live in a shared
+ * mapping of the file, so they are only ever updated in place.
+ */
+struct DiskCacheHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t block_size;
+    uint64_t slots;
+    // bumped on every use, orders the slots from least to most recently used
+    uint64_t clock;
+};
+
+
+/*
+ * Index entry of a slot in the blocks file, which holds block block of the
+ * file whose path hashes to path_hash, as it was when the file had the
+ * validator fields as attributes.
+ */
+struct DiskCacheSlot {
+    uint64_t path_hash;
+    int64_t block;
+    uint32_t length;
+    uint32_t state;
+    uint64_t checksum;
+    uint64_t ino;
+    int64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    int64_t ctime_sec;
+    int64_t ctime_nsec;
+    uint64_t last_used;
+};
+
+
+/*
+ * Thread safe LRU cache of file blocks in a local directory, which survives
+ * unmounts so that a remount starts warm. The directory holds two files: a
+ * blocks file of fixed size slots, one BLOCK_SZ block each, and an index
+ * with an entry per slot. The index is mapped into memory, so opening the
+ * cache is one mmap and a scan of the entries; the data stays on disk until
+ * it is read.
+ *
+ * Blocks are keyed by a hash of the file's path and the block number, and
+ * stored with the attributes the file had when the block was fetched: its
+ * inode, size, mtime and ctime. A block is only used if the file still has
+ * those attributes, which the caller gets with a getattr before using it.
+ * Blocks of a file that turns out to have changed are dropped. The inode in
+ * the validator also keeps two paths whose hashes collide apart.
+ *
+ * A checksum of each block is kept in the index and checked on every read,
+ * so a block that didn't make it to disk before a crash, or that a
+ * concurrent write is replacing, is a miss rather than bad data. Only one
+ * client can use a cache directory at a time.
+ */
+class DiskCache {
+public:
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+
+    DiskCache() : hits(0), misses(0), evictions(0), index_fd(-1),
+                  blocks_fd(-1), header(NULL), slots(NULL), index_size(0) {
+
+        pthread_mutex_init(&cache_mutex, NULL);
+    }
+
+    ~DiskCache() {
+        if (header != NULL) {
+            msync(header, index_size, MS_SYNC);
+            munmap(header, index_size);
+        }
+        if (blocks_fd != -1) {
+            close(blocks_fd);
+        }
+        if (index_fd != -1) {
+            close(index_fd);
+        }
+        pthread_mutex_destroy(&cache_mutex);
+    }
+
+
+    /*
+     * use the cache in directory dir, holding up to max_bytes of blocks. What
+     * an earlier client left there is picked up, unless it was laid out for
+     * a different size.
+     *
+     * returns 0 on success, or -errno on error, in which case nothing is
+     * cached
+     */
+    int Open(const string &dir, size_t max_bytes) {
+        uint64_t nslots = max_bytes / BLOCK_SZ;
+
+        if (nslots == 0) {
+            return 0;
+        }
+
+        index_fd = open((dir + "/index").c_str(),
+                        O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        if (index_fd == -1) {
+            return -errno;
+        }
+
+        // another mount using the same directory would overwrite our slots
+        if (flock(index_fd, LOCK_EX | LOCK_NB) == -1) {
+            return Fail(errno == EWOULDBLOCK ? -EBUSY : -errno);
+        }
+
+        blocks_fd = open((dir + "/blocks").c_str(),
+                         O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        if (blocks_fd == -1) {
+            return Fail(-errno);
+        }
+
+        index_size = sizeof(DiskCacheHeader) + nslots * sizeof(DiskCacheSlot);
+
+        struct stat st;
+        if (fstat(index_fd, &st) == -1) {
+            return Fail(-errno);
+        }
+        bool fresh = (size_t)st.st_size != index_size;
+
+        // sparse, space is only used as slots fill
+        if (ftruncate(index_fd, index_size) == -1 ||
+            ftruncate(blocks_fd, nslots * BLOCK_SZ) == -1) {
+            return Fail(-errno);
+        }
+
+        void *map = mmap(NULL, index_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                         index_fd, 0);
+        if (map == MAP_FAILED) {
+            return Fail(-errno);
+        }
+        header = (DiskCacheHeader *)map;
+        slots = (DiskCacheSlot *)(header + 1);
+
+        if (fresh || header->magic != DISK_CACHE_MAGIC ||
+            header->version != DISK_CACHE_VERSION ||
+            header->block_size != BLOCK_SZ || header->slots != nslots) {
+
+            memset(map, 0, index_size);
+            header->magic = DISK_CACHE_MAGIC;
+            header->version = DISK_CACHE_VERSION;
+            header->block_size = BLOCK_SZ;
+            header->slots = nslots;
+        }
+
+        Load();
+
+        return 0;
+    }
+
+
+    /*
+     * returns whether Open succeeded
+     */
+    bool Enabled() {
+        return header != NULL;
+    }
+
+
+    /*
+     * read block of path into data, if we have it as it was when the file
+     * had attributes attr.
+     *
+     * returns true on a hit
+     */
+    bool Read(const string &path, const struct stat &attr, long block,
+              string *data) {
+        uint64_t hash = Hash(path.data(), path.size());
+        DiskCacheSlot entry;
+        uint32_t slot;
+
+        if (!Enabled()) {
+            return false;
+        }
+
+        pthread_mutex_lock(&cache_mutex);
+
+        if (!Find(hash, block, &slot)) {
+            misses++;
+            pthread_mutex_unlock(&cache_mutex);
+            return false;
+        }
+
+        if (!Matches(slots[slot], attr)) {
+            // the file changed, nothing we have of it is any good
+            DropStale(hash, attr);
+            misses++;
+            pthread_mutex_unlock(&cache_mutex);
+            return false;
+        }
+
+        Touch(slot);
+        entry = slots[slot];
+
+        pthread_mutex_unlock(&cache_mutex);
+
+        data->resize(entry.length);
+        ssize_t res = pread_full(blocks_fd, &(*data)[0], entry.length,
+                                 (off_t)slot * BLOCK_SZ);
+
+        // a torn or reused slot
+        if (res != entry.length ||
+            Hash(data->data(), data->size()) != entry.checksum) {
+
+            pthread_mutex_lock(&cache_mutex);
+            if (slots[slot].state == DISK_SLOT_VALID &&
+                slots[slot].checksum == entry.checksum) {
+                Drop(slot);
+            }
+            misses++;
+            pthread_mutex_unlock(&cache_mutex);
+            return false;
+        }
+
+        pthread_mutex_lock(&cache_mutex);
+        hits++;
+        pthread_mutex_unlock(&cache_mutex);
+
+        return true;
+    }
+
+
+    /*
+     * keep block of path, fetched after the file was found to have
+     * attributes attr, replacing any older copy of the block
+     */
+    void Write(const string &path, const struct stat &attr, long block,
+               const string &data) {
+        uint64_t hash = Hash(path.data(), path.size());
+        uint32_t slot;
+
+        if (!Enabled() || data.size() > BLOCK_SZ) {
+            return;
+        }
+
+        pthread_mutex_lock(&cache_mutex);
+
+        if (Find(hash, block, &slot)) {
+            Drop(slot);
+        }
+
+        if (free_slots.empty() && !EvictOne()) {
+            // everything is being written right now
+            pthread_mutex_unlock(&cache_mutex);
+            return;
+        }
+
+        slot = free_slots.back();
+        free_slots.pop_back();
+        slots[slot].state = DISK_SLOT_WRITING;
+
+        pthread_mutex_unlock(&cache_mutex);
+
+        ssize_t res = pwrite_full(blocks_fd, data.data(), data.size(),
+                                  (off_t)slot * BLOCK_SZ);
+
+        pthread_mutex_lock(&cache_mutex);
+
+        if (res != (ssize_t)data.size()) {
+            slots[slot].state = DISK_SLOT_FREE;
+            free_slots.push_back(slot);
+            pthread_mutex_unlock(&cache_mutex);
+            return;
+        }
+
+        // somebody stored the same block while we were writing
+        uint32_t other;
+        if (Find(hash, block, &other)) {
+            Drop(other);
+        }
+
+        DiskCacheSlot &entry = slots[slot];
+        entry.path_hash = hash;
+        entry.block = block;
+        entry.length = data.size();
+        entry.checksum = Hash(data.data(), data.size());
+        SetValidator(&entry, attr);
+        entry.state = DISK_SLOT_VALID;
+
+        files[hash][block] = slot;
+        lru.push_front(slot);
+        lru_pos[slot] = lru.begin();
+        Touch(slot);
+
+        pthread_mutex_unlock(&cache_mutex);
+    }
+
+
+    /*
+     * drop every block of path, after this client changed it
+     */
+    void Invalidate(const string &path) {
+        uint64_t hash = Hash(path.data(), path.size());
+
+        if (!Enabled()) {
+            return;
+        }
+
+        pthread_mutex_lock(&cache_mutex);
+
+        auto file = files.find(hash);
+        if (file != files.end()) {
+            vector<uint32_t> doomed;
+            for (auto &block : file->second) {
+                doomed.push_back(block.second);
+            }
+            for (auto slot : doomed) {
+                Drop(slot);
+            }
+        }
+
+        pthread_mutex_unlock(&cache_mutex);
+    }
+
+
+    void PrintStats(ostream &out) {
+        if (!Enabled()) {
+            return;
+        }
+
+        pthread_mutex_lock(&cache_mutex);
+
+        unsigned long lookups = hits + misses;
+        out << "disk cache: " << lru.size() << " of " << header->slots
+            << " blocks used, " << hits << " hits, " << misses << " misses ("
+            << (lookups ? (100.0 * hits / lookups) : 0.0) << "% hit rate), "
+            << evictions << " evictions" << endl;
+
+        pthread_mutex_unlock(&cache_mutex);
+    }
+
+
+private:
+    int index_fd;
+    int blocks_fd;
+
+    // the mapped index file, slots follows header
+    DiskCacheHeader *header;
+    DiskCacheSlot *slots;
+    size_t index_size;
+
+    // valid slots by path hash and block number
+    unordered_map<uint64_t, map<long, uint32_t>> files;
+    // valid slots, most recently used at the front
+    list<uint32_t> lru;
+    vector<list<uint32_t>::iterator> lru_pos;
+    vector<uint32_t> free_slots;
+
+    pthread_mutex_t cache_mutex;
+
+
+    /*
+     * give up on the cache after Open failed with err
+     */
+    int Fail(int err) {
+        if (header != NULL) {
+            munmap(header, index_size);
+            header = NULL;
+        }
+        if (blocks_fd != -1) {
+            close(blocks_fd);
+            blocks_fd = -1;
+        }
+        close(index_fd);
+        index_fd = -1;
+
+        return err;
+    }
+
+
+    /*
+     * build the in-memory lookups from the index, oldest slots at the back
+     * of lru
+     */
+    void Load() {
+        vector<pair<uint64_t, uint32_t>> used;
+
+        lru_pos.resize(header->slots);
+
+        for (uint32_t slot = 0; slot < header->slots; slot++) {
+            if (slots[slot].state == DISK_SLOT_VALID &&
+                slots[slot].length <= BLOCK_SZ) {
+                used.push_back(make_pair(slots[slot].last_used, slot));
+                files[slots[slot].path_hash][slots[slot].block] = slot;
+            } else {
+                slots[slot].state = DISK_SLOT_FREE;
+                free_slots.push_back(slot);
+            }
+        }
+
+        sort(used.begin(), used.end());
+        for (auto &entry : used) {
+            lru.push_front(entry.second);
+            lru_pos[entry.second] = lru.begin();
+        }
+    }
+
+
+    // FNV-1a
+    static uint64_t Hash(const char *data, size_t size) {
+        uint64_t hash = 14695981039346656037UL;
+
+        for (size_t i = 0; i < size; i++) {
+            hash ^= (unsigned char)data[i];
+            hash *= 1099511628211UL;
+        }
+
+        return hash;
+    }
+
+
+    static void SetValidator(DiskCacheSlot *entry, const struct stat &attr) {
+        entry->ino = attr.st_ino;
+        entry->size = attr.st_size;
+        entry->mtime_sec = attr.st_mtim.tv_sec;
+        entry->mtime_nsec = attr.st_mtim.tv_nsec;
+        entry->ctime_sec = attr.st_ctim.tv_sec;
+        entry->ctime_nsec = attr.st_ctim.tv_nsec;
+    }
+
+
+    static bool Matches(const DiskCacheSlot &entry, const struct stat &attr) {
+        return entry.ino == (uint64_t)attr.st_ino &&
+               entry.size == attr.st_size &&
+               entry.mtime_sec == attr.st_mtim.tv_sec &&
+               entry.mtime_nsec == attr.st_mtim.tv_nsec &&
+               entry.ctime_sec == attr.st_ctim.tv_sec &&
+               entry.ctime_nsec == attr.st_ctim.tv_nsec;
+    }
+
+
+    // caller holds cache_mutex
+    bool Find(uint64_t hash, long block, uint32_t *slot) {
+        auto file = files.find(hash);
+        if (file == files.end()) {
+            return false;
+        }
+
+        auto it = file->second.find(block);
+        if (it == file->second.end()) {
+            return false;
+        }
+
+        *slot = it->second;
+        return true;
+    }
+
+
+    // caller holds cache_mutex
+    void Touch(uint32_t slot) {
+        lru.splice(lru.begin(), lru, lru_pos[slot]);
+        slots[slot].last_used = ++header->clock;
+    }
+
+
+    // caller holds cache_mutex
+    void Drop(uint32_t slot) {
+        DiskCacheSlot &entry = slots[slot];
+
+        auto file = files.find(entry.path_hash);
+        file->second.erase(entry.block);
+        if (file->second.empty()) {
+            files.erase(file);
+        }
+
+        lru.erase(lru_pos[slot]);
+        entry.state = DISK_SLOT_FREE;
+        free_slots.push_back(slot);
+    }
+
+
+    /*
+     * drop the blocks of the file with path hash hash that don't match attr.
+     * Caller holds cache_mutex.
+     */
+    void DropStale(uint64_t hash, const struct stat &attr) {
+        vector<uint32_t> doomed;
+
+        for (auto &block : files[hash]) {
+            if (!Matches(slots[block.second], attr)) {
+                doomed.push_back(block.second);
+            }
+        }
+        for (auto slot : doomed) {
+            Drop(slot);
+        }
+    }
+
+
+    /*
+     * free the least recently used slot. Caller holds cache_mutex.
+     *
+     * returns false if there was none to free
+     */
+    bool EvictOne() {
+        if (lru.empty()) {
+            return false;
+        }
+
+        Drop(lru.back());
+        evictions++;
+
+        return true;
+    }
+};
+
+#endif // __WATFS_DISK_CACHE__
@@ -0,0 +1,376 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include <list>
+#include <string>
+#include <unordered_map>
+
+#include "dir_fd_cache.h"
+
+using namespace std;
+
+#ifndef __WATFS_FD_CACHE__
+#define __WATFS_FD_CACHE__
+
+
+#define FD_CACHE_DEFAULT_SIZE       1024
+
+
+/*
+ * An open file descriptor for path, opened with the access mode in flags.
+ * refs counts the RPCs currently using the descriptor; an entry is only ever
+ * closed once nobody holds a reference to it.
+ */
+class FdCacheEntry {
+public:
+    string path;
+    int flags;
+    int fd;
+    int refs;
+    // set when the entry was invalidated while in use, close on last release
+    bool stale;
+};
+
+
+/*
+ * Bounded, thread safe LRU cache of open file descriptors keyed by server
+ * path and access mode, so the data path doesn't have to walk and open the
+ * path on every request. Callers Acquire an entry, use its fd with pread or
+ * pwrite, and Release it when done.
+ *
+ * The server invalidates a path when it removes, renames or creates it, and
+ * when inotify reports a change to it from outside WatFS. A cached file that
+ * has lost its last link is reopened as well, so a file deleted or replaced
+ * in a directory nobody watches isn't served either.
+ */
+class FdCache {
+public:
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+
+    FdCache() {
+        Init(FD_CACHE_DEFAULT_SIZE);
+    }
+
+    explicit FdCache(size_t max_entries) {
+        Init(max_entries);
+    }
+
+    ~FdCache() {
+        for (auto entry : lru) {
+            close(entry->fd);
+            delete entry;
+        }
+        pthread_mutex_destroy(&cache_mutex);
+    }
+
+
+    /*
+     * get an open descriptor for path with the given access mode (O_RDONLY,
+     * O_WRONLY or O_RDWR), opening the file if it isn't cached.
+     *
+     * returns the entry on success, or NULL on failure with errno set.
+     */
+    FdCacheEntry *Acquire(const string &path, int flags) {
+        FdCacheEntry *entry;
+        string key = MakeKey(path, flags);
+        int fd;
+
+        for (;;) {
+            pthread_mutex_lock(&cache_mutex);
+
+            entry = Find(key);
+            if (entry != NULL) {
+                hits++;
+                pthread_mutex_unlock(&cache_mutex);
+
+                if (Linked(entry->fd)) {
+                    return entry;
+                }
+
+                // deleted or replaced behind our back
+                Release(entry);
+                Invalidate(path);
+                continue;
+            }
+
+            misses++;
+            unsigned long generation = StartOpen(path);
+
+            pthread_mutex_unlock(&cache_mutex);
+
+            // don't hold the lock across the open, it can be slow
+            fd = Open(path, flags & O_ACCMODE);
+            int err = errno;
+
+            pthread_mutex_lock(&cache_mutex);
+
+            bool current = FinishOpen(path, generation);
+
+            if (fd == -1) {
+                pthread_mutex_unlock(&cache_mutex);
+                errno = err;
+                return NULL;
+            }
+
+            // the path was unlinked or renamed over while we were opening
+            // it, we may have the old file
+            if (!current) {
+                pthread_mutex_unlock(&cache_mutex);
+                close(fd);
+                continue;
+            }
+
+            // somebody may have opened the same file while we weren't
+            // looking
+            entry = Find(key);
+            if (entry != NULL) {
+                pthread_mutex_unlock(&cache_mutex);
+                close(fd);
+                return entry;
+            }
+
+            break;
+        }
+
+        EvictIdle(capacity > 0 ? capacity - 1 : 0);
+
+        entry = new FdCacheEntry();
+        entry->path = path;
+        entry->flags = flags & O_ACCMODE;
+        entry->fd = fd;
+        entry->refs = 1;
+        entry->stale = false;
+
+        lru.push_front(entry);
+        entries[key] = lru.begin();
+
+        pthread_mutex_unlock(&cache_mutex);
+
+        return entry;
+    }
+
+
+    /*
+     * give back an entry returned by Acquire
+     */
+    void Release(FdCacheEntry *entry) {
+        pthread_mutex_lock(&cache_mutex);
+
+        entry->refs--;
+        if (entry->refs == 0 && entry->stale) {
+            close(entry->fd);
+            delete entry;
+        } else if (entry->refs == 0 && lru.size() > capacity) {
+            EvictIdle(capacity);
+        }
+
+        pthread_mutex_unlock(&cache_mutex);
+    }
+
+
+    /*
+     * drop all descriptors for path, they are closed once no longer in use
+     */
+    void Invalidate(const string &path) {
+        pthread_mutex_lock(&cache_mutex);
+
+        auto pending = opening.find(path);
+        if (pending != opening.end()) {
+            pending->second.generation = next_generation++;
+        }
+
+        for (auto it = lru.begin(); it != lru.end(); ) {
+            if ((*it)->path == path) {
+                it = Remove(it);
+            } else {
+                ++it;
+            }
+        }
+
+        pthread_mutex_unlock(&cache_mutex);
+    }
+
+
+    /*
+     * open files relative to their directories in dir_cache from now on,
+     * instead of walking their whole paths
+     */
+    void ResolveWith(DirFdCache *dir_cache) {
+        dirs = dir_cache;
+    }
+
+
+    /*
+     * drop all descriptors for path and anything below it
+     */
+    void InvalidateTree(const string &path) {
+        string prefix = path + "/";
+
+        pthread_mutex_lock(&cache_mutex);
+
+        for (auto &pending : opening) {
+            if (pending.first == path ||
+                pending.first.compare(0, prefix.size(), prefix) == 0) {
+
+                pending.second.generation = next_generation++;
+            }
+        }
+
+        for (auto it = lru.begin(); it != lru.end(); ) {
+            if ((*it)->path == path ||
+                (*it)->path.compare(0, prefix.size(), prefix) == 0) {
+
+                it = Remove(it);
+            } else {
+                ++it;
+            }
+        }
+
+        pthread_mutex_unlock(&cache_mutex);
+    }
+
+
+private:
+    size_t capacity;
+
+    // most recently used entries are at the front
+    list<FdCacheEntry *> lru;
+    unordered_map<string, list<FdCacheEntry *>::iterator> entries;
+
+    // paths being opened, and the generation to give the next one
+    unordered_map<string, PendingOpen> opening;
+    unsigned long next_generation;
+
+    DirFdCache *dirs;
+
+    pthread_mutex_t cache_mutex;
+
+
+    void Init(size_t max_entries) {
+        capacity = max_entries;
+        next_generation = 1;
+        dirs = NULL;
+        hits = 0;
+        misses = 0;
+        evictions = 0;
+
+        pthread_mutex_init(&cache_mutex, NULL);
+    }
+
+
+    /*
+     * returns the new descriptor, or -1 with errno set
+     */
+    int Open(const string &path, int flags) {
+        if (dirs == NULL) {
+            return open(path.c_str(), flags);
+        }
+
+        ParentDir parent(dirs, path);
+        if (parent.fd == -1) {
+            return -1;
+        }
+
+        return openat(parent.fd, parent.name, flags);
+    }
+
+
+    /*
+     * returns whether the file open on fd still has a name
+     */
+    static bool Linked(int fd) {
+        struct stat statbuf;
+
+        return fstat(fd, &statbuf) == -1 || statbuf.st_nlink > 0;
+    }
+
+
+    /*
+     * note an open of path, and return the generation it starts in. Caller
+     * holds cache_mutex.
+     */
+    unsigned long StartOpen(const string &path) {
+        PendingOpen &pending = opening[path];
+        if (pending.opens++ == 0) {
+            pending.generation = next_generation++;
+        }
+        return pending.generation;
+    }
+
+
+    /*
+     * note the end of an open of path started in generation. Caller holds
+     * cache_mutex.
+     *
+     * returns false if path was invalidated since
+     */
+    bool FinishOpen(const string &path, unsigned long generation) {
+        auto pending = opening.find(path);
+        bool current = pending->second.generation == generation;
+
+        if (--pending->second.opens == 0) {
+            opening.erase(pending);
+        }
+
+        return current;
+    }
+
+
+    static string MakeKey(const string &path, int flags) {
+        return to_string(flags & O_ACCMODE) + ":" + path;
+    }
+
+
+    // caller holds cache_mutex, takes a reference on a hit
+    FdCacheEntry *Find(const string &key) {
+        auto it = entries.find(key);
+        if (it == entries.end()) {
+            return NULL;
+        }
+
+        lru.splice(lru.begin(), lru, it->second);
+        (*it->second)->refs++;
+
+        return *it->second;
+    }
+
+
+    // caller holds cache_mutex, returns the next position in lru
+    list<FdCacheEntry *>::iterator Remove(list<FdCacheEntry *>::iterator it) {
+        FdCacheEntry *entry = *it;
+
+        entries.erase(MakeKey(entry->path, entry->flags));
+        if (entry->refs == 0) {
+            close(entry->fd);
+            delete entry;
+        } else {
+            entry->stale = true;
+        }
+
+        return lru.erase(it);
+    }
+
+
+    /*
+     * close least recently used descriptors that aren't in use until at most
+     * target remain. If everything is busy we temporarily exceed the limit
+     * rather than block. Caller holds cache_mutex.
+     */
+    void EvictIdle(size_t target) {
+        auto it = lru.end();
+        while (lru.size() > target && it != lru.begin()) {
+            --it;
+            if ((*it)->refs == 0) {
+                it = Remove(it);
+                evictions++;
+            }
+        }
+    }
+};
+
+#endif // __WATFS_FD_CACHE__
@@ -0,0 +1,184 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "fd_cache.h"
+#include "storage_backend.h"
+
+using namespace std;
+
+#ifndef __WATFS_GROUP_COMMIT__
+#define __WATFS_GROUP_COMMIT__
+
+
+#define GROUP_COMMIT_DEFAULT_WINDOW_US  500
+
+
+/*
+ * The files named by all commits that arrived within one window, and the
+ * result of syncing each of them.
+ */
+class CommitBatch {
+public:
+    set<string> paths;
+    map<string, int> errors;
+    bool done;
+
+    CommitBatch() : done(false) {}
+};
+
+
+/*
+ * Flushes committed files to stable storage with fdatasync, batching commits
+ * that arrive close together. The first committer to arrive becomes the
+ * leader: it waits for a short window so concurrent commits can join its
+ * batch, then syncs every file in the batch once and wakes everybody up.
+ * Commits that arrive while a batch is being synced form the next batch.
+ */
+class GroupCommit {
+public:
+    unsigned long commits;
+    unsigned long batches;
+
+    GroupCommit(FdCache *cache, StorageBackend *storage_backend,
+                long window_us = GROUP_COMMIT_DEFAULT_WINDOW_US)
+        : fd_cache(cache), storage(storage_backend), window(window_us), 
+          leader_running(false) {
+
+        commits = 0;
+        batches = 0;
+
+        pthread_mutex_init(&commit_mutex, NULL);
+        pthread_cond_init(&batch_done, NULL);
+    }
+
+    ~GroupCommit() {
+        pthread_cond_destroy(&batch_done);
+        pthread_mutex_destroy(&commit_mutex);
+    }
+
+
+    /*
+     * make all written data for the files in paths durable.
+     *
+     * returns 0 on success, or the errno of the first file that failed to sync
+     */
+    int Commit(const vector<string> &paths) {
+        shared_ptr<CommitBatch> batch;
+        int err = 0;
+
+        pthread_mutex_lock(&commit_mutex);
+
+        commits++;
+
+        if (!open_batch) {
+            open_batch = make_shared<CommitBatch>();
+        }
+        batch = open_batch;
+        batch->paths.insert(paths.begin(), paths.end());
+
+        while (!batch->done) {
+            if (leader_running) {
+                pthread_cond_wait(&batch_done, &commit_mutex);
+                continue;
+            }
+
+            // nobody is syncing, so we lead this batch
+            leader_running = true;
+
+            pthread_mutex_unlock(&commit_mutex);
+            if (window > 0) {
+                usleep(window);
+            }
+            pthread_mutex_lock(&commit_mutex);
+
+            // anything that arrives from now on goes into the next batch
+            open_batch.reset();
+            batches++;
+
+            pthread_mutex_unlock(&commit_mutex);
+            SyncBatch(batch.get());
+            pthread_mutex_lock(&commit_mutex);
+
+            batch->done = true;
+            leader_running = false;
+            pthread_cond_broadcast(&batch_done);
+        }
+
+        for (auto &path : paths) {
+            auto it = batch->errors.find(path);
+            if (it != batch->errors.end()) {
+                err = it->second;
+                break;
+            }
+        }
+
+        pthread_mutex_unlock(&commit_mutex);
+
+        return err;
+    }
+
+
+private:
+    FdCache *fd_cache;
+    StorageBackend *storage;
+    long window;
+
+    bool leader_running;
+    // batch that new commits join, NULL if none has arrived yet
+    shared_ptr<CommitBatch> open_batch;
+
+    pthread_mutex_t commit_mutex;
+    pthread_cond_t batch_done;
+
+
+    /*
+     * start writeback on every file in the batch first so the disk sees all
+     * of it at once, then fdatasync them through the storage backend, which
+     * may have all the syncs in flight together. Called without commit_mutex
+     * held; nobody else touches the batch until it is done.
+     */
+    void SyncBatch(CommitBatch *batch) {
+        vector<FdCacheEntry *> files;
+        vector<int> fds;
+        vector<int> errors;
+
+        for (auto &path : batch->paths) {
+            // writes go through the O_WRONLY descriptor, so it's usually cached
+            FdCacheEntry *file = fd_cache->Acquire(path, O_WRONLY);
+            if (file == NULL) {
+                file = fd_cache->Acquire(path, O_RDONLY);
+            }
+
+            if (file == NULL) {
+                // a file that has been removed has nothing left to commit
+                if (errno != ENOENT) {
+                    batch->errors[path] = errno;
+                }
+                continue;
+            }
+
+            sync_file_range(file->fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+            files.push_back(file);
+            fds.push_back(file->fd);
+        }
+
+        storage->SyncFiles(fds, &errors);
+
+        for (size_t i = 0; i < files.size(); i++) {
+            if (errors[i] != 0) {
+                batch->errors[files[i]->path] = errors[i];
+            }
+            fd_cache->Release(files[i]);
+        }
+    }
+};
+
+#endif // __WATFS_GROUP_COMMIT__
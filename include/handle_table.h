@@ -0,0 +1,261 @@
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+#ifndef __WATFS_HANDLE_TABLE__
+#define __WATFS_HANDLE_TABLE__
+
+
+#define HANDLE_TABLE_DEFAULT_SIZE   65536
+
+/*
+ * A file handle is an opaque 64 bit value made up of
+ *
+ *   bits 63-40: boot id of the server instance that issued it
+ *   bits 39-24: generation of the slot when the handle was issued
+ *   bits 23-0:  slot index in the handle table
+ *
+ * so handles from a previous server instance, or for a slot that has since
+ * been recycled, can be recognized and rejected with ESTALE. 0 is never a
+ * valid handle, clients use it to mean "no handle, use the path".
+ */
+#define HANDLE_BOOT_BITS            24
+#define HANDLE_GEN_BITS             16
+#define HANDLE_SLOT_BITS            24
+
+#define HANDLE_BOOT_MASK            ((1ULL << HANDLE_BOOT_BITS) - 1)
+#define HANDLE_GEN_MASK             ((1ULL << HANDLE_GEN_BITS) - 1)
+#define HANDLE_SLOT_MASK            ((1ULL << HANDLE_SLOT_BITS) - 1)
+
+
+class HandleSlot {
+public:
+    string path;
+    uint64_t gen;
+    bool used;
+    // position in the LRU list, valid while used
+    list<uint32_t>::iterator lru_pos;
+};
+
+
+/*
+ * Maps file handles to server paths. Each path gets at most one handle, and
+ * handles stay valid until the object is unlinked or the slot is recycled
+ * to make room for another path. Renames update the paths of existing
+ * handles, so clients holding a handle keep following the file.
+ */
+class HandleTable {
+public:
+    HandleTable(uint64_t boot, size_t max_handles = HANDLE_TABLE_DEFAULT_SIZE) {
+        boot_id = boot & HANDLE_BOOT_MASK;
+        if (boot_id == 0) {
+            boot_id = 1;
+        }
+
+        if (max_handles > HANDLE_SLOT_MASK + 1) {
+            max_handles = HANDLE_SLOT_MASK + 1;
+        }
+        capacity = max_handles;
+
+        pthread_mutex_init(&table_mutex, NULL);
+    }
+
+    ~HandleTable() {
+        pthread_mutex_destroy(&table_mutex);
+    }
+
+
+    /*
+     * return the handle for path, allocating one if needed
+     */
+    uint64_t Get(const string &path) {
+        uint32_t slot_idx;
+
+        pthread_mutex_lock(&table_mutex);
+
+        auto it = paths.find(path);
+        if (it != paths.end()) {
+            slot_idx = it->second;
+            Touch(slot_idx);
+        } else {
+            slot_idx = Allocate();
+            slots[slot_idx].path = path;
+            paths[path] = slot_idx;
+        }
+
+        uint64_t handle = MakeHandle(slot_idx, slots[slot_idx].gen);
+
+        pthread_mutex_unlock(&table_mutex);
+
+        return handle;
+    }
+
+
+    /*
+     * find the path a handle refers to.
+     *
+     * returns 0 on success, or ESTALE if the handle was issued by another
+     * server instance or its object has gone away
+     */
+    int Resolve(uint64_t handle, string *path) {
+        uint64_t slot_idx = handle & HANDLE_SLOT_MASK;
+        uint64_t gen = (handle >> HANDLE_SLOT_BITS) & HANDLE_GEN_MASK;
+        uint64_t boot = handle >> (HANDLE_SLOT_BITS + HANDLE_GEN_BITS);
+
+        if (boot != boot_id) {
+            return ESTALE;
+        }
+
+        pthread_mutex_lock(&table_mutex);
+
+        if (slot_idx >= slots.size() || !slots[slot_idx].used ||
+            slots[slot_idx].gen != gen) {
+
+            pthread_mutex_unlock(&table_mutex);
+            return ESTALE;
+        }
+
+        path->assign(slots[slot_idx].path);
+        Touch(slot_idx);
+
+        pthread_mutex_unlock(&table_mutex);
+
+        return 0;
+    }
+
+
+    /*
+     * update handles after from was renamed to to. If is_dir is set, the
+     * handles of everything below from move as well. Any handle for the
+     * object that was replaced at to becomes stale.
+     */
+    void Rename(const string &from, const string &to, bool is_dir) {
+        pthread_mutex_lock(&table_mutex);
+
+        auto replaced = paths.find(to);
+        if (replaced != paths.end()) {
+            Free(replaced->second);
+        }
+
+        auto it = paths.find(from);
+        if (it != paths.end()) {
+            uint32_t slot_idx = it->second;
+            paths.erase(it);
+            slots[slot_idx].path = to;
+            paths[to] = slot_idx;
+        }
+
+        if (is_dir) {
+            string from_prefix = from + "/";
+            vector<uint32_t> moved;
+
+            for (auto &entry : paths) {
+                if (entry.first.compare(0, from_prefix.size(),
+                                        from_prefix) == 0) {
+                    moved.push_back(entry.second);
+                }
+            }
+
+            for (auto slot_idx : moved) {
+                HandleSlot &slot = slots[slot_idx];
+                paths.erase(slot.path);
+                slot.path = to + slot.path.substr(from.size());
+                paths[slot.path] = slot_idx;
+            }
+        }
+
+        pthread_mutex_unlock(&table_mutex);
+    }
+
+
+    /*
+     * make the handle for path stale, after it has been unlinked
+     */
+    void Remove(const string &path) {
+        pthread_mutex_lock(&table_mutex);
+
+        auto it = paths.find(path);
+        if (it != paths.end()) {
+            Free(it->second);
+        }
+
+        pthread_mutex_unlock(&table_mutex);
+    }
+
+
+private:
+    uint64_t boot_id;
+    size_t capacity;
+
+    vector<HandleSlot> slots;
+    // slots that aren't in use, and can be reissued with a new generation
+    vector<uint32_t> free_slots;
+    // used slots, most recently used at the front
+    list<uint32_t> lru;
+    unordered_map<string, uint32_t> paths;
+
+    pthread_mutex_t table_mutex;
+
+
+    uint64_t MakeHandle(uint32_t slot_idx, uint64_t gen) {
+        return (boot_id << (HANDLE_SLOT_BITS + HANDLE_GEN_BITS)) |
+               ((gen & HANDLE_GEN_MASK) << HANDLE_SLOT_BITS) |
+               slot_idx;
+    }
+
+
+    // caller holds table_mutex
+    void Touch(uint32_t slot_idx) {
+        lru.splice(lru.begin(), lru, slots[slot_idx].lru_pos);
+    }
+
+
+    // caller holds table_mutex
+    uint32_t Allocate() {
+        uint32_t slot_idx;
+
+        if (free_slots.empty() && slots.size() < capacity) {
+            slots.emplace_back();
+            slots.back().gen = 0;
+            slots.back().used = false;
+            free_slots.push_back(slots.size() - 1);
+        } else if (free_slots.empty()) {
+            // recycle the least recently used handle
+            Free(lru.back());
+        }
+
+        slot_idx = free_slots.back();
+        free_slots.pop_back();
+
+        HandleSlot &slot = slots[slot_idx];
+        slot.used = true;
+        lru.push_front(slot_idx);
+        slot.lru_pos = lru.begin();
+
+        return slot_idx;
+    }
+
+
+    // caller holds table_mutex
+    void Free(uint32_t slot_idx) {
+        HandleSlot &slot = slots[slot_idx];
+
+        paths.erase(slot.path);
+        lru.erase(slot.lru_pos);
+        slot.path.clear();
+        slot.used = false;
+        // outstanding handles for this slot are now stale
+        slot.gen = (slot.gen + 1) & HANDLE_GEN_MASK;
+
+        free_slots.push_back(slot_idx);
+    }
+};
+
+#endif // __WATFS_HANDLE_TABLE__
@@ -0,0 +1,63 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <deque>
+#include <string>
+
+using namespace std;
+
+#ifndef __WATFS_OPEN_DIR__
+#define __WATFS_OPEN_DIR__
+
+
+// directory entries fetched per readdir call, 0 for the whole directory
+#define READDIR_DEFAULT_PAGE    4096
+
+
+/*
+ * An entry of a directory listing, with the server's cookie for continuing
+ * the listing after it.
+ */
+class DirListEntry {
+public:
+    string name;
+    struct stat attr;
+    off_t cookie;
+};
+
+
+/*
+ * Client side state of a directory opened through FUSE, a pointer to it is
+ * stored in fuse_file_info::fh. Entries are fetched from the server a page
+ * at a time and handed to FUSE as it asks for them, so listing a huge
+ * directory takes one streamed call per page instead of holding the whole
+ * listing in memory.
+ */
+class OpenDir {
+public:
+    string path;
+    // fetched entries FUSE hasn't taken yet
+    deque<DirListEntry> entries;
+    // offset FUSE asks for when it wants the first of entries
+    off_t position;
+    // where the next page starts
+    off_t next_cookie;
+    // the last page has been fetched
+    bool eof;
+
+    OpenDir(const char *new_path) :
+        path(new_path), position(0), next_cookie(0), eof(false) {}
+
+
+    /*
+     * restart the listing at offset, after a seek or rewinddir
+     */
+    void Seek(off_t offset) {
+        entries.clear();
+        position = offset;
+        next_cookie = offset;
+        eof = false;
+    }
+};
+
+#endif // __WATFS_OPEN_DIR__
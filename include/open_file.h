@@ -0,0 +1,32 @@
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+
+#include "readahead.h"
+
+using namespace std;
+
+#ifndef __WATFS_OPEN_FILE__
+#define __WATFS_OPEN_FILE__
+
+
+/*
+ * Client side state of a file opened through FUSE, a pointer to it is stored
+ * in fuse_file_info::fh.
+ */
+class OpenFile {
+public:
+    string path;
+    // server file handle, 0 to use the path
+    uint64_t fh;
+    // access pattern, shared with readahead requests still in the queue
+    shared_ptr<ReadaheadState> readahead;
+    // contents fetched at open, NULL if reads go to the server
+    shared_ptr<const string> whole;
+
+    OpenFile(const char *new_path, uint64_t new_fh) :
+        path(new_path), fh(new_fh), readahead(make_shared<ReadaheadState>()) {}
+};
+
+#endif // __WATFS_OPEN_FILE__
@@ -0,0 +1,124 @@
+#include <stdint.h>
+#include <sys/types.h>
+#include <pthread.h>
+
+#include <algorithm>
+#include <memory>
+#include <string>
+
+#include "block_cache.h"
+
+using namespace std;
+
+#ifndef __WATFS_READAHEAD__
+#define __WATFS_READAHEAD__
+
+
+#define READAHEAD_DEFAULT_MAX       (8 << 20)
+#define READAHEAD_DEFAULT_THREADS   4
+// first readahead window after a stream is detected
+#define READAHEAD_INITIAL_WINDOW    (2 * BLOCK_SZ)
+
+
+/*
+ * Access pattern of one open file. Reads that start where the previous one
+ * ended are a sequential stream, and each one grows the readahead window
+ * (doubling up to a maximum). Any other read resets the window and cancels
+ * readahead that hasn't started yet, by bumping the generation.
+ */
+class ReadaheadState {
+public:
+    ReadaheadState() : next_offset(0), window(0), prefetch_end(0),
+                       generation(0) {
+
+        pthread_mutex_init(&state_mutex, NULL);
+    }
+
+    ~ReadaheadState() {
+        pthread_mutex_destroy(&state_mutex);
+    }
+
+
+    /*
+     * record a read of count bytes at offset.
+     *
+     * returns true if the read is part of a sequential stream. In that case
+     * [*start, *end) is set to the range that should be prefetched now, which
+     * may be empty, and *gen to the generation to tag the prefetches with.
+     */
+    bool Update(off_t offset, size_t count, long max_window, off_t *start,
+                off_t *end, unsigned long *gen) {
+
+        bool sequential;
+
+        pthread_mutex_lock(&state_mutex);
+
+        sequential = offset == next_offset;
+        if (sequential) {
+            window = window == 0 ? READAHEAD_INITIAL_WINDOW : window * 2;
+            window = min(window, max_window);
+
+            *start = max(prefetch_end, (off_t)(offset + count));
+            *end = max(*start, (off_t)(offset + count + window));
+            prefetch_end = *end;
+        } else {
+            window = 0;
+            prefetch_end = 0;
+            generation++;
+        }
+
+        next_offset = offset + count;
+        *gen = generation;
+
+        pthread_mutex_unlock(&state_mutex);
+
+        return sequential;
+    }
+
+
+    /*
+     * returns whether readahead tagged with gen is still wanted
+     */
+    bool Current(unsigned long gen) {
+        pthread_mutex_lock(&state_mutex);
+        bool current = gen == generation;
+        pthread_mutex_unlock(&state_mutex);
+
+        return current;
+    }
+
+
+    /*
+     * drop all pending readahead, e.g. when the file is closed
+     */
+    void Cancel() {
+        pthread_mutex_lock(&state_mutex);
+        generation++;
+        pthread_mutex_unlock(&state_mutex);
+    }
+
+
+private:
+    off_t next_offset;
+    long window;
+    // everything before this has already been queued for readahead
+    off_t prefetch_end;
+    unsigned long generation;
+
+    pthread_mutex_t state_mutex;
+};
+
+
+/*
+ * A block to prefetch for an open file.
+ */
+class ReadaheadJob {
+public:
+    string path;
+    uint64_t fh;
+    long block;
+    shared_ptr<ReadaheadState> state;
+    unsigned long generation;
+};
+
+#endif // __WATFS_READAHEAD__
@@ -0,0 +1,280 @@
+#include <unistd.h>
+#include <pthread.h>
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include <grpc++/grpc++.h>
+
+using grpc::Status;
+using grpc::StatusCode;
+
+using namespace std;
+
+#ifndef __WATFS_RETRY_POLICY__
+#define __WATFS_RETRY_POLICY__
+
+
+// attempts per call before giving up, including the first
+#define RETRY_DEFAULT_MAX_ATTEMPTS  8
+// backoff before the first retry, doubled for each one after that
+#define RETRY_INITIAL_BACKOFF_MS    50
+#define RETRY_MAX_BACKOFF_MS        5000
+
+// retry budget: every failed attempt costs a token, every call that
+// succeeds earns some back, and retries stop below half the maximum
+#define RETRY_BUDGET_TOKENS         100
+#define RETRY_BUDGET_REFILL         0.1
+
+// call latencies kept for working out the hedging delay
+#define HEDGE_SAMPLES               256
+// samples needed before we start hedging
+#define HEDGE_MIN_SAMPLES           32
+
+
+/*
+ * How a call may be repeated.
+ */
+enum RetryClass {
+    // repeating it changes nothing, retry on any transient failure
+    RETRY_IDEMPOTENT,
+    // idempotent and cheap, so a slow attempt may be raced by a second one
+    RETRY_HEDGED,
+    // never retried here, the server may already have run it
+    RETRY_NON_IDEMPOTENT
+};
+
+
+/*
+ * Retry rules shared by all calls of a client. Retries back off
+ * exponentially with full jitter, so clients that lost a restarting server
+ * at the same moment don't all come back at the same moment. The budget
+ * stops retries altogether while most calls are failing, and the calls
+ * then fail back to the application instead of piling up on the server.
+ *
+ * Also tracks the latency of hedged calls, to decide when a call has taken
+ * long enough that a second copy should be sent.
+ */
+class RetryPolicy {
+public:
+    unsigned long retries;
+    unsigned long exhausted;
+    unsigned long hedges;
+
+    RetryPolicy() : retries(0), exhausted(0), hedges(0),
+                    max_attempts(RETRY_DEFAULT_MAX_ATTEMPTS),
+                    tokens(RETRY_BUDGET_TOKENS), hedge_percentile(0),
+                    next_sample(0), hedge_delay_us(-1), 
+                    random(random_device()()) {
+
+        pthread_mutex_init(&policy_mutex, NULL);
+    }
+
+    ~RetryPolicy() {
+        pthread_mutex_destroy(&policy_mutex);
+    }
+
+
+    /*
+     * allow attempts tries per call, and hedge calls that take longer than
+     * percentile percent of recent ones (0 turns hedging off)
+     */
+    void Configure(int attempts, int percentile) {
+        pthread_mutex_lock(&policy_mutex);
+        max_attempts = max(attempts, 1);
+        hedge_percentile = min(max(percentile, 0), 100);
+        pthread_mutex_unlock(&policy_mutex);
+    }
+
+
+    /*
+     * a call of class retry_class failed with status on try number attempt.
+     *
+     * returns how long to back off before trying again, or -1 if the call
+     * should fail
+     */
+    long RetryAfter(const Status &status, RetryClass retry_class,
+                    int attempt) {
+        long backoff_ms = -1;
+
+        pthread_mutex_lock(&policy_mutex);
+
+        tokens = max(tokens - 1, 0.0);
+
+        if (!Retryable(status.error_code(), retry_class) ||
+            attempt >= max_attempts) {
+            pthread_mutex_unlock(&policy_mutex);
+            return -1;
+        }
+
+        if (tokens <= RETRY_BUDGET_TOKENS / 2) {
+            exhausted++;
+            pthread_mutex_unlock(&policy_mutex);
+            return -1;
+        }
+
+        long ceiling = min((long)RETRY_INITIAL_BACKOFF_MS << 
+                               min(attempt - 1, 16),
+                           (long)RETRY_MAX_BACKOFF_MS);
+        backoff_ms = uniform_int_distribution<long>(0, ceiling)(random);
+        retries++;
+
+        pthread_mutex_unlock(&policy_mutex);
+
+        return backoff_ms;
+    }
+
+
+    /*
+     * a call succeeded, refill the budget a little
+     */
+    void Succeeded() {
+        pthread_mutex_lock(&policy_mutex);
+        tokens = min(tokens + RETRY_BUDGET_REFILL,
+                     (double)RETRY_BUDGET_TOKENS);
+        pthread_mutex_unlock(&policy_mutex);
+    }
+
+
+    /*
+     * record how long a hedged call took to answer
+     */
+    void RecordLatency(chrono::steady_clock::duration latency) {
+        long us = chrono::duration_cast<chrono::microseconds>(latency).count();
+
+        pthread_mutex_lock(&policy_mutex);
+
+        if (hedge_percentile == 0) {
+            pthread_mutex_unlock(&policy_mutex);
+            return;
+        }
+
+        if (samples.size() < HEDGE_SAMPLES) {
+            samples.push_back(us);
+        } else {
+            samples[next_sample] = us;
+        }
+        next_sample = (next_sample + 1) % HEDGE_SAMPLES;
+
+        // sorting the window on every call would cost more than it saves
+        if (samples.size() >= HEDGE_MIN_SAMPLES && next_sample % 16 == 0) {
+            vector<long> sorted(samples);
+            size_t rank = (sorted.size() - 1) * hedge_percentile / 100;
+            nth_element(sorted.begin(), sorted.begin() + rank, sorted.end());
+            hedge_delay_us = sorted[rank];
+        }
+
+        pthread_mutex_unlock(&policy_mutex);
+    }
+
+
+    /*
+     * returns how long to wait for a hedged call before sending a second
+     * copy in microseconds, or -1 to not hedge
+     */
+    long HedgeDelay() {
+        long delay;
+
+        pthread_mutex_lock(&policy_mutex);
+        delay = (hedge_percentile == 0) ? -1 : hedge_delay_us;
+        pthread_mutex_unlock(&policy_mutex);
+
+        return delay;
+    }
+
+
+    /*
+     * a second copy of a slow call was sent
+     */
+    void Hedged() {
+        pthread_mutex_lock(&policy_mutex);
+        hedges++;
+        pthread_mutex_unlock(&policy_mutex);
+    }
+
+
+    void PrintStats(ostream &out) {
+        pthread_mutex_lock(&policy_mutex);
+        out << "retries: " << retries << " retried, " << exhausted
+            << " refused by the budget, " << hedges << " hedged" << endl;
+        pthread_mutex_unlock(&policy_mutex);
+    }
+
+
+private:
+    int max_attempts;
+    double tokens;
+    int hedge_percentile;
+
+    vector<long> samples;
+    size_t next_sample;
+    long hedge_delay_us;
+
+    // seeded per client, or every client would back off in step
+    mt19937 random;
+
+    pthread_mutex_t policy_mutex;
+
+
+    static bool Retryable(StatusCode code, RetryClass retry_class) {
+        // calls wait for the channel to be ready, so UNAVAILABLE means the
+        // connection dropped after the request went out. gRPC already
+        // retries calls that never left the client by itself.
+        if (retry_class == RETRY_NON_IDEMPOTENT) {
+            return false;
+        }
+
+        return code == StatusCode::UNAVAILABLE ||
+               code == StatusCode::DEADLINE_EXCEEDED ||
+               code == StatusCode::RESOURCE_EXHAUSTED ||
+               code == StatusCode::ABORTED;
+    }
+};
+
+
+/*
+ * The attempts of one call:
+ *
+ *     RetryLoop retry(&policy, RETRY_IDEMPOTENT);
+ *     do {
+ *         status = ...;
+ *     } while (retry.Again(status));
+ */
+class RetryLoop {
+public:
+    RetryLoop(RetryPolicy *retry_policy, RetryClass call_class) :
+        policy(retry_policy), retry_class(call_class), attempt(1) {}
+
+
+    /*
+     * returns whether the call should be tried again after ending with
+     * status, having slept for the backoff if so
+     */
+    bool Again(const Status &status) {
+        if (status.ok()) {
+            policy->Succeeded();
+            return false;
+        }
+
+        long backoff_ms = policy->RetryAfter(status, retry_class, attempt);
+        if (backoff_ms < 0) {
+            return false;
+        }
+
+        usleep(backoff_ms * 1000);
+        attempt++;
+
+        return true;
+    }
+
+
+private:
+    RetryPolicy *policy;
+    RetryClass retry_class;
+    int attempt;
+};
+
+#endif // __WATFS_RETRY_POLICY__
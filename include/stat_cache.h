@@ -0,0 +1,672 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <functional>
+#include <iostream>
+#include <list>
+#include <map>
+#include <string>
+#include <unordered_map>
+
+using namespace std;
+
+#ifndef __WATFS_STAT_CACHE__
+#define __WATFS_STAT_CACHE__
+
+
+#define STAT_CACHE_DEFAULT_SIZE     (256 << 10)
+// most directories watched at once, unused watches are dropped past this
+#define STAT_CACHE_MAX_WATCHES      (64 << 10)
+
+// everything that changes the attributes of a directory or its entries
+#define STAT_CACHE_EVENTS   (IN_ATTRIB | IN_MODIFY | IN_CREATE | IN_DELETE | \
+                             IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | \
+                             IN_MOVE_SELF)
+
+
+/*
+ * Attributes of a server path, or the errno stat failed with (only ENOENT
+ * is cached).
+ */
+class StatCacheEntry {
+public:
+    string path;
+    struct stat attr;
+    int err;
+    // position in the LRU list
+    list<StatCacheEntry *>::iterator lru_pos;
+};
+
+
+/*
+ * An inotify watch on a directory. generation goes up whenever the
+ * directory or one of its entries may have changed.
+ */
+class DirWatch {
+public:
+    string path;
+    unsigned long generation;
+};
+
+
+/*
+ * What the cache looked like before a stat, handed from Prepare to Insert so
+ * that a result that may have been overtaken by a change isn't cached.
+ */
+class StatCacheToken {
+public:
+    unsigned long tree_generation;
+    // watch on the directory holding the path
+    int wd;
+    unsigned long generation;
+    // watch on the path itself if it is a watched directory, or -1
+    int own_wd;
+    unsigned long own_generation;
+};
+
+
+/*
+ * Size-bounded LRU cache of the server's stat results, keyed by server path.
+ * Entries are only cached once every directory from the root down to them
+ * is watched with inotify, so changes made outside WatFS are seen: a change
+ * to an entry or its directory drops them, and a directory that is moved or
+ * removed drops everything under it. The server's own mutations invalidate
+ * their paths directly, since the inotify events arrive a little later.
+ * Names that change are also passed to a handler, for the server's
+ * descriptor caches.
+ *
+ * Files with more than one link aren't cached, because a change through
+ * another name shows up in another directory. Symbolic links are followed
+ * like stat does, and changes to where they point aren't watched.
+ *
+ * All methods are thread safe.
+ */
+class StatCache {
+public:
+    StatCache() : capacity(0), inotify_fd(-1), tree_generation(0),
+                  watcher_running(false) {
+
+        stop_pipe[0] = stop_pipe[1] = -1;
+        pthread_mutex_init(&cache_mutex, NULL);
+    }
+
+    ~StatCache() {
+        if (watcher_running) {
+            close(stop_pipe[1]);
+            pthread_join(watcher, NULL);
+            close(stop_pipe[0]);
+        }
+        if (inotify_fd != -1) {
+            close(inotify_fd);
+        }
+
+        for (auto entry : lru) {
+            delete entry;
+        }
+
+        pthread_mutex_destroy(&cache_mutex);
+    }
+
+
+    /*
+     * cache up to max_entries paths under root_dir, and start watching for
+     * changes. Nothing is cached if max_entries is 0.
+     *
+     * returns 0 on success, or -errno if inotify couldn't be set up, in
+     * which case nothing is cached either
+     */
+    int Start(const string &root_dir, size_t max_entries) {
+        if (max_entries == 0) {
+            return 0;
+        }
+
+        inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (inotify_fd == -1) {
+            return -errno;
+        }
+
+        if (pipe2(stop_pipe, O_CLOEXEC) == -1) {
+            int err = errno;
+            close(inotify_fd);
+            inotify_fd = -1;
+            return -err;
+        }
+
+        int err = pthread_create(&watcher, NULL, Watcher, this);
+        if (err != 0) {
+            close(stop_pipe[0]);
+            close(stop_pipe[1]);
+            close(inotify_fd);
+            inotify_fd = -1;
+            return -err;
+        }
+        watcher_running = true;
+
+        root = root_dir;
+        capacity = max_entries;
+
+        return 0;
+    }
+
+
+    /*
+     * call handler, from the watcher thread, with the path of every entry
+     * of a watched directory that is created, removed or renamed, and of
+     * every watched directory that is moved or removed itself, so that
+     * whatever else is keyed by those names can be dropped. Must be called
+     * before Start.
+     */
+    void OnNameChange(function<void(const string &)> handler) {
+        name_changed = handler;
+    }
+
+
+    /*
+     * look up path in the cache.
+     *
+     * returns true on a hit, in which case statbuf and err are filled in
+     * from the cached entry
+     */
+    bool Lookup(const string &path, struct stat *statbuf, int *err) {
+        bool hit = false;
+
+        pthread_mutex_lock(&cache_mutex);
+
+        auto it = entries.find(Key(path));
+        if (it != entries.end()) {
+            StatCacheEntry *entry = it->second;
+            lru.splice(lru.begin(), lru, entry->lru_pos);
+            memcpy(statbuf, &entry->attr, sizeof(struct stat));
+            *err = entry->err;
+            hit = true;
+        }
+
+        pthread_mutex_unlock(&cache_mutex);
+
+        return hit;
+    }
+
+
+    /*
+     * get ready to stat path after a miss: watch the directories down to it,
+     * so that any change from here on is seen, and fill in token for Insert.
+     *
+     * returns false if path can't be cached
+     */
+    bool Prepare(const string &path, StatCacheToken *token) {
+        bool ready;
+        string key = Key(path);
+
+        if (capacity == 0 || key.compare(0, root.size(), root) != 0) {
+            return false;
+        }
+
+        pthread_mutex_lock(&cache_mutex);
+
+        token->tree_generation = tree_generation;
+
+        // every directory from the root down to the one holding path, the
+        // root being its own parent
+        ready = Watch(root, &token->wd, &token->generation);
+        for (size_t pos = root.size(); ready; ) {
+            size_t next = key.find('/', pos + 1);
+            if (next == string::npos) {
+                break;
+            }
+            ready = Watch(key.substr(0, next), &token->wd,
+                          &token->generation);
+            pos = next;
+        }
+
+        auto own = watch_paths.find(key);
+        if (own != watch_paths.end()) {
+            token->own_wd = own->second;
+            token->own_generation = watches[own->second].generation;
+        } else {
+            token->own_wd = -1;
+        }
+
+        pthread_mutex_unlock(&cache_mutex);
+
+        return ready;
+    }
+
+
+    /*
+     * cache the result of stat'ing path after Prepare filled in token: the
+     * attributes in statbuf, or the errno in err if the stat failed. The
+     * result is dropped if anything may have changed since Prepare.
+     */
+    void Insert(const string &path, const struct stat *statbuf, int err,
+                const StatCacheToken &token) {
+        string key = Key(path);
+
+        if (err != 0 && err != ENOENT) {
+            return;
+        }
+        if (err == 0 && !S_ISDIR(statbuf->st_mode) && statbuf->st_nlink > 1) {
+            return;
+        }
+
+        pthread_mutex_lock(&cache_mutex);
+
+        if (!Current(token)) {
+            pthread_mutex_unlock(&cache_mutex);
+            return;
+        }
+
+        if (err == 0 && S_ISDIR(statbuf->st_mode) && token.own_wd == -1) {
+            // its own times change with its entries, which we only hear
+            // about once it is watched. Cache it the next time round.
+            int wd;
+            unsigned long generation;
+            Watch(key, &wd, &generation);
+            pthread_mutex_unlock(&cache_mutex);
+            return;
+        }
+
+        StatCacheEntry *entry;
+
+        auto it = entries.find(key);
+        if (it != entries.end()) {
+            entry = it->second;
+            lru.splice(lru.begin(), lru, entry->lru_pos);
+        } else {
+            while (lru.size() >= capacity) {
+                Remove(lru.back());
+            }
+            entry = new StatCacheEntry();
+            entry->path = key;
+            lru.push_front(entry);
+            entry->lru_pos = lru.begin();
+            entries[key] = entry;
+        }
+
+        if (err == 0) {
+            memcpy(&entry->attr, statbuf, sizeof(struct stat));
+        } else {
+            memset(&entry->attr, 0, sizeof(struct stat));
+        }
+        entry->err = err;
+
+        pthread_mutex_unlock(&cache_mutex);
+    }
+
+
+    /*
+     * forget the attributes of path
+     */
+    void Invalidate(const string &path) {
+        pthread_mutex_lock(&cache_mutex);
+        InvalidateLocked(Key(path));
+        pthread_mutex_unlock(&cache_mutex);
+    }
+
+
+    /*
+     * path was created, removed or renamed: forget it, everything under it,
+     * and the directory holding it
+     */
+    void InvalidateEntry(const string &path) {
+        string key = Key(path);
+
+        pthread_mutex_lock(&cache_mutex);
+        InvalidateTreeLocked(key);
+        InvalidateLocked(ParentOf(key));
+        pthread_mutex_unlock(&cache_mutex);
+    }
+
+
+private:
+    size_t capacity;
+    string root;
+
+    // most recently used entries are at the front
+    list<StatCacheEntry *> lru;
+    // ordered, so everything under a directory can be found
+    map<string, StatCacheEntry *> entries;
+
+    int inotify_fd;
+    unordered_map<int, DirWatch> watches;
+    // ordered like entries
+    map<string, int> watch_paths;
+
+    // goes up whenever watches are dropped
+    unsigned long tree_generation;
+
+    function<void(const string &)> name_changed;
+
+    pthread_t watcher;
+    bool watcher_running;
+    // closed to stop the watcher thread
+    int stop_pipe[2];
+
+    pthread_mutex_t cache_mutex;
+
+
+    /*
+     * the server path of the root directory ends in a slash, drop it
+     */
+    static string Key(const string &path) {
+        if (path.size() > 1 && path.back() == '/') {
+            return path.substr(0, path.size() - 1);
+        }
+        return path;
+    }
+
+
+    static string ParentOf(const string &path) {
+        size_t pos = path.find_last_of('/');
+        if (pos == string::npos || pos == 0) {
+            return "/";
+        }
+        return path.substr(0, pos);
+    }
+
+
+    // caller holds cache_mutex
+    bool Current(const StatCacheToken &token) {
+        if (token.tree_generation != tree_generation) {
+            return false;
+        }
+
+        auto it = watches.find(token.wd);
+        if (it == watches.end() || it->second.generation != token.generation) {
+            return false;
+        }
+
+        if (token.own_wd != -1) {
+            it = watches.find(token.own_wd);
+            if (it == watches.end() ||
+                it->second.generation != token.own_generation) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+
+    /*
+     * make sure dir is watched, and return its watch and generation.
+     * Caller holds cache_mutex.
+     *
+     * returns false if it can't be watched
+     */
+    bool Watch(const string &dir, int *wd, unsigned long *generation) {
+        auto it = watch_paths.find(dir);
+        if (it != watch_paths.end()) {
+            *wd = it->second;
+            *generation = watches[it->second].generation;
+            return true;
+        }
+
+        if (watches.size() >= STAT_CACHE_MAX_WATCHES) {
+            DropUnusedWatches();
+            if (watches.size() >= STAT_CACHE_MAX_WATCHES) {
+                return false;
+            }
+        }
+
+        int new_wd = inotify_add_watch(inotify_fd, dir.c_str(),
+                                       STAT_CACHE_EVENTS | IN_ONLYDIR);
+        if (new_wd == -1) {
+            return false;
+        }
+
+        // the same directory under another name, e.g. through a symlink
+        auto existing = watches.find(new_wd);
+        if (existing != watches.end()) {
+            *wd = new_wd;
+            *generation = existing->second.generation;
+            return existing->second.path == dir;
+        }
+
+        DirWatch &watch = watches[new_wd];
+        watch.path = dir;
+        watch.generation = 0;
+        watch_paths[dir] = new_wd;
+
+        *wd = new_wd;
+        *generation = 0;
+
+        return true;
+    }
+
+
+    /*
+     * stop watching directories nothing is cached in or under. Caller holds
+     * cache_mutex.
+     */
+    void DropUnusedWatches() {
+        for (auto it = watches.begin(); it != watches.end(); ) {
+            const string &dir = it->second.path;
+            string prefix = dir + "/";
+
+            auto below = entries.lower_bound(prefix);
+            if (entries.count(dir) != 0 ||
+                (below != entries.end() &&
+                 below->first.compare(0, prefix.size(), prefix) == 0)) {
+                ++it;
+                continue;
+            }
+
+            inotify_rm_watch(inotify_fd, it->first);
+            watch_paths.erase(dir);
+            it = watches.erase(it);
+        }
+
+        // a Prepare may have been counting on one of them
+        tree_generation++;
+    }
+
+
+    // caller holds cache_mutex
+    void Remove(StatCacheEntry *entry) {
+        entries.erase(entry->path);
+        lru.erase(entry->lru_pos);
+        delete entry;
+    }
+
+
+    // caller holds cache_mutex
+    void Bump(const string &dir) {
+        auto it = watch_paths.find(dir);
+        if (it != watch_paths.end()) {
+            watches[it->second].generation++;
+        }
+    }
+
+
+    // caller holds cache_mutex
+    void InvalidateLocked(const string &path) {
+        Bump(ParentOf(path));
+        Bump(path);
+
+        auto it = entries.find(path);
+        if (it != entries.end()) {
+            Remove(it->second);
+        }
+    }
+
+
+    /*
+     * drop path and everything under it, along with the watches on them,
+     * which would otherwise keep following the directories to wherever they
+     * were moved. Caller holds cache_mutex.
+     */
+    void InvalidateTreeLocked(const string &path) {
+        string prefix = path + "/";
+
+        InvalidateLocked(path);
+
+        auto it = entries.lower_bound(prefix);
+        while (it != entries.end() &&
+               it->first.compare(0, prefix.size(), prefix) == 0) {
+            StatCacheEntry *entry = it->second;
+            ++it;
+            Remove(entry);
+        }
+
+        bool dropped = DropWatch(path);
+        auto watch = watch_paths.lower_bound(prefix);
+        while (watch != watch_paths.end() &&
+               watch->first.compare(0, prefix.size(), prefix) == 0) {
+            int wd = watch->second;
+            ++watch;
+            inotify_rm_watch(inotify_fd, wd);
+            watch_paths.erase(watches[wd].path);
+            watches.erase(wd);
+            dropped = true;
+        }
+
+        // only Prepares that watched something under path could be affected
+        if (dropped) {
+            tree_generation++;
+        }
+    }
+
+
+    /*
+     * stop watching dir. Caller holds cache_mutex.
+     *
+     * returns whether it was being watched
+     */
+    bool DropWatch(const string &dir) {
+        auto it = watch_paths.find(dir);
+        if (it == watch_paths.end()) {
+            return false;
+        }
+
+        inotify_rm_watch(inotify_fd, it->second);
+        watches.erase(it->second);
+        watch_paths.erase(it);
+
+        return true;
+    }
+
+
+    void HandleEvent(const struct inotify_event *event) {
+        // a name that now leads somewhere else, or nowhere
+        string changed;
+        bool name_change = false;
+
+        pthread_mutex_lock(&cache_mutex);
+
+        if (event->mask & IN_Q_OVERFLOW) {
+            // events were lost, nothing can be trusted
+            while (!lru.empty()) {
+                Remove(lru.back());
+            }
+            tree_generation++;
+            changed = root;
+            name_change = true;
+        } else {
+            auto it = watches.find(event->wd);
+            if (it != watches.end()) {
+                name_change = HandleWatchEvent(event, it->second.path,
+                                               &changed);
+            }
+        }
+
+        pthread_mutex_unlock(&cache_mutex);
+
+        if (name_change && name_changed) {
+            name_changed(changed);
+        }
+    }
+
+
+    /*
+     * handle an event on the watched directory dir. Caller holds
+     * cache_mutex.
+     *
+     * returns whether a name changed, stored in changed
+     */
+    bool HandleWatchEvent(const struct inotify_event *event, string dir,
+                          string *changed) {
+        if (event->len > 0) {
+            string child = dir + "/" + event->name;
+            uint32_t name_events = IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+                                   IN_MOVED_TO;
+
+            if ((event->mask & IN_ISDIR) &&
+                (event->mask & (IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO))) {
+                InvalidateTreeLocked(child);
+            } else {
+                InvalidateLocked(child);
+            }
+
+            // the directory's own times and link count change as well
+            if (event->mask & name_events) {
+                InvalidateLocked(dir);
+                *changed = child;
+                return true;
+            }
+        } else if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF |
+                                  IN_IGNORED)) {
+            InvalidateTreeLocked(dir);
+            *changed = dir;
+            return true;
+        } else {
+            InvalidateLocked(dir);
+        }
+
+        return false;
+    }
+
+
+    /*
+     * body of the thread reading inotify events, which runs until the stop
+     * pipe is closed
+     */
+    static void *Watcher(void *arg) {
+        StatCache *cache = (StatCache *)arg;
+        char buf[64 * (sizeof(struct inotify_event) + NAME_MAX + 1)]
+            __attribute__((aligned(__alignof__(struct inotify_event))));
+
+        for (;;) {
+            struct pollfd fds[2];
+            fds[0].fd = cache->inotify_fd;
+            fds[0].events = POLLIN;
+            fds[1].fd = cache->stop_pipe[0];
+            fds[1].events = POLLIN;
+
+            if (poll(fds, 2, -1) == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                break;
+            }
+            if (fds[1].revents != 0) {
+                break;
+            }
+
+            ssize_t len = read(cache->inotify_fd, buf, sizeof buf);
+            if (len <= 0) {
+                if (len == -1 && (errno == EINTR || errno == EAGAIN)) {
+                    continue;
+                }
+                break;
+            }
+
+            for (char *pos = buf; pos < buf + len; ) {
+                struct inotify_event *event = (struct inotify_event *)pos;
+                cache->HandleEvent(event);
+                pos += sizeof(struct inotify_event) + event->len;
+            }
+        }
+
+        return NULL;
+    }
+};
+
+#endif // __WATFS_STAT_CACHE__
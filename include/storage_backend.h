@@ -0,0 +1,152 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <string>
+#include <vector>
+
+using namespace std;
+
+#ifndef __WATFS_STORAGE_BACKEND__
+#define __WATFS_STORAGE_BACKEND__
+
+
+/*
+ * pread until count bytes are read or we hit end of file, retrying on short
+ * reads and EINTR.
+ *
+ * returns the number of bytes read, or -1 with errno set on error
+ */
+static inline ssize_t pread_full(int fd, char *buf, size_t count, off_t offset)
+{
+    size_t total = 0;
+
+    while (total < count) {
+        ssize_t res = pread(fd, buf + total, count - total, offset + total);
+        if (res == -1 && errno == EINTR) {
+            continue;
+        } else if (res == -1) {
+            return -1;
+        } else if (res == 0) {
+            break;
+        }
+        total += res;
+    }
+
+    return total;
+}
+
+
+/*
+ * pwrite all count bytes, retrying on short writes and EINTR.
+ *
+ * returns the number of bytes written, or -1 with errno set on error
+ */
+static inline ssize_t pwrite_full(int fd, const char *buf, size_t count,
+                                  off_t offset)
+{
+    size_t total = 0;
+
+    while (total < count) {
+        ssize_t res = pwrite(fd, buf + total, count - total, offset + total);
+        if (res == -1 && errno == EINTR) {
+            continue;
+        } else if (res == -1) {
+            return -1;
+        }
+        total += res;
+    }
+
+    return total;
+}
+
+
+/*
+ * The file I/O the server's data path does, so that it can be handed to the
+ * kernel in different ways. Methods are called from many I/O threads at
+ * once and block until the operation is done. They follow the conventions
+ * of the system calls they replace: -1 with errno set on error.
+ */
+class StorageBackend {
+public:
+    virtual ~StorageBackend() {}
+
+    virtual const char *Name() = 0;
+
+    /*
+     * read until count bytes are read or end of file, like pread_full
+     */
+    virtual ssize_t Read(int fd, char *buf, size_t count, off_t offset) = 0;
+
+    /*
+     * write all count bytes, like pwrite_full
+     */
+    virtual ssize_t Write(int fd, const char *buf, size_t count,
+                          off_t offset) = 0;
+
+    /*
+     * fdatasync fd
+     */
+    virtual int Sync(int fd) = 0;
+
+    /*
+     * stat path, following symbolic links
+     */
+    virtual int Stat(const string &path, struct stat *statbuf) = 0;
+
+    /*
+     * stat name in the directory open at dirfd, following symbolic links
+     */
+    virtual int StatAt(int dirfd, const char *name, struct stat *statbuf) = 0;
+
+    /*
+     * fdatasync each of fds, storing errno, or 0 on success, for each of them
+     * in errors. Backends that can have several syncs in flight at once
+     * start them all before waiting.
+     */
+    virtual void SyncFiles(const vector<int> &fds, vector<int> *errors) {
+        errors->assign(fds.size(), 0);
+        for (size_t i = 0; i < fds.size(); i++) {
+            if (Sync(fds[i]) == -1) {
+                (*errors)[i] = errno;
+            }
+        }
+    }
+};
+
+
+/*
+ * The blocking system calls, one at a time on the calling thread. Always
+ * available, so it is what we fall back to.
+ */
+class PosixBackend : public StorageBackend {
+public:
+    const char *Name() override {
+        return "posix";
+    }
+
+    ssize_t Read(int fd, char *buf, size_t count, off_t offset) override {
+        return pread_full(fd, buf, count, offset);
+    }
+
+    ssize_t Write(int fd, const char *buf, size_t count,
+                  off_t offset) override {
+        return pwrite_full(fd, buf, count, offset);
+    }
+
+    int Sync(int fd) override {
+        return fdatasync(fd);
+    }
+
+    int Stat(const string &path, struct stat *statbuf) override {
+        return stat(path.c_str(), statbuf);
+    }
+
+    int StatAt(int dirfd, const char *name, struct stat *statbuf) override {
+        return fstatat(dirfd, name, statbuf, 0);
+    }
+};
+
+#endif // __WATFS_STORAGE_BACKEND__
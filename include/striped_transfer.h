@@ -0,0 +1,125 @@
+#include <pthread.h>
+
+#include <functional>
+#include <vector>
+
+using namespace std;
+
+#ifndef __WATFS_STRIPED_TRANSFER__
+#define __WATFS_STRIPED_TRANSFER__
+
+
+// reads and writes bigger than this are split into stripes this size
+#define STRIPE_DEFAULT_SIZE     (256 << 10)
+// most stripes of one transfer in flight at once, 1 turns striping off
+#define STRIPE_DEFAULT_WIDTH    4
+
+
+/*
+ * A read or write of [offset, offset + size) split into stripes that are
+ * moved over separate streams at the same time. Each thread working on the
+ * transfer calls Work, which claims stripes in order and runs op on them
+ * until none are left; op returns the number of bytes moved or -errno.
+ *
+ * Every stripe owns its own slice of the caller's buffer, so the data comes
+ * back in order however the stripes finish. The results are kept per stripe
+ * for the caller to put together once Wait returns.
+ */
+class StripedTransfer {
+public:
+    vector<long> results;
+
+    StripedTransfer(long offset, long size, long stripe_size,
+                    function<long(long, long)> stripe_op) :
+        start(offset), length(size), stripe(stripe_size), op(stripe_op),
+        next(0), remaining(0) {
+
+        count = (size + stripe_size - 1) / stripe_size;
+        remaining = count;
+        results.assign(count, 0);
+
+        pthread_mutex_init(&transfer_mutex, NULL);
+        pthread_cond_init(&all_done, NULL);
+    }
+
+    ~StripedTransfer() {
+        pthread_cond_destroy(&all_done);
+        pthread_mutex_destroy(&transfer_mutex);
+    }
+
+
+    long Count() {
+        return count;
+    }
+
+
+    /*
+     * size of stripe index, the last one may be short
+     */
+    long StripeSize(long index) {
+        return min(stripe, length - index * stripe);
+    }
+
+
+    /*
+     * run stripes until they have all been claimed
+     */
+    void Work() {
+        long index;
+
+        while (Claim(&index)) {
+            long res = op(start + index * stripe, StripeSize(index));
+
+            pthread_mutex_lock(&transfer_mutex);
+            results[index] = res;
+            if (--remaining == 0) {
+                pthread_cond_broadcast(&all_done);
+            }
+            pthread_mutex_unlock(&transfer_mutex);
+        }
+    }
+
+
+    /*
+     * wait for every stripe to finish
+     */
+    void Wait() {
+        pthread_mutex_lock(&transfer_mutex);
+        while (remaining > 0) {
+            pthread_cond_wait(&all_done, &transfer_mutex);
+        }
+        pthread_mutex_unlock(&transfer_mutex);
+    }
+
+
+private:
+    long start;
+    long length;
+    long stripe;
+    function<long(long, long)> op;
+
+    long count;
+    // first stripe nobody has claimed
+    long next;
+    // stripes that haven't finished
+    long remaining;
+
+    pthread_mutex_t transfer_mutex;
+    pthread_cond_t all_done;
+
+
+    bool Claim(long *index) {
+        bool claimed = false;
+
+        pthread_mutex_lock(&transfer_mutex);
+        if (next < count) {
+            *index = next++;
+            claimed = true;
+        }
+        pthread_mutex_unlock(&transfer_mutex);
+
+        return claimed;
+    }
+};
+
+#endif // __WATFS_STRIPED_TRANSFER__
@@ -0,0 +1,623 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <linux/io_uring.h>
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "storage_backend.h"
+
+using namespace std;
+
+#ifndef __WATFS_URING_BACKEND__
+#define __WATFS_URING_BACKEND__
+
+
+// submission queue entries, which is also the most requests in flight
+#define URING_DEFAULT_ENTRIES   256
+// pause before the reaper waits again after io_uring_enter failed
+#define URING_RETRY_US          1000
+
+
+/*
+ * A request submitted to the ring, and its result once it completes.
+ */
+class UringRequest {
+public:
+    int res;
+    bool done;
+    pthread_cond_t completed;
+
+    UringRequest() : res(0), done(false) {
+        pthread_cond_init(&completed, NULL);
+    }
+
+    ~UringRequest() {
+        pthread_cond_destroy(&completed);
+    }
+};
+
+
+/*
+ * Storage backend that hands reads, writes, fsyncs and stats to the kernel
+ * through one io_uring shared by every I/O thread.
+ *
+ * Threads put their requests on the submission queue under ring_mutex. The
+ * first one to find nobody submitting calls io_uring_enter for everything
+ * queued so far, and keeps going until the queue is empty, so requests from
+ * concurrent RPCs go into the kernel together with one system call. A
+ * reaper thread waits for completions and wakes up the threads waiting for
+ * them.
+ *
+ * We talk to the kernel with the raw system calls, so there is nothing to
+ * link against. Open fails on kernels without io_uring, or without one of
+ * the operations we need, and the server falls back to PosixBackend.
+ *
+ * If io_uring_enter fails, the requests the kernel didn't take fail with its
+ * errno, and the handlers waiting for them return an error to the client. A
+ * ring that can't be used any more fails every request after that with EIO.
+ */
+class UringBackend : public StorageBackend {
+public:
+    unsigned long submits;
+    unsigned long requests;
+
+    UringBackend() : submits(0), requests(0), ring_fd(-1), sq_ring(NULL),
+                     sqes(NULL), cq_ring(NULL), in_flight(0), unsubmitted(0),
+                     submitting(false), broken(0), reaper_running(false) {
+
+        pthread_mutex_init(&ring_mutex, NULL);
+        pthread_cond_init(&slot_free, NULL);
+    }
+
+    ~UringBackend() {
+        if (reaper_running) {
+            // stop_request tells the reaper to exit. A broken ring can't
+            // take it, and the reaper exits once nothing is in flight.
+            pthread_mutex_lock(&ring_mutex);
+            do {
+                stop_request.done = false;
+                Queue([](struct io_uring_sqe *sqe) {
+                    sqe->opcode = IORING_OP_NOP;
+                }, &stop_request);
+                Submit();
+                while (!stop_request.done) {
+                    pthread_cond_wait(&stop_request.completed, &ring_mutex);
+                }
+            } while (stop_request.res < 0 && broken == 0);
+            pthread_mutex_unlock(&ring_mutex);
+
+            pthread_join(reaper, NULL);
+        }
+
+        if (sqes != NULL) {
+            munmap(sqes, params.sq_entries * sizeof(struct io_uring_sqe));
+        }
+        if (cq_ring != NULL && cq_ring != sq_ring) {
+            munmap(cq_ring, cq_ring_size);
+        }
+        if (sq_ring != NULL) {
+            munmap(sq_ring, sq_ring_size);
+        }
+        if (ring_fd != -1) {
+            close(ring_fd);
+        }
+
+        pthread_cond_destroy(&slot_free);
+        pthread_mutex_destroy(&ring_mutex);
+    }
+
+
+    /*
+     * set up a ring with room for entries requests and start the reaper.
+     *
+     * returns 0 on success, or -errno if io_uring can't be used
+     */
+    int Open(unsigned entries) {
+        memset(&params, 0, sizeof params);
+
+        ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+        if (ring_fd == -1) {
+            return -errno;
+        }
+
+        if (!Supported()) {
+            return -EOPNOTSUPP;
+        }
+
+        sq_ring_size = params.sq_off.array +
+                       params.sq_entries * sizeof(unsigned);
+        cq_ring_size = params.cq_off.cqes +
+                       params.cq_entries * sizeof(struct io_uring_cqe);
+
+        // newer kernels map both rings at once
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+            sq_ring_size = max(sq_ring_size, cq_ring_size);
+            cq_ring_size = sq_ring_size;
+        }
+
+        sq_ring = MapRing(sq_ring_size, IORING_OFF_SQ_RING);
+        if (sq_ring == NULL) {
+            return -errno;
+        }
+
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+            cq_ring = sq_ring;
+        } else {
+            cq_ring = MapRing(cq_ring_size, IORING_OFF_CQ_RING);
+            if (cq_ring == NULL) {
+                return -errno;
+            }
+        }
+
+        sqes = (struct io_uring_sqe *)MapRing(
+            params.sq_entries * sizeof(struct io_uring_sqe), IORING_OFF_SQES);
+        if (sqes == NULL) {
+            return -errno;
+        }
+
+        sq_head = (unsigned *)(sq_ring + params.sq_off.head);
+        sq_tail = (unsigned *)(sq_ring + params.sq_off.tail);
+        sq_mask = *(unsigned *)(sq_ring + params.sq_off.ring_mask);
+        sq_array = (unsigned *)(sq_ring + params.sq_off.array);
+
+        cq_head = (unsigned *)(cq_ring + params.cq_off.head);
+        cq_tail = (unsigned *)(cq_ring + params.cq_off.tail);
+        cq_mask = *(unsigned *)(cq_ring + params.cq_off.ring_mask);
+        cqes = (struct io_uring_cqe *)(cq_ring + params.cq_off.cqes);
+
+        int err = pthread_create(&reaper, NULL, Reaper, this);
+        if (err != 0) {
+            return -err;
+        }
+        reaper_running = true;
+
+        return 0;
+    }
+
+
+    const char *Name() override {
+        return "io_uring";
+    }
+
+
+    ssize_t Read(int fd, char *buf, size_t count, off_t offset) override {
+        size_t total = 0;
+
+        while (total < count) {
+            int res = Execute([&](struct io_uring_sqe *sqe) {
+                sqe->opcode = IORING_OP_READ;
+                sqe->fd = fd;
+                sqe->addr = (uint64_t)(buf + total);
+                sqe->len = count - total;
+                sqe->off = offset + total;
+            });
+
+            if (res == -EINTR || res == -EAGAIN) {
+                continue;
+            } else if (res < 0) {
+                errno = -res;
+                return -1;
+            } else if (res == 0) {
+                break;
+            }
+            total += res;
+        }
+
+        return total;
+    }
+
+
+    ssize_t Write(int fd, const char *buf, size_t count,
+                  off_t offset) override {
+        size_t total = 0;
+
+        while (total < count) {
+            int res = Execute([&](struct io_uring_sqe *sqe) {
+                sqe->opcode = IORING_OP_WRITE;
+                sqe->fd = fd;
+                sqe->addr = (uint64_t)(buf + total);
+                sqe->len = count - total;
+                sqe->off = offset + total;
+            });
+
+            if (res == -EINTR || res == -EAGAIN) {
+                continue;
+            } else if (res < 0) {
+                errno = -res;
+                return -1;
+            }
+            total += res;
+        }
+
+        return total;
+    }
+
+
+    int Sync(int fd) override {
+        int res = Execute([&](struct io_uring_sqe *sqe) {
+            PrepareSync(sqe, fd);
+        });
+
+        if (res < 0) {
+            errno = -res;
+            return -1;
+        }
+
+        return 0;
+    }
+
+
+    /*
+     * every sync is submitted before we wait for the first one, so the
+     * device can work on all of them at once
+     */
+    void SyncFiles(const vector<int> &fds, vector<int> *errors) override {
+        vector<UringRequest> syncs(fds.size());
+
+        pthread_mutex_lock(&ring_mutex);
+
+        for (size_t i = 0; i < fds.size(); i++) {
+            int fd = fds[i];
+            Queue([&](struct io_uring_sqe *sqe) {
+                PrepareSync(sqe, fd);
+            }, &syncs[i]);
+        }
+        Submit();
+
+        errors->assign(fds.size(), 0);
+        for (size_t i = 0; i < fds.size(); i++) {
+            while (!syncs[i].done) {
+                pthread_cond_wait(&syncs[i].completed, &ring_mutex);
+            }
+            if (syncs[i].res < 0) {
+                (*errors)[i] = -syncs[i].res;
+            }
+        }
+
+        pthread_mutex_unlock(&ring_mutex);
+    }
+
+
+    int Stat(const string &path, struct stat *statbuf) override {
+        return StatAt(AT_FDCWD, path.c_str(), statbuf);
+    }
+
+
+    int StatAt(int dirfd, const char *name, struct stat *statbuf) override {
+        struct statx stx;
+
+        int res = Execute([&](struct io_uring_sqe *sqe) {
+            sqe->opcode = IORING_OP_STATX;
+            sqe->fd = dirfd;
+            sqe->addr = (uint64_t)name;
+            sqe->len = STATX_BASIC_STATS;
+            sqe->addr2 = (uint64_t)&stx;
+        });
+
+        if (res < 0) {
+            errno = -res;
+            return -1;
+        }
+
+        memset(statbuf, 0, sizeof *statbuf);
+        statbuf->st_dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+        statbuf->st_ino = stx.stx_ino;
+        statbuf->st_mode = stx.stx_mode;
+        statbuf->st_nlink = stx.stx_nlink;
+        statbuf->st_uid = stx.stx_uid;
+        statbuf->st_gid = stx.stx_gid;
+        statbuf->st_rdev = makedev(stx.stx_rdev_major, stx.stx_rdev_minor);
+        statbuf->st_size = stx.stx_size;
+        statbuf->st_blksize = stx.stx_blksize;
+        statbuf->st_blocks = stx.stx_blocks;
+        statbuf->st_atim.tv_sec = stx.stx_atime.tv_sec;
+        statbuf->st_atim.tv_nsec = stx.stx_atime.tv_nsec;
+        statbuf->st_mtim.tv_sec = stx.stx_mtime.tv_sec;
+        statbuf->st_mtim.tv_nsec = stx.stx_mtime.tv_nsec;
+        statbuf->st_ctim.tv_sec = stx.stx_ctime.tv_sec;
+        statbuf->st_ctim.tv_nsec = stx.stx_ctime.tv_nsec;
+
+        return 0;
+    }
+
+
+private:
+    int ring_fd;
+    struct io_uring_params params;
+
+    char *sq_ring;
+    size_t sq_ring_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+
+    char *cq_ring;
+    size_t cq_ring_size;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+
+    // submitted to the kernel or queued, but not completed
+    unsigned in_flight;
+    // queued but not submitted yet
+    unsigned unsubmitted;
+    // somebody is in io_uring_enter submitting the queue
+    bool submitting;
+    // errno that made the ring unusable, 0 while it works
+    int broken;
+
+    // the request that stops the reaper
+    UringRequest stop_request;
+
+    pthread_t reaper;
+    bool reaper_running;
+
+    pthread_mutex_t ring_mutex;
+    pthread_cond_t slot_free;
+
+
+    /*
+     * check that the kernel has every operation we use
+     */
+    bool Supported() {
+        static const int ops[] = { IORING_OP_READ, IORING_OP_WRITE,
+                                   IORING_OP_FSYNC, IORING_OP_STATX };
+        size_t probe_size = sizeof(struct io_uring_probe) +
+                            256 * sizeof(struct io_uring_probe_op);
+        struct io_uring_probe *probe;
+        bool supported = true;
+
+        probe = (struct io_uring_probe *)calloc(1, probe_size);
+        if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE,
+                    probe, 256) == -1) {
+            free(probe);
+            return false;
+        }
+
+        for (int op : ops) {
+            if (op >= probe->ops_len ||
+                !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+                supported = false;
+            }
+        }
+
+        free(probe);
+
+        return supported;
+    }
+
+    /*
+     * returns the mapping, or NULL with errno set
+     */
+    char *MapRing(size_t size, off_t offset) {
+        void *map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring_fd, offset);
+        if (map == MAP_FAILED) {
+            return NULL;
+        }
+        return (char *)map;
+    }
+
+    static void PrepareSync(struct io_uring_sqe *sqe, int fd) {
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->fd = fd;
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+    }
+
+    /*
+     * put a request filled in by prepare on the submission queue, waiting
+     * for room if too many are in flight. request is woken up when it
+     * completes. Caller holds ring_mutex.
+     */
+    void Queue(const function<void(struct io_uring_sqe *)> &prepare,
+               UringRequest *request) {
+        while (in_flight >= params.sq_entries && broken == 0) {
+            // what we queued ourselves may be all that is in flight
+            Submit();
+            pthread_cond_wait(&slot_free, &ring_mutex);
+        }
+
+        if (broken != 0) {
+            Complete(request, -EIO);
+            return;
+        }
+
+        unsigned tail = *sq_tail;
+        unsigned index = tail & sq_mask;
+        struct io_uring_sqe *sqe = &sqes[index];
+
+        memset(sqe, 0, sizeof *sqe);
+        prepare(sqe);
+        sqe->user_data = (uint64_t)request;
+        sq_array[index] = index;
+
+        // the kernel must see the entry before it sees the new tail
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+        in_flight++;
+        unsubmitted++;
+        requests++;
+    }
+
+    /*
+     * hand everything queued to the kernel, unless another thread is doing
+     * that already, in which case it picks up our requests too. Caller holds
+     * ring_mutex, which is dropped around io_uring_enter.
+     */
+    void Submit() {
+        if (submitting) {
+            return;
+        }
+        submitting = true;
+
+        while (unsubmitted > 0) {
+            unsigned count = unsubmitted;
+            unsubmitted = 0;
+
+            pthread_mutex_unlock(&ring_mutex);
+            int res = syscall(__NR_io_uring_enter, ring_fd, count, 0, 0,
+                              NULL, 0);
+            int err = errno;
+            pthread_mutex_lock(&ring_mutex);
+
+            submits++;
+
+            if (res == -1 && err != EINTR && err != EAGAIN && err != EBUSY) {
+                errno = err;
+                perror("io_uring_enter");
+                if (Unusable(err)) {
+                    broken = err;
+                }
+                FailUnsubmitted(err);
+                break;
+            }
+            if (res == -1) {
+                res = 0;
+                sched_yield();
+            }
+
+            // whatever the kernel didn't take goes round again
+            unsubmitted += count - res;
+        }
+
+        submitting = false;
+    }
+
+    /*
+     * fail every request on the submission queue the kernel hasn't taken
+     * with err. Nobody else is submitting, so the kernel won't look at the
+     * queue while we take them off. Caller holds ring_mutex.
+     */
+    void FailUnsubmitted(int err) {
+        unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+        unsigned tail = *sq_tail;
+
+        for (unsigned pos = head; pos != tail; pos++) {
+            struct io_uring_sqe *sqe = &sqes[sq_array[pos & sq_mask]];
+            Complete((UringRequest *)sqe->user_data, -err);
+            in_flight--;
+        }
+
+        __atomic_store_n(sq_tail, head, __ATOMIC_RELEASE);
+        unsubmitted = 0;
+
+        pthread_cond_broadcast(&slot_free);
+    }
+
+    /*
+     * wake up whoever waits for request with result res. Caller holds
+     * ring_mutex.
+     */
+    static void Complete(UringRequest *request, int res) {
+        request->res = res;
+        request->done = true;
+        pthread_cond_signal(&request->completed);
+    }
+
+    /*
+     * returns whether io_uring_enter failing with err means the ring itself
+     * is unusable, rather than short of memory for a moment
+     */
+    static bool Unusable(int err) {
+        return err == EBADF || err == EFAULT || err == EINVAL ||
+               err == ENXIO || err == EOPNOTSUPP;
+    }
+
+    /*
+     * queue one request, submit it, and wait for it to complete.
+     *
+     * returns the result, negative errno on failure
+     */
+    int Execute(const function<void(struct io_uring_sqe *)> &prepare) {
+        UringRequest request;
+
+        pthread_mutex_lock(&ring_mutex);
+
+        Queue(prepare, &request);
+        Submit();
+
+        while (!request.done) {
+            pthread_cond_wait(&request.completed, &ring_mutex);
+        }
+
+        pthread_mutex_unlock(&ring_mutex);
+
+        return request.res;
+    }
+
+    /*
+     * body of the reaper thread, which hands completions to the threads
+     * waiting for them
+     */
+    static void *Reaper(void *arg) {
+        UringBackend *ring = (UringBackend *)arg;
+        bool stopping = false;
+
+        while (!stopping) {
+            int res = syscall(__NR_io_uring_enter, ring->ring_fd, 0, 1,
+                              IORING_ENTER_GETEVENTS, NULL, 0);
+            int err = errno;
+
+            // the kernel still owns the requests in flight and may write to
+            // their buffers, so they can't be failed early. Keep collecting
+            // whatever completes.
+            if (res == -1 && err != EINTR) {
+                errno = err;
+                perror("io_uring_enter");
+                usleep(URING_RETRY_US);
+            }
+
+            pthread_mutex_lock(&ring->ring_mutex);
+
+            if (res == -1 && Unusable(err)) {
+                ring->broken = err;
+            }
+
+            unsigned head = *ring->cq_head;
+            unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+            for (; head != tail; head++) {
+                struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+                UringRequest *request = (UringRequest *)cqe->user_data;
+
+                ring->in_flight--;
+
+                if (request == &ring->stop_request) {
+                    stopping = true;
+                }
+                Complete(request, cqe->res);
+            }
+
+            // nobody is left to wait for
+            if (ring->broken != 0 && ring->in_flight == 0) {
+                stopping = true;
+            }
+
+            // the kernel can reuse the entries we have seen
+            __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+            pthread_cond_broadcast(&ring->slot_free);
+            pthread_mutex_unlock(&ring->ring_mutex);
+        }
+
+        return NULL;
+    }
+};
+
+#endif // __WATFS_URING_BACKEND__
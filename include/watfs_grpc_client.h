@@ -7,17 +7,41 @@
 #include <fuse.h>
 #include <pthread.h>
 
+#include <atomic>
+#include <deque>
 #include <iostream>
 #include <memory>
 #include <string>
+#include <vector>
 
 #include <grpc++/grpc++.h>
 #include <grpc++/channel.h>
 #include <grpc++/client_context.h>
 #include <grpc++/create_channel.h>
 #include <grpc++/security/credentials.h>
-
+#include <grpcpp/generic/generic_stub.h>
+#include <grpcpp/support/proto_buffer_reader.h>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/wire_format_lite.h>
+
+#include "async_call_queue.h"
+#include "attr_cache.h"
+#include "block_cache.h"
+#include "channel_pool.h"
+#include "chunk_tuner.h"
 #include "commit_data.h"
+#include "compound_call.h"
+#include "disk_cache.h"
+#include "dirty_index.h"
+#include "open_dir.h"
+#include "open_file.h"
+#include "readahead.h"
+#include "retry_policy.h"
+#include "striped_transfer.h"
+#include "whole_file_cache.h"
+#include "work_queue.h"
+#include "wire_attr.h"
+#include "write_queue.h"
 #include "watfs.grpc.pb.h"
 
 using watfs::WatFS;
@@ -31,6 +55,8 @@ using watfs::WatFSGetAttrArgs;
 using watfs::WatFSGetAttrRet;
 using watfs::WatFSLookupArgs;
 using watfs::WatFSLookupRet;
+using watfs::WatFSOpenArgs;
+using watfs::WatFSOpenRet;
 using watfs::WatFSReadArgs;
 using watfs::WatFSReadRet;
 using watfs::WatFSWriteArgs;
@@ -54,16 +80,22 @@ using watfs::WatFSRmdirRet;
 using watfs::WatFSUtimensArgs;
 using watfs::WatFSUtimensRet;
 
+using grpc::ByteBuffer;
 using grpc::Channel;
+using grpc::ClientAsyncReader;
+using grpc::ClientAsyncResponseReader;
+using grpc::ClientAsyncWriter;
 using grpc::ClientContext;
-using grpc::ClientReader;
-using grpc::ClientWriter;
+using grpc::CompletionQueue;
+using grpc::GenericStub;
+using grpc::ProtoBufferReader;
+using grpc::SerializationTraits;
 using grpc::Status;
 
-using namespace std;
-
+using google::protobuf::io::CodedInputStream;
+using google::protobuf::internal::WireFormatLite;
 
-#define MESSAGE_SZ          8192
+using namespace std;
 
 
 #ifndef __WATFS_GRPC_CLIENT__
@@ -73,12 +105,35 @@ using namespace std;
 class WatFSClient {
 public:
 
-    // use to verify commits
-    long verf;
+    // use to verify commits, replaced by whichever commit first sees a
+    // restarted server
+    atomic<long> verf;
     // data that has been written but not commited to disk
-    vector<CommitData *> cached_writes;
-    
-    pthread_mutex_t cached_writes_mutex;
+    DirtyIndex dirty_index;
+
+    // attributes of recently seen objects, keyed by path
+    AttrCache attr_cache;
+
+    // size of read and write stream messages
+    ChunkTuner chunk_tuner;
+
+    // file data from readahead and sequential reads
+    BlockCache block_cache;
+
+    // small files fetched whole when they are opened
+    WholeFileCache whole_files;
+
+    // blocks kept on local disk across mounts, behind block_cache
+    DiskCache disk_cache;
+
+    // every RPC goes through here, see UnaryCall
+    AsyncCallQueue async_calls;
+
+    // connections to the server, split into metadata and bulk lanes
+    ChannelPool channels;
+
+    // when and how failed calls are tried again
+    RetryPolicy retry_policy;
 
     /*
      * Constructor using default deadline
@@ -92,8 +147,112 @@ public:
     WatFSClient(shared_ptr<Channel> channel, long deadline);
 
 
+    /*
+     * Constructor opening a pool of nchannels channels to address, created
+     * with args, and setting gRPC call deadline in seconds
+     */
+    WatFSClient(const string &address, int nchannels, 
+                const grpc::ChannelArguments &args, long deadline);
+
+
+    /*
+     * sends any writes still queued, and stops the readahead and write 
+     * threads
+     */
+    ~WatFSClient();
+
+
+    /*
+     * start threads readahead worker threads, and limit the readahead window
+     * of a stream to max_window bytes. Without any threads there is no
+     * readahead, but sequential reads still go through the block cache.
+     */
+    void StartReadahead(int threads, long max_window);
+
+
+    /*
+     * read from a file opened through FUSE.
+     *
+     * files fetched whole at open are served from that copy. Sequential 
+     * streams are served from the block cache, and the blocks after the 
+     * current read are prefetched in the background. Other reads go straight
+     * to the server.
+     *
+     * returns number of bytes read into data on success, or -errno on error
+     */
+    int ReadFile(OpenFile *file, off_t offset, int count, char *data);
+
+
+    /*
+     * split reads and writes bigger than stripe_size into stripes of that
+     * size, and move up to width of them at once. The stripes are run by
+     * the calling thread and a pool of width - 1 threads shared by all
+     * transfers. A width of 1 keeps every transfer on one stream.
+     */
+    void StartStriping(long stripe_size, int width);
+
+
+    /*
+     * start depth threads that send queued writes to the server, so at most
+     * depth writes are in flight. Without any threads writes are sent
+     * synchronously.
+     */
+    void StartWriteBehind(int depth);
+
+
+    /*
+     * returns whether writes can be queued with QueueWrite
+     */
+    bool WriteBehind() { return !write_threads.empty(); }
+
+
+    /*
+     * send write to the server in the background, using the server file
+     * handle fh. We take ownership of write.
+     */
+    void QueueWrite(CommitData *write, uint64_t fh);
+
+
+    /*
+     * wait until the queued writes to path have reached the server.
+     *
+     * returns 0 if they all succeeded, or -errno of the first one that 
+     * failed since the last flush
+     */
+    int FlushWrites(const string &path);
+
+
+    /*
+     * send the queued writes to path and commit its uncommitted data,
+     * resending it if the server lost it in a crash. Other files are left
+     * alone.
+     *
+     * returns 0, or -errno if a queued write to path failed or the server
+     * couldn't be reached
+     */
+    int CommitFile(const string &path);
+
+
+    /*
+     * cap uncommitted data at max_bytes (0 for no cap), and keep it in a
+     * journal file at journal_path instead of memory if that isn't NULL.
+     *
+     * returns 0 on success, or -errno if the journal couldn't be created
+     */
+    int ConfigureDirty(long max_bytes, const char *journal_path);
+
+
+    /*
+     * called after a write to path has been sent or queued. If there is more
+     * uncommitted data than the cap allows, the writer commits its own file,
+     * and others if that isn't enough, before it can go on.
+     */
+    void ThrottleWrites(const string &path);
+
+
     /* 
-     * call WatFSNull to ping the server
+     * call WatFSNull to ping the server, and agree on the largest stream
+     * message size with it
      *
      * return: verf from server on success
      *         -1 on failure
@@ -104,7 +263,8 @@ public:
     /*
      * get attribute information from the server. 
      *
-     * fills in the given struct stat with values for relevant file
+     * fills in the given struct stat with values for relevant file. Results
+     * (including errors) are served from attr_cache while they are fresh.
      * 
      * returns 0 on success, or -1 if the gRPC call fails. errno is set on error
      */
@@ -114,11 +274,52 @@ public:
     /*
      * get a file handle from the server. 
      *
-     * given the handle of a directory to search and a file name.
+     * given the path of the object to look up. If file_handle is given, the
+     * server's handle for the object is stored there.
      * 
      * returns 0 on success, or -1 on failure, errno is set on error.
      */
-    int WatFSLookup(const string &path);
+    int WatFSLookup(const string &path, uint64_t *file_handle = NULL);
+
+
+    /*
+     * open a file on the server.
+     *
+     * the server checks that the file can be opened with the access mode in
+     * flags, and stores a file handle for it in file_handle.
+     *
+     * returns 0 on success, or -errno on failure, errno is set on error.
+     */
+    int WatFSOpen(const string &path, int flags, uint64_t *file_handle);
+
+
+    /*
+     * open a file on the server like WatFSOpen, and fetch it whole in the
+     * same compound call if it is a regular file no bigger than whole_files
+     * allows. A copy kept from an earlier open is used instead if the file
+     * hasn't changed since.
+     *
+     * the contents are stored in data, which is left NULL if the file isn't
+     * fetched whole, and unchanged is set if they are the same as when the
+     * file was last opened.
+     *
+     * returns 0 on success, or -errno on failure, errno is set on error.
+     */
+    int WatFSOpenWhole(const string &path, int flags, uint64_t *file_handle,
+                       shared_ptr<const string> *data, bool *unchanged);
+
+
+    /*
+     * create a regular file on the server and open it, in one compound call.
+     *
+     * mode and flags are as for open(2) with O_CREAT. If the file turns out
+     * to exist already and flags don't have O_EXCL, it is just opened. The
+     * server's handle for the file is stored in file_handle.
+     *
+     * returns 0 on success, or -errno on failure, errno is set on error.
+     */
+    int WatFSCreate(const string &path, mode_t mode, int flags, 
+                    uint64_t *file_handle);
 
 
     /*
@@ -126,12 +327,17 @@ public:
      *
      * Given a WatFS file handle (string containing server file path), we read
      * requested number of bytes from the file on the server into the given
-     * buffer.
+     * buffer. If fh points to a non-zero server file handle, it is sent in
+     * place of the path. A stale handle is replaced by looking the path up
+     * again, and *fh is updated.
      * 
+     * Large reads are striped, see StartStriping.
+     *
      * returns number of bytes read into the buffer on success, or -1 on error.
      * errno is set on error.
      */
-    int WatFSRead(const string &file_handle, int offset, int count, char *data);
+    int WatFSRead(const string &file_handle, off_t offset, int count, 
+                  char *data, uint64_t *fh = NULL);
 
 
     /*
@@ -140,27 +346,46 @@ public:
      * Given a WatFS file handle (string containing server file path), we write
      * requested number of bytes to the file on the server at the specified 
      * offset from the given buffer. An error field is sent back to the 
-     * client on error, set to relevant errno. 
+     * client on error, set to relevant errno. fh is used as in WatFSRead.
+     * Large writes are striped, see StartStriping.
      * 
      * returns number of bytes read into the buffer on success, or -1 on error.
      * errno is set on error.
      */
     int WatFSWrite(const string &file_handle, const char *buffer, long size,
-                   long offset);
+                   long offset, uint64_t *fh = NULL);
 
 
-    int WatFSCommit();
+    /*
+     * ask the server to make the writes to the files in paths durable.
+     *
+     * returns the server's verf, which the caller compares with the one our
+     * cached writes were sent under to detect a server crash
+     */
+    long WatFSCommit(const vector<string> &paths);
 
     /*
-     * 
+     * truncate a file on the server to size bytes, fh is used as in WatFSRead
      */
-    int WatFSTruncate(const string &file_path, int size);
+    int WatFSTruncate(const string &file_path, int size, uint64_t *fh = NULL);
 
 
     /*
-     * 
+     * fetch directory listings a page of page_entries entries at a time, 0
+     * for the whole directory in one call
+     */
+    void ConfigureReaddir(int page_entries);
+
+
+    /*
+     * list the directory dir from offset, handing entries to filler with
+     * their attributes until the directory ends or filler's buffer is full.
+     * Each page is fetched with a single call that brings the attributes of
+     * its entries along, and they go into attr_cache as well.
+     *
+     * returns 0 on success, or -errno on failure, errno is set on error.
      */
-    int WatFSReaddir(const string &file_handle, void *buffer, 
+    int WatFSReaddir(OpenDir *dir, off_t offset, void *buffer, 
                      fuse_fill_dir_t filler);
 
 
@@ -202,11 +427,283 @@ public:
 
 
 private:
-    unique_ptr<WatFS::Stub> stub_;
+    // blocks waiting to be prefetched, in the order they were requested
+    deque<ReadaheadJob> readahead_queue;
+    vector<pthread_t> readahead_threads;
+    long readahead_max;
+    bool readahead_stopping;
+
+    pthread_mutex_t readahead_mutex;
+    pthread_cond_t readahead_ready;
+
+    // writes acknowledged to FUSE but not sent yet
+    WriteQueue write_queue;
+    vector<pthread_t> write_threads;
+
+    // striping of large transfers
+    long stripe_size;
+    int stripe_width;
+    WorkQueue stripe_pool;
+
+    /*
+     * WatFSRead and WatFSWrite over a single stream
+     */
+    int StreamRead(const string &file_handle, long offset, int count, 
+                   char *data, uint64_t *fh);
+    int StreamWrite(const string &file_handle, const char *buffer, long size,
+                    long offset, uint64_t *fh);
+
+    /*
+     * run the stripes of transfer on the stripe pool and the calling thread,
+     * and wait for all of them
+     */
+    void RunStripes(const shared_ptr<StripedTransfer> &transfer);
+
+    // directory entries per readdir call, 0 for all of them
+    int readdir_page;
+
+    /*
+     * fetch the next page of the listing of dir from the server
+     *
+     * returns 0 on success, or -errno on failure
+     */
+    int ReaddirPage(OpenDir *dir);
+
+    // most uncommitted data we hold before writers commit, 0 for no limit
+    long dirty_max;
+    // holds uncommitted data when configured
+    WriteJournal journal;
+
+    /*
+     * body of the write-behind sender threads
+     */
+    static void *WriteSender(void *arg);
+
+    /*
+     * send batches claimed from the write queue for path in one compound
+     * call, followed by a commit of path if it has uncommitted data, and
+     * report the batches back to the queue
+     */
+    void CommitWithWrites(const string &path, vector<WriteBatch> &batches);
+
+    /*
+     * CommitFile without collecting the errors of queued writes.
+     *
+     * returns 0, or -errno if the server couldn't be reached
+     */
+    int CommitDirty(const string &path);
+
+    /*
+     * body of the readahead worker threads
+     */
+    static void *ReadaheadWorker(void *arg);
+
+    /*
+     * queue the blocks covering [start, end) of file for readahead
+     */
+    void QueueReadahead(OpenFile *file, off_t start, off_t end, 
+                        unsigned long generation);
+
+    /*
+     * copy up to count bytes at offset within block of path into data, from
+     * the block cache or by fetching the block from the server.
+     *
+     * returns the number of bytes copied, short at the end of the file, or
+     * -errno on error
+     */
+    int ReadBlock(const string &path, uint64_t *fh, long block, size_t offset, 
+                  int count, char *data);
+
+    /*
+     * read block of path from the disk cache if it is still good there, or
+     * from the server otherwise, into data and hand it to the block cache,
+     * completing a fetch claimed with StartFetch at epoch.
+     *
+     * returns the size of the block on success, or -errno on error
+     */
+    int FetchBlock(const string &path, uint64_t *fh, long block, 
+                   unsigned long epoch, string *data);
 
     // deadline for gRPC calls in seconds
     long grpc_deadline;
 
+    /*
+     * make a unary call with the stub's prepare method, retrying it as
+     * retry_class allows. Calls of class RETRY_HEDGED are raced by a second
+     * copy once they have taken longer than the retry policy's hedging
+     * delay. The public methods stay synchronous, but a thread waiting here
+     * doesn't keep others from starting calls of their own.
+     */
+    template <class Args, class Ret>
+    Status UnaryCall(unique_ptr<ClientAsyncResponseReader<Ret>> 
+                         (WatFS::Stub::*prepare)(ClientContext *, const Args &,
+                                                 CompletionQueue *),
+                     const Args &args, Ret *ret, RetryClass retry_class) {
+        RetryLoop retry(&retry_policy, retry_class);
+        Status status;
+
+        do {
+            if (retry_class == RETRY_HEDGED) {
+                status = HedgedAttempt(prepare, args, ret);
+            } else {
+                status = UnaryAttempt(prepare, args, ret);
+            }
+        } while (retry.Again(status));
+
+        return status;
+    }
+
+    /*
+     * one try of a unary call, on the shared completion queue and over a
+     * channel of the metadata lane
+     */
+    template <class Args, class Ret>
+    Status UnaryAttempt(unique_ptr<ClientAsyncResponseReader<Ret>> 
+                            (WatFS::Stub::*prepare)(ClientContext *, 
+                                                    const Args &,
+                                                    CompletionQueue *),
+                        const Args &args, Ret *ret) {
+        ClientContext context;
+        PendingCall call;
+        Status status;
+
+        context.set_wait_for_ready(true);
+        context.set_deadline(GetDeadline());
+
+        async_calls.Begin();
+        PooledChannel *channel = channels.Acquire(METADATA_LANE);
+
+        auto reader = (channel->stub.get()->*prepare)(&context, args, 
+                                                      async_calls.Queue());
+        reader->StartCall();
+        reader->Finish(ret, &status, &call);
+        async_calls.Wait(&call);
+
+        channels.Release(channel);
+        async_calls.End();
+
+        return status;
+    }
+
+    /*
+     * one try of a unary call like UnaryAttempt, sending a second copy if
+     * the first hasn't answered within the hedging delay. Whichever copy
+     * answers first wins and the other is cancelled. No copy is sent while
+     * the in flight limit is reached.
+     */
+    template <class Args, class Ret>
+    Status HedgedAttempt(unique_ptr<ClientAsyncResponseReader<Ret>> 
+                             (WatFS::Stub::*prepare)(ClientContext *, 
+                                                     const Args &,
+                                                     CompletionQueue *),
+                         const Args &args, Ret *ret) {
+        ClientContext contexts[2];
+        PendingCall calls[2];
+        Status statuses[2];
+        Ret rets[2];
+        PooledChannel *used[2];
+        unique_ptr<ClientAsyncResponseReader<Ret>> readers[2];
+        int sent = 0;
+        int winner;
+
+        long delay_us = retry_policy.HedgeDelay();
+        auto start = chrono::steady_clock::now();
+
+        // both copies wake us up on the same condition
+        calls[1].wakeup = calls[0].wakeup;
+
+        async_calls.Begin();
+
+        for (;;) {
+            contexts[sent].set_wait_for_ready(true);
+            contexts[sent].set_deadline(GetDeadline());
+
+            used[sent] = channels.Acquire(METADATA_LANE);
+            readers[sent] = (used[sent]->stub.get()->*prepare)(
+                &contexts[sent], args, async_calls.Queue());
+            readers[sent]->StartCall();
+            readers[sent]->Finish(&rets[sent], &statuses[sent], 
+                                  &calls[sent]);
+            sent++;
+
+            if (sent == 2 || delay_us < 0) {
+                winner = async_calls.WaitAny(calls, sent, NULL);
+                break;
+            }
+
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += delay_us / 1000000;
+            deadline.tv_nsec += (delay_us % 1000000) * 1000;
+            if (deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+
+            winner = async_calls.WaitAny(calls, sent, &deadline);
+            if (winner != -1) {
+                break;
+            }
+
+            if (!async_calls.TryBegin()) {
+                winner = async_calls.WaitAny(calls, sent, NULL);
+                break;
+            }
+            retry_policy.Hedged();
+        }
+
+        retry_policy.RecordLatency(chrono::steady_clock::now() - start);
+
+        for (int i = 0; i < sent; i++) {
+            if (i != winner) {
+                contexts[i].TryCancel();
+            }
+        }
+        for (int i = 0; i < sent; i++) {
+            async_calls.Wait(&calls[i]);
+            channels.Release(used[i]);
+            async_calls.End();
+        }
+
+        ret->Swap(&rets[winner]);
+
+        return statuses[winner];
+    }
+
+    /*
+     * make the ops of compound in one call, retried as its ops allow
+     */
+    Status RunCompound(CompoundCall *compound) {
+        return UnaryCall(&WatFS::Stub::PrepareAsyncWatFSCompound, 
+                         compound->args, &compound->ret, 
+                         compound->retry_class);
+    }
+
+    /*
+     * called when the server rejects the handle in *fh as stale. Looks path up
+     * again to get a fresh handle for later requests.
+     *
+     * returns true if the request should be retried by path
+     */
+    bool RefreshHandle(const string &path, uint64_t *fh);
+
+    /*
+     * refresh the attribute cache entry for path from the post-operation
+     * attributes in reply ret, or drop it if the server didn't send any
+     */
+    template <class Ret>
+    void CacheAttr(const string &path, const Ret &ret) {
+        struct stat statbuf;
+
+        if (!ret.has_attr()) {
+            attr_cache.Invalidate(path);
+            return;
+        }
+
+        attr_from_wire(ret.attr(), &statbuf);
+        attr_cache.Insert(path, &statbuf);
+    }
+
     /*
      * We want to get an absolute deadline for our grpc calls, since we're using
      * wait_for_ready semantics.
@@ -0,0 +1,236 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+#include <iostream>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+using namespace std;
+
+#ifndef __WATFS_WHOLE_FILE_CACHE__
+#define __WATFS_WHOLE_FILE_CACHE__
+
+
+#define WHOLE_FILE_CACHE_DEFAULT_SIZE   (64 << 20)
+
+
+/*
+ * The contents of a small file as fetched when it was opened, along with the
+ * attributes it had then.
+ */
+class WholeFile {
+public:
+    string path;
+    struct stat attr;
+    shared_ptr<const string> data;
+    // position in the LRU list
+    list<WholeFile *>::iterator lru_pos;
+};
+
+
+/*
+ * Thread safe LRU cache of whole small files, bounded by the total number of
+ * bytes cached. A file no bigger than the configured limit is fetched along
+ * with its open, and reads through that open are served from the copy until
+ * it is closed. The copy is kept after the close: the next open fetches the
+ * file again in the same round trip, but keeps using the copy, and whatever
+ * the kernel cached from it, if the inode, size, mtime and ctime are still
+ * the same.
+ *
+ * The data is shared with the open files using it, so a copy can be evicted
+ * or replaced while it is still being read.
+ */
+class WholeFileCache {
+public:
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+
+    WholeFileCache() : hits(0), misses(0), evictions(0),
+                       capacity(WHOLE_FILE_CACHE_DEFAULT_SIZE),
+                       max_file_size(0), size(0) {
+
+        pthread_mutex_init(&cache_mutex, NULL);
+    }
+
+    ~WholeFileCache() {
+        for (auto file : lru) {
+            delete file;
+        }
+        pthread_mutex_destroy(&cache_mutex);
+    }
+
+
+    /*
+     * keep up to max_bytes of files no bigger than max_file_bytes each. A
+     * max_file_bytes of 0 turns whole file fetches off.
+     */
+    void Configure(size_t max_bytes, long max_file_bytes) {
+        pthread_mutex_lock(&cache_mutex);
+
+        capacity = max_bytes;
+        max_file_size = max_file_bytes;
+        while (size > capacity || (!lru.empty() && max_file_size == 0)) {
+            Evict();
+        }
+
+        pthread_mutex_unlock(&cache_mutex);
+    }
+
+
+    /*
+     * returns the largest file fetched whole, 0 if none are
+     */
+    long MaxFileSize() {
+        long max_size;
+
+        pthread_mutex_lock(&cache_mutex);
+        max_size = max_file_size;
+        pthread_mutex_unlock(&cache_mutex);
+
+        return max_size;
+    }
+
+
+    /*
+     * returns the copy of path if the file still has attributes attr, or NULL.
+     * A copy that is out of date is dropped.
+     */
+    shared_ptr<const string> Lookup(const string &path,
+                                    const struct stat &attr) {
+        shared_ptr<const string> data;
+
+        pthread_mutex_lock(&cache_mutex);
+
+        auto it = files.find(path);
+        if (it != files.end()) {
+            WholeFile *file = it->second;
+
+            if (Unchanged(file->attr, attr)) {
+                lru.splice(lru.begin(), lru, file->lru_pos);
+                data = file->data;
+                hits++;
+            } else {
+                Remove(file);
+                misses++;
+            }
+        } else {
+            misses++;
+        }
+
+        pthread_mutex_unlock(&cache_mutex);
+
+        return data;
+    }
+
+
+    /*
+     * keep contents, fetched from path after it was found to have attributes
+     * attr, replacing any older copy.
+     *
+     * returns the shared copy, which is also handed out if the cache is too
+     * small to keep it
+     */
+    shared_ptr<const string> Insert(const string &path,
+                                    const struct stat &attr,
+                                    string &&contents) {
+        auto data = make_shared<const string>(move(contents));
+
+        pthread_mutex_lock(&cache_mutex);
+
+        auto it = files.find(path);
+        if (it != files.end()) {
+            Remove(it->second);
+        }
+
+        if (data->size() <= capacity) {
+            while (size + data->size() > capacity) {
+                Evict();
+            }
+
+            WholeFile *file = new WholeFile();
+            file->path = path;
+            file->attr = attr;
+            file->data = data;
+            lru.push_front(file);
+            file->lru_pos = lru.begin();
+            files[path] = file;
+            size += data->size();
+        }
+
+        pthread_mutex_unlock(&cache_mutex);
+
+        return data;
+    }
+
+
+    /*
+     * drop the copy of path, after this client changed it
+     */
+    void Invalidate(const string &path) {
+        pthread_mutex_lock(&cache_mutex);
+
+        auto it = files.find(path);
+        if (it != files.end()) {
+            Remove(it->second);
+        }
+
+        pthread_mutex_unlock(&cache_mutex);
+    }
+
+
+    void PrintStats(ostream &out) {
+        pthread_mutex_lock(&cache_mutex);
+
+        unsigned long lookups = hits + misses;
+        out << "whole file cache: " << size << " bytes in " << lru.size()
+            << " files, " << hits << " hits, " << misses << " misses ("
+            << (lookups ? (100.0 * hits / lookups) : 0.0) << "% hit rate), "
+            << evictions << " evictions" << endl;
+
+        pthread_mutex_unlock(&cache_mutex);
+    }
+
+
+private:
+    size_t capacity;
+    long max_file_size;
+    size_t size;
+
+    // most recently used files are at the front
+    list<WholeFile *> lru;
+    unordered_map<string, WholeFile *> files;
+
+    pthread_mutex_t cache_mutex;
+
+
+    static bool Unchanged(const struct stat &cached, const struct stat &now) {
+        return cached.st_ino == now.st_ino &&
+               cached.st_size == now.st_size &&
+               cached.st_mtim.tv_sec == now.st_mtim.tv_sec &&
+               cached.st_mtim.tv_nsec == now.st_mtim.tv_nsec &&
+               cached.st_ctim.tv_sec == now.st_ctim.tv_sec &&
+               cached.st_ctim.tv_nsec == now.st_ctim.tv_nsec;
+    }
+
+
+    // caller holds cache_mutex
+    void Remove(WholeFile *file) {
+        size -= file->data->size();
+        files.erase(file->path);
+        lru.erase(file->lru_pos);
+        delete file;
+    }
+
+
+    // caller holds cache_mutex
+    void Evict() {
+        Remove(lru.back());
+        evictions++;
+    }
+};
+
+#endif // __WATFS_WHOLE_FILE_CACHE__
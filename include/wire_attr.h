@@ -0,0 +1,66 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+
+#include "watfs.pb.h"
+
+using watfs::WatFSAttr;
+
+using namespace std;
+
+#ifndef __WATFS_WIRE_ATTR__
+#define __WATFS_WIRE_ATTR__
+
+
+/*
+ * Conversions between struct stat and WatFSAttr, which carries only the
+ * fields FUSE looks at. Both ends go through here, so the encoding doesn't
+ * depend on either side's struct layout.
+ */
+
+
+static inline void attr_to_wire(const struct stat *statbuf, WatFSAttr *attr)
+{
+    attr->set_ino(statbuf->st_ino);
+    attr->set_mode(statbuf->st_mode);
+    attr->set_nlink(statbuf->st_nlink);
+    attr->set_uid(statbuf->st_uid);
+    attr->set_gid(statbuf->st_gid);
+    attr->set_rdev(statbuf->st_rdev);
+    attr->set_size(statbuf->st_size);
+    attr->set_blocks(statbuf->st_blocks);
+    attr->set_blksize(statbuf->st_blksize);
+    attr->set_atime_sec(statbuf->st_atim.tv_sec);
+    attr->set_atime_nsec(statbuf->st_atim.tv_nsec);
+    attr->set_mtime_sec(statbuf->st_mtim.tv_sec);
+    attr->set_mtime_nsec(statbuf->st_mtim.tv_nsec);
+    attr->set_ctime_sec(statbuf->st_ctim.tv_sec);
+    attr->set_ctime_nsec(statbuf->st_ctim.tv_nsec);
+}
+
+
+/*
+ * fields that aren't sent come back as 0
+ */
+static inline void attr_from_wire(const WatFSAttr &attr, struct stat *statbuf)
+{
+    memset(statbuf, 0, sizeof *statbuf);
+
+    statbuf->st_ino = attr.ino();
+    statbuf->st_mode = attr.mode();
+    statbuf->st_nlink = attr.nlink();
+    statbuf->st_uid = attr.uid();
+    statbuf->st_gid = attr.gid();
+    statbuf->st_rdev = attr.rdev();
+    statbuf->st_size = attr.size();
+    statbuf->st_blocks = attr.blocks();
+    statbuf->st_blksize = attr.blksize();
+    statbuf->st_atim.tv_sec = attr.atime_sec();
+    statbuf->st_atim.tv_nsec = attr.atime_nsec();
+    statbuf->st_mtim.tv_sec = attr.mtime_sec();
+    statbuf->st_mtim.tv_nsec = attr.mtime_nsec();
+    statbuf->st_ctim.tv_sec = attr.ctime_sec();
+    statbuf->st_ctim.tv_nsec = attr.ctime_nsec();
+}
+
+#endif // __WATFS_WIRE_ATTR__
@@ -0,0 +1,116 @@
+#include <string.h>
+#include <pthread.h>
+
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <vector>
+
+using namespace std;
+
+#ifndef __WATFS_WORK_QUEUE__
+#define __WATFS_WORK_QUEUE__
+
+
+/*
+ * Fixed pool of threads running jobs in the order they were added. Used for
+ * work that blocks, like file I/O, so it doesn't hold up the threads that
+ * poll the completion queues. The number of threads never changes, however
+ * many calls are waiting.
+ */
+class WorkQueue {
+public:
+    WorkQueue() : stopping(false) {
+        pthread_mutex_init(&queue_mutex, NULL);
+        pthread_cond_init(&work_ready, NULL);
+    }
+
+    ~WorkQueue() {
+        Stop();
+        pthread_cond_destroy(&work_ready);
+        pthread_mutex_destroy(&queue_mutex);
+    }
+
+
+    /*
+     * start nthreads worker threads
+     */
+    void Start(int nthreads) {
+        for (int i = 0; i < nthreads; i++) {
+            pthread_t thread;
+            int err = pthread_create(&thread, NULL, Worker, this);
+            if (err != 0) {
+                cerr << "failed to start worker thread: " << strerror(err)
+                     << endl;
+                break;
+            }
+            threads.push_back(thread);
+        }
+    }
+
+
+    /*
+     * run job on one of the worker threads
+     */
+    void Add(function<void()> job) {
+        pthread_mutex_lock(&queue_mutex);
+        jobs.push_back(move(job));
+        pthread_cond_signal(&work_ready);
+        pthread_mutex_unlock(&queue_mutex);
+    }
+
+
+    /*
+     * run the jobs already queued, then stop the worker threads
+     */
+    void Stop() {
+        pthread_mutex_lock(&queue_mutex);
+        stopping = true;
+        pthread_cond_broadcast(&work_ready);
+        pthread_mutex_unlock(&queue_mutex);
+
+        for (auto thread : threads) {
+            pthread_join(thread, NULL);
+        }
+        threads.clear();
+    }
+
+
+private:
+    bool stopping;
+    deque<function<void()>> jobs;
+    vector<pthread_t> threads;
+
+    pthread_mutex_t queue_mutex;
+    pthread_cond_t work_ready;
+
+
+    static void *Worker(void *arg) {
+        WorkQueue *queue = (WorkQueue *)arg;
+
+        pthread_mutex_lock(&queue->queue_mutex);
+
+        for (;;) {
+            if (queue->jobs.empty()) {
+                if (queue->stopping) {
+                    break;
+                }
+                pthread_cond_wait(&queue->work_ready, &queue->queue_mutex);
+                continue;
+            }
+
+            function<void()> job = move(queue->jobs.front());
+            queue->jobs.pop_front();
+
+            pthread_mutex_unlock(&queue->queue_mutex);
+            job();
+            pthread_mutex_lock(&queue->queue_mutex);
+        }
+
+        pthread_mutex_unlock(&queue->queue_mutex);
+
+        return NULL;
+    }
+};
+
+#endif // __WATFS_WORK_QUEUE__
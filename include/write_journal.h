@@ -0,0 +1,173 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include <iostream>
+#include <string>
+
+using namespace std;
+
+#ifndef __WATFS_WRITE_JOURNAL__
+#define __WATFS_WRITE_JOURNAL__
+
+
+/*
+ * Append-only file, mapped into memory, that holds the data of uncommitted
+ * writes instead of the heap. The pages are backed by the file, so the kernel
+ * can write them out and drop them under memory pressure and the client's RSS
+ * stays flat no matter how much is waiting for a commit.
+ *
+ * Space is handed out from the tail and never reused piecemeal. The journal
+ * counts the bytes still referenced, and starts over from the beginning once
+ * nothing is, which happens whenever everything written has been committed.
+ */
+class WriteJournal {
+public:
+    WriteJournal() : fd(-1), base(NULL), capacity(0), tail(0), live(0) {
+        pthread_mutex_init(&journal_mutex, NULL);
+    }
+
+    ~WriteJournal() {
+        if (base != NULL) {
+            munmap(base, capacity);
+        }
+        if (fd != -1) {
+            close(fd);
+        }
+        pthread_mutex_destroy(&journal_mutex);
+    }
+
+
+    /*
+     * create the journal file at path, holding up to size bytes. Anything
+     * already in the file is thrown away; it only matters while we run.
+     *
+     * returns 0 on success, or -errno on error
+     */
+    int Open(const string &path, size_t size) {
+        fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if (fd == -1) {
+            return -errno;
+        }
+
+        // sparse, so space on disk is only used as the journal fills
+        if (ftruncate(fd, size) == -1) {
+            int err = errno;
+            close(fd);
+            fd = -1;
+            return -err;
+        }
+
+        void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+            int err = errno;
+            close(fd);
+            fd = -1;
+            return -err;
+        }
+
+        base = (char *)map;
+        capacity = size;
+
+        return 0;
+    }
+
+
+    bool IsOpen() {
+        return base != NULL;
+    }
+
+
+    /*
+     * copy size bytes of data to the tail of the journal, counting them as
+     * referenced.
+     *
+     * returns the offset of the data in the journal, or -1 if it is full
+     */
+    long Append(const char *data, size_t size) {
+        long offset = -1;
+
+        pthread_mutex_lock(&journal_mutex);
+
+        if (tail + size <= capacity) {
+            offset = tail;
+            tail += size;
+            live += size;
+        }
+
+        pthread_mutex_unlock(&journal_mutex);
+
+        if (offset != -1) {
+            memcpy(base + offset, data, size);
+        }
+
+        return offset;
+    }
+
+
+    /*
+     * append size bytes of data like Append, but only if they would land
+     * right at end, so that the data ending there can grow in place.
+     *
+     * returns whether the data was appended
+     */
+    bool Extend(long end, const char *data, size_t size) {
+        bool extended = false;
+
+        pthread_mutex_lock(&journal_mutex);
+
+        if (end == (long)tail && tail + size <= capacity) {
+            tail += size;
+            live += size;
+            extended = true;
+        }
+
+        pthread_mutex_unlock(&journal_mutex);
+
+        if (extended) {
+            memcpy(base + end, data, size);
+        }
+
+        return extended;
+    }
+
+
+    /*
+     * the data at offset, valid until it is released
+     */
+    const char *Get(long offset) {
+        return base + offset;
+    }
+
+
+    /*
+     * stop referencing size bytes of the journal
+     */
+    void Release(size_t size) {
+        pthread_mutex_lock(&journal_mutex);
+
+        live -= size;
+        if (live == 0) {
+            tail = 0;
+        }
+
+        pthread_mutex_unlock(&journal_mutex);
+    }
+
+
+private:
+    int fd;
+    char *base;
+    size_t capacity;
+    // where the next append goes
+    size_t tail;
+    // bytes still referenced by the dirty index
+    size_t live;
+
+    pthread_mutex_t journal_mutex;
+};
+
+#endif // __WATFS_WRITE_JOURNAL__
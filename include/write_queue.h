@@ -0,0 +1,409 @@
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <deque>
+#include <iterator>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "commit_data.h"
+
+using namespace std;
+
+#ifndef __WATFS_WRITE_QUEUE__
+#define __WATFS_WRITE_QUEUE__
+
+
+// writes in flight per mount when write-behind is on, 0 turns it off
+#define WRITE_BEHIND_DEFAULT_DEPTH  4
+// largest run of queued writes coalesced into one request
+#define WRITE_BEHIND_MAX_BATCH      (1 << 20)
+// most data waiting to be sent before writers block
+#define WRITE_BEHIND_MAX_QUEUED     (32 << 20)
+
+
+/*
+ * A write waiting to be sent, and the server file handle to send it with.
+ * The queue owns the data until it has been copied into a batch.
+ */
+class QueuedWrite {
+public:
+    CommitData *write;
+    uint64_t fh;
+};
+
+
+/*
+ * Queued and in flight writes of one file, and the first error a background
+ * write to it ran into.
+ */
+class FileWrites {
+public:
+    deque<QueuedWrite> queued;
+    // [offset, end) of the batches being sent right now
+    list<pair<long, long>> in_flight;
+    int err;
+
+    FileWrites() : err(0) {}
+};
+
+
+/*
+ * A run of queued writes coalesced into one request.
+ */
+class WriteBatch {
+public:
+    string path;
+    uint64_t fh;
+    long offset;
+    string data;
+    // size of the writes that went into the batch
+    long bytes;
+    // our entry in the file's in_flight list
+    list<pair<long, long>>::iterator range;
+};
+
+
+/*
+ * Thread safe queue of writes the client has acknowledged to the application
+ * but not sent to the server yet. Sender threads take batches with Take and
+ * report back with Done.
+ *
+ * Writes to a file leave the queue in order. Each batch is a run of queued
+ * writes that continue or overwrite each other, and several batches of a
+ * file can be in flight at once as long as they don't overlap, so the server
+ * ends up with the same bytes as if the writes had been sent one by one.
+ */
+class WriteQueue {
+public:
+    WriteQueue() : stopping(false), max_bytes(WRITE_BEHIND_MAX_QUEUED),
+                   queued_bytes(0) {
+
+        pthread_mutex_init(&queue_mutex, NULL);
+        pthread_cond_init(&work_ready, NULL);
+        pthread_cond_init(&writes_done, NULL);
+    }
+
+    ~WriteQueue() {
+        for (auto &file : files) {
+            for (auto &queued : file.second.queued) {
+                delete queued.write;
+            }
+        }
+
+        pthread_cond_destroy(&writes_done);
+        pthread_cond_destroy(&work_ready);
+        pthread_mutex_destroy(&queue_mutex);
+    }
+
+
+    /*
+     * limit the data queued and in flight to max_queued bytes, 0 for no limit
+     */
+    void SetLimit(long max_queued) {
+        pthread_mutex_lock(&queue_mutex);
+        max_bytes = max_queued;
+        pthread_mutex_unlock(&queue_mutex);
+    }
+
+
+    /*
+     * queue write to be sent with the server file handle fh, the queue
+     * takes ownership of it. Blocks while the queue is full.
+     */
+    void Add(CommitData *write, uint64_t fh) {
+        pthread_mutex_lock(&queue_mutex);
+
+        while (max_bytes > 0 && queued_bytes > 0 &&
+               queued_bytes + write->size > max_bytes) {
+            pthread_cond_wait(&writes_done, &queue_mutex);
+        }
+        queued_bytes += write->size;
+
+        FileWrites &file = files[write->path];
+        if (file.queued.empty()) {
+            active.push_back(write->path);
+        }
+
+        QueuedWrite queued;
+        queued.write = write;
+        queued.fh = fh;
+        file.queued.push_back(queued);
+
+        pthread_cond_signal(&work_ready);
+        pthread_mutex_unlock(&queue_mutex);
+    }
+
+
+    /*
+     * wait for a batch of at most max_size bytes that can be sent now.
+     *
+     * returns false once the queue has been stopped
+     */
+    bool Take(WriteBatch *batch, long max_size) {
+        pthread_mutex_lock(&queue_mutex);
+
+        while (!stopping) {
+            if (TakeBatch(batch, max_size)) {
+                pthread_mutex_unlock(&queue_mutex);
+                return true;
+            }
+            pthread_cond_wait(&work_ready, &queue_mutex);
+        }
+
+        pthread_mutex_unlock(&queue_mutex);
+
+        return false;
+    }
+
+
+    /*
+     * take the writes queued for path as batches of at most max_size bytes
+     * for the caller to send itself, if they add up to no more than
+     * max_bytes and none of path's writes are in flight. The batches are
+     * meant to be sent in order, and reported back with Done like those
+     * from Take.
+     *
+     * returns whether any writes were taken
+     */
+    bool Claim(const string &path, long max_bytes, long max_size,
+               vector<WriteBatch> *batches) {
+        long bytes = 0;
+
+        pthread_mutex_lock(&queue_mutex);
+
+        auto it = files.find(path);
+        if (it == files.end() || it->second.queued.empty() ||
+            !it->second.in_flight.empty()) {
+
+            pthread_mutex_unlock(&queue_mutex);
+            return false;
+        }
+
+        FileWrites &file = it->second;
+        for (auto &queued : file.queued) {
+            bytes += queued.write->size;
+        }
+        if (bytes > max_bytes) {
+            pthread_mutex_unlock(&queue_mutex);
+            return false;
+        }
+
+        while (!file.queued.empty()) {
+            batches->emplace_back();
+            TakeRun(path, file, &batches->back(), max_size);
+        }
+        active.remove(path);
+
+        pthread_mutex_unlock(&queue_mutex);
+
+        return true;
+    }
+
+
+    /*
+     * a batch from Take has been sent, err is its errno or 0
+     */
+    void Done(const WriteBatch &batch, int err) {
+        pthread_mutex_lock(&queue_mutex);
+
+        FileWrites &file = files[batch.path];
+        file.in_flight.erase(batch.range);
+        queued_bytes -= batch.bytes;
+        if (err != 0 && file.err == 0) {
+            file.err = err;
+        }
+
+        if (Idle(file) && file.err == 0) {
+            files.erase(batch.path);
+        }
+
+        // writes that overlapped this batch may be able to go now
+        pthread_cond_broadcast(&work_ready);
+        pthread_cond_broadcast(&writes_done);
+        pthread_mutex_unlock(&queue_mutex);
+    }
+
+
+    /*
+     * wait until every write queued for path so far has reached the server
+     */
+    void Wait(const string &path) {
+        pthread_mutex_lock(&queue_mutex);
+
+        for (;;) {
+            auto it = files.find(path);
+            if (it == files.end() || Idle(it->second)) {
+                break;
+            }
+            pthread_cond_wait(&writes_done, &queue_mutex);
+        }
+
+        pthread_mutex_unlock(&queue_mutex);
+    }
+
+
+    /*
+     * wait for the writes to path like Wait, then collect the error.
+     *
+     * returns 0 if all background writes to path since the last Flush
+     * succeeded, or the errno of the first one that failed
+     */
+    int Flush(const string &path) {
+        int err = 0;
+
+        Wait(path);
+
+        pthread_mutex_lock(&queue_mutex);
+
+        auto it = files.find(path);
+        if (it != files.end() && Idle(it->second)) {
+            err = it->second.err;
+            files.erase(it);
+        }
+
+        pthread_mutex_unlock(&queue_mutex);
+
+        return err;
+    }
+
+
+    /*
+     * wait until all queued writes have reached the server
+     */
+    void WaitAll() {
+        pthread_mutex_lock(&queue_mutex);
+
+        for (;;) {
+            bool idle = true;
+            for (auto &file : files) {
+                if (!Idle(file.second)) {
+                    idle = false;
+                    break;
+                }
+            }
+
+            if (idle) {
+                break;
+            }
+            pthread_cond_wait(&writes_done, &queue_mutex);
+        }
+
+        pthread_mutex_unlock(&queue_mutex);
+    }
+
+
+    /*
+     * make Take return false in all sender threads
+     */
+    void Stop() {
+        pthread_mutex_lock(&queue_mutex);
+        stopping = true;
+        pthread_cond_broadcast(&work_ready);
+        pthread_mutex_unlock(&queue_mutex);
+    }
+
+
+private:
+    bool stopping;
+    long max_bytes;
+    long queued_bytes;
+
+    unordered_map<string, FileWrites> files;
+    // files with queued writes, taken from in turn
+    list<string> active;
+
+    pthread_mutex_t queue_mutex;
+    pthread_cond_t work_ready;
+    pthread_cond_t writes_done;
+
+
+    static bool Idle(const FileWrites &file) {
+        return file.queued.empty() && file.in_flight.empty();
+    }
+
+
+    static bool Overlaps(const FileWrites &file, long offset, long end) {
+        for (auto &range : file.in_flight) {
+            if (offset < range.second && range.first < end) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+
+    /*
+     * take the run of queued writes at the front of file into batch, and
+     * count it as in flight. Caller holds queue_mutex.
+     */
+    void TakeRun(const string &path, FileWrites &file, WriteBatch *batch,
+                 long max_size) {
+        CommitData *first = file.queued.front().write;
+
+        batch->path = path;
+        batch->fh = file.queued.front().fh;
+        batch->offset = first->offset;
+        batch->bytes = first->size;
+        batch->data.swap(first->data);
+        delete first;
+        file.queued.pop_front();
+
+        // pull in writes that continue or overwrite the batch
+        while (!file.queued.empty()) {
+            CommitData *next = file.queued.front().write;
+            long pos = next->offset - batch->offset;
+
+            if (pos < 0 || pos > (long)batch->data.size() ||
+                pos + next->size > max_size ||
+                Overlaps(file, next->offset, next->offset + next->size)) {
+                break;
+            }
+
+            if (pos + next->size > (long)batch->data.size()) {
+                batch->data.resize(pos + next->size);
+            }
+            memcpy(&batch->data[pos], next->data.data(), next->size);
+            batch->bytes += next->size;
+            delete next;
+            file.queued.pop_front();
+        }
+
+        file.in_flight.emplace_back(batch->offset,
+                                    batch->offset + batch->data.size());
+        batch->range = prev(file.in_flight.end());
+    }
+
+
+    // caller holds queue_mutex
+    bool TakeBatch(WriteBatch *batch, long max_size) {
+        for (auto path = active.begin(); path != active.end(); path++) {
+            FileWrites &file = files[*path];
+            CommitData *first = file.queued.front().write;
+
+            // wait for the batch in flight so the writes land in order
+            if (Overlaps(file, first->offset, first->offset + first->size)) {
+                continue;
+            }
+
+            TakeRun(*path, file, batch, max_size);
+
+            // go round the other files before coming back to this one
+            string taken = *path;
+            active.erase(path);
+            if (!file.queued.empty()) {
+                active.push_back(taken);
+            }
+
+            return true;
+        }
+
+        return false;
+    }
+};
+
+#endif // __WATFS_WRITE_QUEUE__
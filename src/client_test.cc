@@ -1,8 +1,511 @@
 #include "watfs_grpc_client.h"
+#include "dir_fd_cache.h"
+#include "stat_cache.h"
+
+
+static int failures = 0;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            cerr << __FILE__ << ":" << __LINE__ << ": " #cond << endl; \
+            failures++; \
+        } \
+    } while (0)
+
+
+/*
+ * returns the dirty data of path as offset:data pairs, e.g. "0:aab 5:c", with
+ * touching ranges joined so heap and journal layouts compare the same. This
+ * forgets the verf the data was sent to, like a resend would.
+ */
+static string Ranges(DirtyIndex &index, const string &path) {
+    vector<pair<long, string>> ranges;
+    string out;
+    long end = -1;
+
+    index.TakeForResend(path, &ranges);
+    for (auto &range : ranges) {
+        CHECK(range.first >= end);
+
+        if (range.first != end) {
+            if (!out.empty()) {
+                out += " ";
+            }
+            out += to_string(range.first) + ":";
+        }
+        out += range.second;
+        end = range.first + range.second.size();
+    }
+
+    return out;
+}
+
+
+/*
+ * returns the number of ranges path is kept in
+ */
+static size_t Pieces(DirtyIndex &index, const string &path) {
+    vector<pair<long, string>> ranges;
+
+    index.TakeForResend(path, &ranges);
+
+    return ranges.size();
+}
+
+
+static void TestDirtyOverlap(DirtyIndex &index) {
+    index.Add("/f", 0, "aaaa", 4);
+    index.Add("/f", 10, "bbbb", 4);
+    CHECK(Ranges(index, "/f") == "0:aaaa 10:bbbb");
+
+    // spans the gap and both ranges, the latest data wins
+    index.Add("/f", 2, "cccccccccc", 10);
+    CHECK(Ranges(index, "/f") == "0:aaccccccccccbb");
+
+    // in the middle of a range
+    index.Add("/f", 4, "dd", 2);
+    CHECK(Ranges(index, "/f") == "0:aaccddccccccbb");
+
+    // before the start and past the end
+    index.Add("/f", 12, "ee", 2);
+    index.Add("/f", 20, "f", 1);
+    index.Add("/f", 19, "gg", 2);
+    CHECK(Ranges(index, "/f") == "0:aaccddccccccee 19:gg");
+
+    index.Remove("/f");
+}
+
+
+static void TestDirtyAdjacent(DirtyIndex &index) {
+    // appends grow the range in place
+    index.Add("/f", 0, "ab", 2);
+    index.Add("/f", 2, "cd", 2);
+    CHECK(Ranges(index, "/f") == "0:abcd");
+
+    // one that ends where another starts is merged with it
+    index.Add("/f", 8, "gh", 2);
+    index.Add("/f", 6, "ef", 2);
+    CHECK(Ranges(index, "/f") == "0:abcd 6:efgh");
+
+    // and one that fills the gap joins all three
+    index.Add("/f", 4, "xy", 2);
+    CHECK(Ranges(index, "/f") == "0:abcdxyefgh");
+
+    index.Remove("/f");
+}
+
+
+static void TestDirtyTruncate(DirtyIndex &index) {
+    unsigned long version;
+
+    index.Add("/f", 0, "aaaa", 4);
+    index.Add("/f", 10, "bbbbbb", 6);
+
+    // into the middle of a range
+    index.Truncate("/f", 12);
+    CHECK(Ranges(index, "/f") == "0:aaaa 10:bb");
+    CHECK(index.Bytes() == 6);
+
+    // between ranges
+    index.Truncate("/f", 6);
+    CHECK(Ranges(index, "/f") == "0:aaaa");
+
+    // to 0 leaves nothing to resend, so a commit from a restarted server
+    // covers the file and it can be cleaned
+    index.RecordVerf("/f", 1);
+    index.Truncate("/f", 0);
+    CHECK(index.Bytes() == 0);
+    CHECK(index.Dirty("/f", &version));
+    CHECK(Ranges(index, "/f") == "");
+    CHECK(index.SentTo("/f", 2));
+    index.Clean("/f", version);
+    CHECK(!index.Dirty("/f", &version));
+}
+
+
+static void TestDirtyClean(DirtyIndex &index) {
+    unsigned long version;
+
+    index.Add("/f", 0, "aaaa", 4);
+    index.RecordVerf("/f", 1);
+    CHECK(index.SentTo("/f", 1));
+    CHECK(!index.SentTo("/f", 2));
+    CHECK(index.Dirty("/f", &version));
+
+    // a write that lands while the commit is out isn't covered by it
+    index.Add("/f", 4, "bb", 2);
+    index.Clean("/f", version);
+    CHECK(index.Dirty("/f", &version));
+    CHECK(index.Bytes() == 6);
+
+    index.Clean("/f", version);
+    CHECK(!index.Dirty("/f", &version));
+    CHECK(index.Bytes() == 0);
+
+    // writes that went to two server instances need a resend
+    index.Add("/f", 0, "aaaa", 4);
+    index.RecordVerf("/f", 1);
+    index.RecordVerf("/f", 2);
+    CHECK(!index.SentTo("/f", 2));
+    index.Remove("/f");
+}
+
+
+/*
+ * the dirty index and journal don't need a server, so these run first, along
+ * with the cache tests below
+ */
+static void TestDirtyIndex() {
+    DirtyIndex heap_index;
+
+    TestDirtyOverlap(heap_index);
+    TestDirtyAdjacent(heap_index);
+    TestDirtyTruncate(heap_index);
+    TestDirtyClean(heap_index);
+
+    // heap ranges that touch are kept as one
+    heap_index.Add("/f", 0, "ab", 2);
+    heap_index.Add("/f", 4, "ef", 2);
+    heap_index.Add("/f", 2, "cd", 2);
+    CHECK(Pieces(heap_index, "/f") == 1);
+    heap_index.Remove("/f");
+
+    // the same with the data in a journal, where ranges are split by
+    // offset instead of copied
+    char journal_path[] = "/tmp/watfs_journal_XXXXXX";
+    int fd = mkstemp(journal_path);
+    CHECK(fd != -1);
+    close(fd);
+
+    WriteJournal journal;
+    CHECK(journal.Open(journal_path, 1 << 20) == 0);
+    unlink(journal_path);
+
+    DirtyIndex journal_index;
+    journal_index.SetJournal(&journal);
+
+    TestDirtyOverlap(journal_index);
+    TestDirtyAdjacent(journal_index);
+    TestDirtyTruncate(journal_index);
+    TestDirtyClean(journal_index);
+
+    // once nothing is referenced the journal starts over
+    long offset = journal.Append("x", 1);
+    CHECK(offset == 0);
+    journal.Release(1);
+
+    // a journal too small for a write leaves it on the heap
+    WriteJournal small_journal;
+    CHECK(small_journal.Open(journal_path, 4) == 0);
+    unlink(journal_path);
+
+    DirtyIndex small_index;
+    small_index.SetJournal(&small_journal);
+    small_index.Add("/f", 0, "abc", 3);
+    small_index.Add("/f", 3, "def", 3);
+    CHECK(Ranges(small_index, "/f") == "0:abcdef");
+    small_index.Truncate("/f", 1);
+    CHECK(Ranges(small_index, "/f") == "0:a");
+    small_index.Remove("/f");
+    CHECK(small_index.Bytes() == 0);
+}
+
+
+/*
+ * the disk cache keeps its blocks across opens of the same directory, as
+ * long as the file they came from hasn't changed
+ */
+static void TestDiskCache() {
+    char dir[] = "/tmp/watfs_disk_cache_XXXXXX";
+    string blocks_path;
+    string out;
+    struct stat attr;
+    struct stat changed;
+
+    CHECK(mkdtemp(dir) != NULL);
+    blocks_path = string(dir) + "/blocks";
+
+    memset(&attr, 0, sizeof(attr));
+    attr.st_ino = 7;
+    attr.st_size = 2 * BLOCK_SZ + 100;
+    attr.st_mtim.tv_sec = 5;
+
+    string first(BLOCK_SZ, 'a');
+    string last(100, 'c');
+
+    {
+        DiskCache cache;
+        CHECK(cache.Open(dir, 3 * BLOCK_SZ) == 0);
+
+        // only one client at a time
+        DiskCache other;
+        CHECK(other.Open(dir, 3 * BLOCK_SZ) == -EBUSY);
+        CHECK(!other.Enabled());
+
+        CHECK(!cache.Read("/f", attr, 0, &out));
+        cache.Write("/f", attr, 0, first);
+        cache.Write("/f", attr, 2, last);
+        CHECK(cache.Read("/f", attr, 2, &out) && out == last);
+    }
+
+    {
+        // a remount starts warm
+        DiskCache cache;
+        CHECK(cache.Open(dir, 3 * BLOCK_SZ) == 0);
+        CHECK(cache.Read("/f", attr, 0, &out) && out == first);
+        CHECK(cache.Read("/f", attr, 2, &out) && out == last);
+
+        // block 0 was used least recently, so it makes room for these
+        cache.Write("/g", attr, 0, first);
+        cache.Write("/h", attr, 0, first);
+        CHECK(cache.evictions == 1);
+        CHECK(!cache.Read("/f", attr, 0, &out));
+        CHECK(cache.Read("/f", attr, 2, &out) && out == last);
+
+        // a file that changed loses its blocks
+        changed = attr;
+        changed.st_ctim.tv_nsec = 1;
+        CHECK(!cache.Read("/h", changed, 0, &out));
+        CHECK(!cache.Read("/h", attr, 0, &out));
+
+        cache.Invalidate("/g");
+        CHECK(!cache.Read("/g", attr, 0, &out));
+    }
+
+    // tear every slot, as a crash in the middle of writing them would
+    int fd = open(blocks_path.c_str(), O_WRONLY);
+    CHECK(fd != -1);
+    for (int slot = 0; slot < 3; slot++) {
+        CHECK(pwrite(fd, "xyz", 3, (off_t)slot * BLOCK_SZ) == 3);
+    }
+    close(fd);
+
+    {
+        DiskCache cache;
+        CHECK(cache.Open(dir, 3 * BLOCK_SZ) == 0);
+        CHECK(!cache.Read("/f", attr, 2, &out));
+        CHECK(cache.hits == 0);
+    }
+
+    {
+        // a cache of another size starts over
+        DiskCache cache;
+        CHECK(cache.Open(dir, 4 * BLOCK_SZ) == 0);
+        cache.Write("/f", attr, 2, last);
+    }
+    {
+        DiskCache cache;
+        CHECK(cache.Open(dir, 3 * BLOCK_SZ) == 0);
+        CHECK(!cache.Read("/f", attr, 2, &out));
+    }
+
+    unlink(blocks_path.c_str());
+    unlink((string(dir) + "/index").c_str());
+    rmdir(dir);
+}
+
+
+/*
+ * the server resolves client paths with the directory cache, which must
+ * never hand out a descriptor outside the export root
+ */
+static void TestDirFdCache() {
+    char root[] = "/tmp/watfs_root_XXXXXX";
+    char outside[] = "/tmp/watfs_outside_XXXXXX";
+    struct stat st;
+
+    CHECK(mkdtemp(root) != NULL);
+    CHECK(mkdtemp(outside) != NULL);
+
+    string top = root;
+    CHECK(mkdir((top + "/a").c_str(), 0700) == 0);
+    CHECK(mkdir((top + "/a/b").c_str(), 0700) == 0);
+    int fd = open((top + "/a/b/f").c_str(), O_WRONLY | O_CREAT, 0600);
+    CHECK(fd != -1);
+    close(fd);
+    CHECK(symlink(outside, (top + "/esc").c_str()) == 0);
+    CHECK(symlink("..", (top + "/a/b/up").c_str()) == 0);
+
+    DirFdCache cache(2);
+    CHECK(cache.Open(top) == 0);
+
+    {
+        ParentDir parent(&cache, top + "/a/b/f");
+        CHECK(parent.fd != -1 && strcmp(parent.name, "f") == 0);
+        CHECK(fstatat(parent.fd, parent.name, &st, 0) == 0);
+    }
+    {
+        ParentDir parent(&cache, top + "/");
+        CHECK(parent.fd != -1 && strcmp(parent.name, ".") == 0);
+    }
+    {
+        // a link that stays inside the root is followed
+        ParentDir parent(&cache, top + "/a/b/up/b/f");
+        CHECK(parent.fd != -1);
+    }
+
+    // .. anywhere, empty components and paths outside the root are refused
+    const char *refused[] = {
+        "/..", "/a/..", "/a/../../x", "/a/b/../../../x", "//a/b/f",
+        "/a//b/f", "/a/b/", "x/f", "/esc/x",
+    };
+    for (auto suffix : refused) {
+        ParentDir parent(&cache, top + suffix);
+        CHECK(parent.fd == -1);
+    }
+    {
+        ParentDir parent(&cache, string(outside) + "/x");
+        CHECK(parent.fd == -1 && errno == EACCES);
+    }
+    CHECK(cache.Acquire(top + "/a/..") == NULL && errno == EACCES);
+    CHECK(cache.Acquire(top + "//a") == NULL && errno == EACCES);
+    CHECK(cache.Acquire(outside) == NULL && errno == EACCES);
+
+    // a renamed directory isn't reached through its old name
+    CHECK(rename((top + "/a").c_str(), (top + "/c").c_str()) == 0);
+    cache.InvalidateTree(top + "/a");
+    {
+        ParentDir parent(&cache, top + "/a/b/f");
+        CHECK(parent.fd == -1 && errno == ENOENT);
+    }
+    {
+        ParentDir parent(&cache, top + "/c/b/f");
+        CHECK(parent.fd != -1);
+    }
+
+    unlink((top + "/c/b/up").c_str());
+    unlink((top + "/c/b/f").c_str());
+    rmdir((top + "/c/b").c_str());
+    rmdir((top + "/c").c_str());
+    unlink((top + "/esc").c_str());
+    rmdir(root);
+    rmdir(outside);
+}
+
+
+/*
+ * stat path through cache the way the server does, returns 0 or the errno
+ */
+static int CachedStat(StatCache &cache, const string &path,
+                      struct stat *statbuf) {
+    StatCacheToken token;
+    int err;
+
+    if (cache.Lookup(path, statbuf, &err)) {
+        return err;
+    }
+
+    bool cacheable = cache.Prepare(path, &token);
+    err = stat(path.c_str(), statbuf) == -1 ? errno : 0;
+    if (cacheable) {
+        cache.Insert(path, statbuf, err, token);
+    }
+
+    return err;
+}
+
+
+/*
+ * returns whether path drops out of cache within a second, which is how
+ * long we give the watcher to hear about a change
+ */
+static bool Dropped(StatCache &cache, const string &path) {
+    struct stat statbuf;
+    int err;
+
+    for (int i = 0; i < 100; i++) {
+        if (!cache.Lookup(path, &statbuf, &err)) {
+            return true;
+        }
+        usleep(10000);
+    }
+
+    return false;
+}
+
+
+static void TestStatCache() {
+    char root[] = "/tmp/watfs_stat_XXXXXX";
+    struct stat statbuf;
+    int err;
+
+    CHECK(mkdtemp(root) != NULL);
+
+    string top = root;
+    string file = top + "/a/f";
+    CHECK(mkdir((top + "/a").c_str(), 0700) == 0);
+    int fd = open(file.c_str(), O_WRONLY | O_CREAT, 0600);
+    CHECK(fd != -1);
+
+    pthread_mutex_t renamed_mutex = PTHREAD_MUTEX_INITIALIZER;
+    vector<string> renamed;
+
+    StatCache cache;
+    cache.OnNameChange([&](const string &path) {
+        pthread_mutex_lock(&renamed_mutex);
+        renamed.push_back(path);
+        pthread_mutex_unlock(&renamed_mutex);
+    });
+    CHECK(cache.Start(top, 16) == 0);
+
+    CHECK(CachedStat(cache, file, &statbuf) == 0);
+    CHECK(cache.Lookup(file, &statbuf, &err) && err == 0);
+
+    // a stat that raced an invalidation isn't cached
+    StatCacheToken token;
+    cache.Invalidate(file);
+    CHECK(cache.Prepare(file, &token));
+    CHECK(stat(file.c_str(), &statbuf) == 0);
+    cache.Invalidate(file);
+    cache.Insert(file, &statbuf, 0, token);
+    CHECK(!cache.Lookup(file, &statbuf, &err));
+
+    // nor one that raced the removal of a directory above it
+    CHECK(cache.Prepare(file, &token));
+    cache.InvalidateEntry(top + "/a");
+    cache.Insert(file, &statbuf, 0, token);
+    CHECK(!cache.Lookup(file, &statbuf, &err));
+
+    // missing files are cached too
+    CHECK(CachedStat(cache, top + "/a/g", &statbuf) == ENOENT);
+    CHECK(cache.Lookup(top + "/a/g", &statbuf, &err) && err == ENOENT);
+
+    // and changes made by somebody else drop them
+    CHECK(CachedStat(cache, file, &statbuf) == 0);
+    CHECK(write(fd, "x", 1) == 1);
+    CHECK(Dropped(cache, file));
+    CHECK(CachedStat(cache, file, &statbuf) == 0 && statbuf.st_size == 1);
+
+    CHECK(rename(file.c_str(), (top + "/a/g").c_str()) == 0);
+    CHECK(Dropped(cache, top + "/a/g"));
+
+    pthread_mutex_lock(&renamed_mutex);
+    CHECK(find(renamed.begin(), renamed.end(), file) != renamed.end());
+    pthread_mutex_unlock(&renamed_mutex);
+
+    close(fd);
+    unlink((top + "/a/g").c_str());
+    rmdir((top + "/a").c_str());
+    rmdir(root);
+}
 
 
 int main(int argc, const char *argv[])
 {
+    TestDirtyIndex();
+    TestDiskCache();
+    TestDirFdCache();
+    TestStatCache();
+    if (failures != 0) {
+        cerr << failures << " cache checks failed" << endl;
+        return 1;
+    }
+
+    if (argc < 2) {
+        return 0;
+    }
+
     struct stat file_attr;
     struct stat dir_attr;
     string path;
@@ -6,6 +6,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <stddef.h>
+#include <stdlib.h>
 #include <assert.h>
 #include <dirent.h>
 #include <errno.h>
@@ -19,19 +20,129 @@ static struct fuse_operations watfs_oper;
 
 static struct options { 
     int show_help;
+    // attribute cache tuning, a size or ttl of 0 disables the cache
+    unsigned long attr_cache_size;
+    long attr_cache_ttl;
+    // stream message size, 0 to tune automatically within max_chunk_size
+    long chunk_size;
+    long max_chunk_size;
+    // file data caching, 0 readahead threads disables readahead
+    unsigned long block_cache_size;
+    long readahead_max;
+    int readahead_threads;
+    // read-only opens of files up to whole_file_max bytes fetch them whole,
+    // 0 turns that off
+    long whole_file_max;
+    unsigned long whole_file_cache_size;
+    // directory of the persistent block cache, NULL for none
+    char *disk_cache;
+    unsigned long disk_cache_size;
+    // striping of large transfers, a width of 1 turns it off
+    long stripe_size;
+    int stripe_width;
+    // writes in flight, 0 to write synchronously
+    int write_depth;
+    // uncommitted data cap, and where to keep that data instead of memory
+    long dirty_max;
+    char *journal;
+    // RPCs in flight at once, 0 for no limit
+    int max_in_flight;
+    // where the server is, and how many connections to open to it
+    char *server;
+    int channels;
+    // tries per call, and the latency percentile past which calls are hedged
+    int retries;
+    int hedge_percentile;
+    // directory entries per readdir call, 0 for the whole directory
+    int readdir_page;
 } options;
 
 #define OPTION(t, p)                           \
     { t, offsetof(struct options, p), 1 }
+#define VALUE_OPTION(t, p)                     \
+    { t, offsetof(struct options, p), 0 }
 static const struct fuse_opt option_spec[] = {
     OPTION("-h", show_help),
     OPTION("--help", show_help),
+    VALUE_OPTION("--attr_cache_size=%lu", attr_cache_size),
+    VALUE_OPTION("--attr_cache_ttl=%ld", attr_cache_ttl),
+    VALUE_OPTION("--chunk_size=%ld", chunk_size),
+    VALUE_OPTION("--max_chunk_size=%ld", max_chunk_size),
+    VALUE_OPTION("--block_cache_size=%lu", block_cache_size),
+    VALUE_OPTION("--readahead_max=%ld", readahead_max),
+    VALUE_OPTION("--readahead_threads=%d", readahead_threads),
+    VALUE_OPTION("--whole_file_max=%ld", whole_file_max),
+    VALUE_OPTION("--whole_file_cache_size=%lu", whole_file_cache_size),
+    VALUE_OPTION("--disk_cache=%s", disk_cache),
+    VALUE_OPTION("--disk_cache_size=%lu", disk_cache_size),
+    VALUE_OPTION("--stripe_size=%ld", stripe_size),
+    VALUE_OPTION("--stripe_width=%d", stripe_width),
+    VALUE_OPTION("--write_depth=%d", write_depth),
+    VALUE_OPTION("--dirty_max=%ld", dirty_max),
+    VALUE_OPTION("--journal=%s", journal),
+    VALUE_OPTION("--max_in_flight=%d", max_in_flight),
+    VALUE_OPTION("--server=%s", server),
+    VALUE_OPTION("--channels=%d", channels),
+    VALUE_OPTION("--retries=%d", retries),
+    VALUE_OPTION("--hedge_percentile=%d", hedge_percentile),
+    VALUE_OPTION("--readdir_page=%d", readdir_page),
     FUSE_OPT_END
 };
 
 static void show_help(const char *progname)
 {
-    std::cout << "usage: " << progname << " <mountpoint>\n\n";
+    std::cout << "usage: " << progname << " [options] <mountpoint>\n\n";
+    std::cout << "WatFS options:\n"
+              << "    --attr_cache_size=<n>  max cached attributes "
+              << "(default: " << ATTR_CACHE_DEFAULT_SIZE << ")\n"
+              << "    --attr_cache_ttl=<ms>  attribute cache timeout "
+              << "(default: " << ATTR_CACHE_DEFAULT_TTL_MS << ")\n"
+              << "    --chunk_size=<bytes>   fixed stream message size "
+              << "(default: auto)\n"
+              << "    --max_chunk_size=<bytes>  largest stream message size "
+              << "(default: " << CHUNK_DEFAULT_MAX_SZ << ")\n"
+              << "    --block_cache_size=<bytes>  file data cache size "
+              << "(default: " << BLOCK_CACHE_DEFAULT_SIZE << ")\n"
+              << "    --readahead_max=<bytes>  largest readahead window "
+              << "(default: " << READAHEAD_DEFAULT_MAX << ")\n"
+              << "    --whole_file_max=<bytes>  fetch files up to this size "
+              << "whole when opened read-only, 0 for never (default: 0)\n"
+              << "    --whole_file_cache_size=<bytes>  whole file cache size "
+              << "(default: " << WHOLE_FILE_CACHE_DEFAULT_SIZE << ")\n"
+              << "    --disk_cache=<dir>     keep file blocks in this "
+              << "directory across mounts (default: none)\n"
+              << "    --disk_cache_size=<bytes>  disk cache size "
+              << "(default: " << DISK_CACHE_DEFAULT_SIZE << ")\n"
+              << "    --readahead_threads=<n>  readahead threads "
+              << "(default: " << READAHEAD_DEFAULT_THREADS << ")\n"
+              << "    --stripe_size=<bytes>  split larger reads and writes "
+              << "into stripes this size (default: " << STRIPE_DEFAULT_SIZE 
+              << ")\n"
+              << "    --stripe_width=<n>     stripes of a transfer in flight "
+              << "at once, 1 turns striping off (default: " 
+              << STRIPE_DEFAULT_WIDTH << ")\n"
+              << "    --write_depth=<n>      writes in flight, 0 writes "
+              << "synchronously (default: " << WRITE_BEHIND_DEFAULT_DEPTH 
+              << ")\n"
+              << "    --dirty_max=<bytes>    uncommitted data before writers "
+              << "commit, 0 for no limit (default: " << DIRTY_DEFAULT_MAX 
+              << ")\n"
+              << "    --journal=<file>       keep uncommitted data in this "
+              << "file instead of memory\n"
+              << "    --max_in_flight=<n>    RPCs in flight at once, 0 for no "
+              << "limit (default: " << ASYNC_DEFAULT_MAX_IN_FLIGHT << ")\n"
+              << "    --server=<host:port>   server address "
+              << "(default: " << CHANNEL_POOL_DEFAULT_ADDRESS << ")\n"
+              << "    --channels=<n>         connections to the server, the "
+              << "first for metadata (default: " << CHANNEL_POOL_DEFAULT_SIZE 
+              << ")\n"
+              << "    --retries=<n>          tries per call before it fails "
+              << "(default: " << RETRY_DEFAULT_MAX_ATTEMPTS << ")\n"
+              << "    --hedge_percentile=<p>  resend getattr and lookup calls "
+              << "slower than this percentile, 0 for never (default: 0)\n"
+              << "    --readdir_page=<n>     directory entries per readdir "
+              << "call, 0 for all (default: " << READDIR_DEFAULT_PAGE 
+              << ")\n\n";
 }
 
 
@@ -39,11 +150,50 @@ void *watfs_init(struct fuse_conn_info *conn, struct fuse_config *cfg)
 {
     (void) conn;
 
-    WatFSClient *client = new WatFSClient(grpc::CreateChannel("0.0.0.0:50051", 
-                                    grpc::InsecureChannelCredentials()), 30);
+    struct options *opts = (struct options *)fuse_get_context()->private_data;
+
+    // make room for the biggest stream messages we might negotiate
+    grpc::ChannelArguments channel_args;
+    channel_args.SetMaxReceiveMessageSize(opts->max_chunk_size + 
+                                          CHUNK_MESSAGE_OVERHEAD);
+
+    WatFSClient *client = new WatFSClient(opts->server, 
+                                          max(opts->channels, 1),
+                                          channel_args, 30);
+
+    client->attr_cache.Configure(opts->attr_cache_size, opts->attr_cache_ttl);
+    client->chunk_tuner.Configure(opts->max_chunk_size, opts->chunk_size);
+    client->block_cache.Configure(opts->block_cache_size);
+    client->async_calls.SetLimit(opts->max_in_flight);
+    client->retry_policy.Configure(opts->retries, opts->hedge_percentile);
+    client->ConfigureReaddir(opts->readdir_page);
+    client->StartReadahead(opts->readahead_threads, opts->readahead_max);
+    client->StartStriping(max(opts->stripe_size, (long)BLOCK_SZ), 
+                          opts->stripe_width);
+    client->StartWriteBehind(opts->write_depth);
+
+    // without the journal uncommitted data just stays in memory
+    int res = client->ConfigureDirty(opts->dirty_max, opts->journal);
+    if (res < 0) {
+        cerr << "failed to create journal: " << strerror(-res) << endl;
+    }
+
+    if (opts->disk_cache != NULL) {
+        res = client->disk_cache.Open(opts->disk_cache, 
+                                      opts->disk_cache_size);
+        if (res < 0) {
+            cerr << "failed to open disk cache: " << strerror(-res) << endl;
+        }
+    }
 
     client->verf = client->WatFSNull();
 
+    // the contents come back in a single message, which can be no bigger
+    // than the chunk size the server agreed to
+    client->whole_files.Configure(opts->whole_file_cache_size,
+                                  min(opts->whole_file_max, 
+                                      client->chunk_tuner.MaxChunkSize() - 1));
+
     return client;
 } 
 
@@ -51,9 +201,14 @@ void watfs_destroy(void* private_data)
 {
     WatFSClient *client = (WatFSClient *) private_data;
 
-    for (auto write : client->cached_writes) {
-        delete write;
-    }
+    client->attr_cache.PrintStats(cerr);
+    client->chunk_tuner.PrintStats(cerr);
+    client->block_cache.PrintStats(cerr);
+    client->whole_files.PrintStats(cerr);
+    client->disk_cache.PrintStats(cerr);
+    client->async_calls.PrintStats(cerr);
+    client->channels.PrintStats(cerr);
+    client->retry_policy.PrintStats(cerr);
 
     delete client;
 }
@@ -78,8 +233,14 @@ int watfs_opendir(const char *path, struct fuse_file_info *f)
     WatFSClient *client = (WatFSClient *)fuse_get_context()->private_data;
 
     res = client->WatFSLookup(path);
+    if (res < 0) {
+        return res;
+    }
 
-    return res;
+    // readdir fetches the listing a page at a time into this
+    f->fh = (uint64_t)new OpenDir(path);
+
+    return 0;
 }
 
 
@@ -91,19 +252,77 @@ int watfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
     
     WatFSClient *client = (WatFSClient *)fuse_get_context()->private_data;
 
-    res = client->WatFSReaddir(path, buf, filler);
+    res = client->WatFSReaddir((OpenDir *)fi->fh, offset, buf, filler);
     
     return res;
 }
 
 
+int watfs_releasedir(const char *path, struct fuse_file_info *fi)
+{
+    delete (OpenDir *)fi->fh;
+
+    return 0;
+}
+
+
 int watfs_open(const char *path, struct fuse_file_info *f)
 {    
     int res;
+    uint64_t file_handle;
+    shared_ptr<const string> whole;
+    bool unchanged = false;
     
     WatFSClient *client = (WatFSClient *)fuse_get_context()->private_data;
 
-    res = client->WatFSLookup(path);
+    // nothing can change a read-only file's contents behind our back until
+    // it is closed, or so close-to-open consistency lets us pretend
+    if ((f->flags & O_ACCMODE) == O_RDONLY && 
+        client->whole_files.MaxFileSize() > 0) {
+        res = client->WatFSOpenWhole(path, f->flags, &file_handle, &whole,
+                                     &unchanged);
+    } else {
+        res = client->WatFSOpen(path, f->flags, &file_handle);
+    }
+    if (res < 0) {
+        return res;
+    }
+
+    // close-to-open consistency: don't trust data cached before this open
+    client->block_cache.Invalidate(path);
+
+    // unless the server says the file is just as we last read it, in which
+    // case the kernel can keep its pages too
+    f->keep_cache = unchanged;
+
+    // reads and writes send the server handle instead of the path
+    OpenFile *file = new OpenFile(path, file_handle);
+    file->whole = whole;
+    f->fh = (uint64_t)file;
+
+    return 0;
+}
+
+
+/*
+ * create and open a file in one round trip, instead of a mknod and an open
+ */
+int watfs_create(const char *path, mode_t mode, struct fuse_file_info *f)
+{
+    int res;
+    uint64_t file_handle;
+
+    WatFSClient *client = (WatFSClient *)fuse_get_context()->private_data;
+
+    res = client->WatFSCreate(path, mode, f->flags, &file_handle);
+    if (res < 0) {
+        return res;
+    }
+
+    // an existing file may have been opened instead, see WatFSCreate
+    client->block_cache.Invalidate(path);
+
+    f->fh = (uint64_t)new OpenFile(path, file_handle);
 
     return 0;
 }
@@ -139,14 +358,9 @@ int watfs_read(const char* path, char *buf, size_t size, off_t offset,
     int res;
 
     WatFSClient *client = (WatFSClient *)fuse_get_context()->private_data;
+    OpenFile *file = (OpenFile *)fi->fh;
 
-    res = client->WatFSRead(path, offset, size, buf);
-
-    if (res < 0) {
-        cerr << res << endl << endl << endl;
-        perror("read");
-        exit(1);
-    }
+    res = client->ReadFile(file, offset, size, buf);
     
     return res;
 }
@@ -157,70 +371,67 @@ int watfs_write(const char* path, const char *buf, size_t size, off_t offset,
 
     int res;
 
-    CommitData *write = new CommitData(path, offset, size, buf);
-    
     WatFSClient *client = (WatFSClient *)fuse_get_context()->private_data;
+    OpenFile *file = (OpenFile *)fi->fh;
 
-    
-    pthread_mutex_lock(&(client->cached_writes_mutex));
-    
-    client->cached_writes.push_back(write);
-
-    pthread_mutex_unlock(&(client->cached_writes_mutex));
+    // kept until committed, in case the server crashes before then
+    client->dirty_index.Add(path, offset, buf, size);
 
+    if (client->WriteBehind()) {
+        // the sender threads take it from here, errors show up on flush
+        client->QueueWrite(new CommitData(path, offset, size, buf), file->fh);
+        client->ThrottleWrites(path);
+        return size;
+    }
     
-    res = client->WatFSWrite(path, buf, size, offset);
-
+    res = client->WatFSWrite(path, buf, size, offset, &file->fh);
     if (res < 0) {
-        cerr << res << endl << endl << endl;
-        perror("write");
-        exit(1);
+        return res;
     }
+
+    client->ThrottleWrites(path);
     
     return res;
 }
 
 
+/*
+ * commit the writes to path, other files are left for when they are released
+ *
+ * returns 0, or -errno if a queued write to path failed
+ */
 int watfs_commit(const char* path, struct fuse_file_info *fi) {
 
-    int res;
-
     WatFSClient *client = (WatFSClient *)fuse_get_context()->private_data;
 
-    pthread_mutex_lock(&(client->cached_writes_mutex));
+    return client->CommitFile(path);
+}
 
-    int verf = client->WatFSCommit();
 
-    while (client->verf != verf) {
-        cerr << "Server crashed! Resend cached writes" << endl;
-        cerr << "our verf: " << client->verf << endl;
-        cerr << "server verf: " << verf << endl;
-        client->verf = verf;
-        
-        for (auto write : client->cached_writes) {
-            cerr << write->path << endl;
-            res = client->WatFSWrite(write->path.data(), write->data.data(), 
-                                     write->size, write->offset);
-        }
-        verf = client->WatFSCommit();
-    }
+int watfs_flush(const char* path, struct fuse_file_info *fi) {
+    
+    return watfs_commit(path, fi);
+}
+
+
+int watfs_fsync(const char* path, int datasync, struct fuse_file_info *fi) {
+
+    return watfs_commit(path, fi);
+}
 
-    for (auto write : client->cached_writes) {
-        delete write;
-    }
 
-    client->cached_writes.clear();
+int watfs_release(const char* path, struct fuse_file_info *fi) {
 
-    pthread_mutex_unlock(&(client->cached_writes_mutex));
+    OpenFile *file = (OpenFile *)fi->fh;
 
     // we aren't allowed to return errors here!
-    return 0;
-}
+    watfs_commit(path, fi);
 
+    // readahead still queued for this file is no longer wanted
+    file->readahead->Cancel();
+    delete file;
 
-int watfs_flush(const char* path, struct fuse_file_info *fi) {
-    
-    return watfs_commit(path, fi);
+    return 0;
 }
 
 
@@ -230,7 +441,9 @@ int watfs_truncate(const char* path, off_t size, struct fuse_file_info *fi) {
 
     WatFSClient *client = (WatFSClient *)fuse_get_context()->private_data;
 
-    res = client->WatFSTruncate(path, size);
+    // fi is only set for ftruncate on an open file
+    res = client->WatFSTruncate(path, size, 
+                                fi != NULL ? &((OpenFile *)fi->fh)->fh : NULL);
     
     return res;
 }
@@ -291,13 +504,16 @@ void set_fuse_ops(struct fuse_operations *ops) {
     ops->getattr    = watfs_getattr;
     ops->opendir    = watfs_opendir;
     ops->readdir    = watfs_readdir;
+    ops->releasedir = watfs_releasedir;
     ops->mknod      = watfs_mknod;
     ops->open       = watfs_open;
+    ops->create     = watfs_create;
     ops->mknod      = watfs_mknod;
     ops->read       = watfs_read;
     ops->write      = watfs_write;
-    ops->release    = watfs_commit;
+    ops->release    = watfs_release;
     ops->flush      = watfs_flush;
+    ops->fsync      = watfs_fsync;
     ops->truncate   = watfs_truncate;
     ops->rename     = watfs_rename;
     ops->unlink     = watfs_unlink;
@@ -311,6 +527,29 @@ int main(int argc, char* argv[]){
 
     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
 
+    options.attr_cache_size = ATTR_CACHE_DEFAULT_SIZE;
+    options.attr_cache_ttl = ATTR_CACHE_DEFAULT_TTL_MS;
+    options.chunk_size = 0;
+    options.max_chunk_size = CHUNK_DEFAULT_MAX_SZ;
+    options.block_cache_size = BLOCK_CACHE_DEFAULT_SIZE;
+    options.whole_file_max = 0;
+    options.whole_file_cache_size = WHOLE_FILE_CACHE_DEFAULT_SIZE;
+    options.disk_cache = NULL;
+    options.disk_cache_size = DISK_CACHE_DEFAULT_SIZE;
+    options.readahead_max = READAHEAD_DEFAULT_MAX;
+    options.readahead_threads = READAHEAD_DEFAULT_THREADS;
+    options.stripe_size = STRIPE_DEFAULT_SIZE;
+    options.stripe_width = STRIPE_DEFAULT_WIDTH;
+    options.write_depth = WRITE_BEHIND_DEFAULT_DEPTH;
+    options.dirty_max = DIRTY_DEFAULT_MAX;
+    options.journal = NULL;
+    options.max_in_flight = ASYNC_DEFAULT_MAX_IN_FLIGHT;
+    options.server = strdup(CHANNEL_POOL_DEFAULT_ADDRESS);
+    options.channels = CHANNEL_POOL_DEFAULT_SIZE;
+    options.retries = RETRY_DEFAULT_MAX_ATTEMPTS;
+    options.hedge_percentile = 0;
+    options.readdir_page = READDIR_DEFAULT_PAGE;
+
     if (fuse_opt_parse(&args, &options, option_spec, NULL) == -1) {
         return 1;
     }
@@ -323,7 +562,12 @@ int main(int argc, char* argv[]){
 
     set_fuse_ops(&watfs_oper);
 
-    return fuse_main(argc, argv, &watfs_oper, &options);
+    // pass on the remaining arguments, our own options have been consumed
+    int ret = fuse_main(args.argc, args.argv, &watfs_oper, &options);
+
+    fuse_opt_free_args(&args);
+
+    return ret;
 }
 
 
@@ -1,43 +1,215 @@
 #include "watfs_grpc_client.h"
 
 
-WatFSClient::WatFSClient(shared_ptr<Channel> channel) : 
-    stub_(WatFS::NewStub(channel)) {
+/*
+ * decode a serialized WatFSReadRet, copying its data field straight into data
+ * at *bytes_read, without going through a protobuf message. At most count
+ * bytes are stored in data in total. *bytes_read is advanced past the new
+ * data, and *err is set if the message carries an error.
+ */
+static void decode_read_reply(ByteBuffer *reply, char *data, int count, 
+                              int *bytes_read, int *err) {
+
+    ProtoBufferReader input(reply);
+    CodedInputStream stream(&input);
+    uint32_t tag;
+    uint32_t value;
+
+    while ((tag = stream.ReadTag()) != 0) {
+        switch (WireFormatLite::GetTagFieldNumber(tag)) {
+        case WatFSReadRet::kErrFieldNumber:
+            if (!stream.ReadVarint32(&value)) {
+                return;
+            }
+            *err = value;
+            break;
+
+        case WatFSReadRet::kDataFieldNumber: {
+            if (!stream.ReadVarint32(&value)) {
+                return;
+            }
+            int size = min((int)value, count - *bytes_read);
+            if (!stream.ReadRaw(data + *bytes_read, size) || 
+                !stream.Skip(value - size)) {
+                return;
+            }
+            *bytes_read += size;
+            break;
+        }
+
+        default:
+            // count tells us nothing the data length doesn't
+            if (!WireFormatLite::SkipField(&stream, tag)) {
+                return;
+            }
+        }
+    }
+}
+
+
+/*
+ * returns the path of the directory containing path
+ */
+static string parent_path(const string &path) {
+    size_t pos = path.find_last_of('/');
+    if (pos == string::npos || pos == 0) {
+        return "/";
+    }
+    return path.substr(0, pos);
+}
+
+
+WatFSClient::WatFSClient(shared_ptr<Channel> channel) {
+        channels.Add(channel);
+
         grpc_deadline = 120;
+        readahead_max = READAHEAD_DEFAULT_MAX;
+        readahead_stopping = false;
+        dirty_max = 0;
+        stripe_size = STRIPE_DEFAULT_SIZE;
+        stripe_width = 1;
+        readdir_page = READDIR_DEFAULT_PAGE;
+
+        readahead_mutex = PTHREAD_MUTEX_INITIALIZER;
+        readahead_ready = PTHREAD_COND_INITIALIZER;
+    }
+
 
-        cached_writes_mutex = PTHREAD_MUTEX_INITIALIZER;
+WatFSClient::WatFSClient(shared_ptr<Channel> channel, long deadline) {
+        channels.Add(channel);
+
+        grpc_deadline = deadline;
+        readahead_max = READAHEAD_DEFAULT_MAX;
+        readahead_stopping = false;
+        dirty_max = 0;
+        stripe_size = STRIPE_DEFAULT_SIZE;
+        stripe_width = 1;
+        readdir_page = READDIR_DEFAULT_PAGE;
+
+        readahead_mutex = PTHREAD_MUTEX_INITIALIZER;
+        readahead_ready = PTHREAD_COND_INITIALIZER;
     }
 
 
-WatFSClient::WatFSClient(shared_ptr<Channel> channel, long deadline) : 
-    stub_(WatFS::NewStub(channel)) {
+WatFSClient::WatFSClient(const string &address, int nchannels,
+                         const grpc::ChannelArguments &args, long deadline) {
+        channels.Connect(address, nchannels, args);
+
         grpc_deadline = deadline;
+        readahead_max = READAHEAD_DEFAULT_MAX;
+        readahead_stopping = false;
+        dirty_max = 0;
+        stripe_size = STRIPE_DEFAULT_SIZE;
+        stripe_width = 1;
+        readdir_page = READDIR_DEFAULT_PAGE;
+
+        readahead_mutex = PTHREAD_MUTEX_INITIALIZER;
+        readahead_ready = PTHREAD_COND_INITIALIZER;
+    }
+
 
-        cached_writes_mutex = PTHREAD_MUTEX_INITIALIZER;
+WatFSClient::~WatFSClient() {
+    write_queue.WaitAll();
+    write_queue.Stop();
+    for (auto thread : write_threads) {
+        pthread_join(thread, NULL);
     }
 
+    pthread_mutex_lock(&readahead_mutex);
+    readahead_stopping = true;
+    readahead_queue.clear();
+    pthread_cond_broadcast(&readahead_ready);
+    pthread_mutex_unlock(&readahead_mutex);
+
+    for (auto thread : readahead_threads) {
+        pthread_join(thread, NULL);
+    }
+}
+
+
+void WatFSClient::StartReadahead(int threads, long max_window) {
+    readahead_max = max_window;
+
+    for (int i = 0; i < threads; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, ReadaheadWorker, this) != 0) {
+            cerr << "failed to start readahead thread: " << strerror(errno) 
+                 << endl;
+            break;
+        }
+        readahead_threads.push_back(thread);
+    }
+}
+
+
+int WatFSClient::ReadFile(OpenFile *file, off_t offset, int count, 
+                          char *data) {
+    off_t start;
+    off_t end;
+    unsigned long generation;
+    int bytes_read = 0;
+
+    // fetched whole when it was opened
+    if (file->whole != NULL) {
+        if (offset >= (off_t)file->whole->size()) {
+            return 0;
+        }
+        bytes_read = min((size_t)count, file->whole->size() - offset);
+        memcpy(data, file->whole->data() + offset, bytes_read);
+        return bytes_read;
+    }
+
+    // read our own writes
+    write_queue.Wait(file->path);
+
+    // only streams are worth caching, random reads go straight to the server
+    if (!file->readahead->Update(offset, count, readahead_max, &start, &end,
+                                 &generation)) {
+        return WatFSRead(file->path, offset, count, data, &file->fh);
+    }
+
+    QueueReadahead(file, start, end, generation);
+
+    while (bytes_read < count) {
+        off_t pos = offset + bytes_read;
+        size_t block_offset = pos % BLOCK_SZ;
+        int want = min(count - bytes_read, (int)(BLOCK_SZ - block_offset));
+
+        int res = ReadBlock(file->path, &file->fh, pos / BLOCK_SZ, 
+                            block_offset, want, data + bytes_read);
+        if (res < 0) {
+            return res;
+        }
+
+        bytes_read += res;
+        if (res < want) {
+            // end of file
+            break;
+        }
+    }
+
+    return bytes_read;
+}
+
 
 long int WatFSClient::WatFSNull() {
     WatFSStatus client_status;
     WatFSStatus server_status;
 
     client_status.set_verf(0);
+    client_status.set_max_chunk_size(chunk_tuner.MaxChunkSize());
 
     Status status;
 
-    do {    
-        ClientContext context;
-        context.set_wait_for_ready(true);
-        context.set_deadline(GetDeadline());
-
-        status = stub_->WatFSNull(&context, client_status, 
-                                  &server_status);
-    } while (!status.ok());
+    status = UnaryCall(&WatFS::Stub::PrepareAsyncWatFSNull, client_status, 
+                       &server_status, RETRY_IDEMPOTENT);
 
     if (!status.ok()) {
         return -1;
     }
 
+    chunk_tuner.SetServerMax(server_status.max_chunk_size());
+
     return server_status.verf();
 }
 
@@ -46,42 +218,56 @@ int WatFSClient::WatFSGetAttr(string filename, struct stat *statbuf) {
     WatFSGetAttrArgs getattr_args;
     WatFSGetAttrRet getattr_ret;
 
-    string marshalled_attr;
+    int err;
+
+    // the size and times aren't settled while writes are on their way
+    write_queue.Wait(filename);
+
+    if (attr_cache.Lookup(filename, statbuf, &err)) {
+        if (err != 0) {
+            errno = err;
+            return -errno;
+        }
+        return 0;
+    }
 
     getattr_args.set_file_path(filename);
 
     Status status;
 
-    do {
-        ClientContext context;
-        context.set_wait_for_ready(true);
-        context.set_deadline(GetDeadline());
-        status = stub_->WatFSGetAttr(&context, getattr_args, 
-                                     &getattr_ret);
-    } while (!status.ok());
+    // a change to the file while we wait for the reply makes it out of date
+    unsigned long generation = attr_cache.StartFetch(filename);
+
+    auto start = chrono::steady_clock::now();
+
+    status = UnaryCall(&WatFS::Stub::PrepareAsyncWatFSGetAttr, getattr_args, 
+                       &getattr_ret, RETRY_HEDGED);
+
+    // getattr does next to no work on the server, so this is about one RTT
+    chunk_tuner.RecordLatency(chrono::steady_clock::now() - start);
 
     if (!status.ok()) {
+        attr_cache.FinishFetch(filename, generation, NULL, 0);
         errno = ETIMEDOUT;
         return -errno;
     }
 
-    marshalled_attr = getattr_ret.attr();
-    memset(statbuf, 0, sizeof(struct stat));
-    memcpy(statbuf, marshalled_attr.data(), sizeof(struct stat));
-    
+    attr_from_wire(getattr_ret.attr(), statbuf);
 
     // on error we set errno and return -errno
     if (getattr_ret.err() != 0) {
         errno = getattr_ret.err();
+        attr_cache.FinishFetch(filename, generation, NULL, errno);
         return -errno;
     } else {
+        attr_cache.FinishFetch(filename, generation, statbuf, 0);
         return 0;
     }
     
 }
 
 
-int WatFSClient::WatFSLookup(const string &path) {
+int WatFSClient::WatFSLookup(const string &path, uint64_t *file_handle) {
 
     WatFSLookupArgs lookup_args;
     WatFSLookupRet lookup_ret;
@@ -92,12 +278,8 @@ int WatFSClient::WatFSLookup(const string &path) {
 
     Status status;
 
-    do {
-        ClientContext context;
-        context.set_wait_for_ready(true);
-        context.set_deadline(GetDeadline());
-        status = stub_->WatFSLookup(&context, lookup_args, &lookup_ret);
-    } while (!status.ok());
+    status = UnaryCall(&WatFS::Stub::PrepareAsyncWatFSLookup, lookup_args, 
+                       &lookup_ret, RETRY_HEDGED);
 
     if (!status.ok()) {
         errno = ETIMEDOUT;
@@ -110,152 +292,499 @@ int WatFSClient::WatFSLookup(const string &path) {
         errno = lookup_ret.err();
         return -errno;
     } else {
+        if (file_handle != NULL) {
+            *file_handle = lookup_ret.file_handle();
+        }
+        return 0;
+    }
+}
+
+
+int WatFSClient::WatFSOpen(const string &path, int flags, 
+                           uint64_t *file_handle) {
+
+    WatFSOpenArgs open_args;
+    WatFSOpenRet open_ret;
+
+    open_args.set_file_path(path);
+    open_args.set_flags(flags);
+
+    Status status;
+
+    status = UnaryCall(&WatFS::Stub::PrepareAsyncWatFSOpen, open_args, 
+                       &open_ret, RETRY_IDEMPOTENT);
+
+    if (!status.ok()) {
+        errno = ETIMEDOUT;
+        cerr << status.error_message() << endl;
+        return -errno;
+    }
+
+    // on error we set errno and return -errno
+    if (open_ret.err() != 0) {
+        errno = open_ret.err();
+        return -errno;
+    } else {
+        *file_handle = open_ret.file_handle();
+        return 0;
+    }
+}
+
+
+int WatFSClient::WatFSOpenWhole(const string &path, int flags, 
+                                uint64_t *file_handle, 
+                                shared_ptr<const string> *data,
+                                bool *unchanged) {
+    CompoundCall compound;
+    Status status;
+    struct stat statbuf;
+    long max_size = whole_files.MaxFileSize();
+    int err;
+
+    *data = NULL;
+    *unchanged = false;
+
+    // what we wrote ourselves has to be on the server before we look
+    write_queue.Wait(path);
+
+    WatFSOpenArgs *open_args = compound.Add(RETRY_IDEMPOTENT)->mutable_open();
+    open_args->set_file_path(path);
+    open_args->set_flags(flags);
+
+    // the attributes come before the data, so that a change between the two
+    // makes the copy look out of date rather than current
+    compound.Add(RETRY_IDEMPOTENT)->mutable_getattr()->set_file_path(path);
+
+    // send the contents along unless the file is known not to qualify, even
+    // if our copy may still be good, so that an out of date copy doesn't
+    // cost a second round trip. One more byte than the limit tells a file of
+    // just the right size from a bigger one.
+    bool fetch = true;
+    if (attr_cache.Lookup(path, &statbuf, &err) && err == 0 &&
+        (!S_ISREG(statbuf.st_mode) || statbuf.st_size > max_size)) {
+        fetch = false;
+    }
+    if (fetch) {
+        WatFSReadArgs *read_args = 
+            compound.Add(RETRY_IDEMPOTENT)->mutable_read();
+        read_args->set_file_handle(path);
+        read_args->set_offset(0);
+        read_args->set_count(max_size + 1);
+    }
+
+    status = RunCompound(&compound);
+
+    if (!status.ok()) {
+        errno = ETIMEDOUT;
+        cerr << status.error_message() << endl;
+        return -errno;
+    }
+
+    const WatFSCompoundResult *opened = compound.Result(0);
+    if (opened == NULL || opened->open().err() != 0) {
+        errno = compound.ret.err() ? compound.ret.err() : EIO;
+        return -errno;
+    }
+    *file_handle = opened->open().file_handle();
+
+    // the file went away between the open and the getattr, read it normally
+    const WatFSCompoundResult *attr = compound.Result(1);
+    if (attr == NULL || attr->getattr().err() != 0) {
+        attr_cache.Invalidate(path);
+        return 0;
+    }
+
+    CacheAttr(path, attr->getattr());
+    attr_from_wire(attr->getattr().attr(), &statbuf);
+
+    if (!S_ISREG(statbuf.st_mode) || statbuf.st_size > max_size) {
+        return 0;
+    }
+
+    *data = whole_files.Lookup(path, statbuf);
+    if (*data != NULL) {
+        *unchanged = true;
+        return 0;
+    }
+
+    // we didn't ask for the contents because the attributes we had cached
+    // were out of date, or the read failed; this open reads the file normally
+    const WatFSCompoundResult *fetched = compound.Result(2);
+    if (fetched == NULL || fetched->read().err() != 0) {
+        return 0;
+    }
+
+    string contents;
+    contents.swap(*compound.ret.mutable_results(2)->mutable_read()
+                       ->mutable_data());
+
+    // anything else changed the file after the getattr
+    if ((off_t)contents.size() != statbuf.st_size) {
+        return 0;
+    }
+
+    *data = whole_files.Insert(path, statbuf, move(contents));
+
+    return 0;
+}
+
+
+int WatFSClient::WatFSCreate(const string &path, mode_t mode, int flags, 
+                             uint64_t *file_handle) {
+    CompoundCall compound;
+    Status status;
+
+    WatFSMknodArgs *mknod_args = 
+        compound.Add(RETRY_NON_IDEMPOTENT)->mutable_mknod();
+    mknod_args->set_path(path);
+    mknod_args->set_mode(mode);
+
+    WatFSOpenArgs *open_args = compound.Add(RETRY_IDEMPOTENT)->mutable_open();
+    open_args->set_file_path(path);
+    open_args->set_flags(flags);
+
+    status = RunCompound(&compound);
+
+    if (!status.ok()) {
+        errno = ETIMEDOUT;
+        cerr << status.error_message() << endl;
+        return -errno;
+    }
+
+    attr_cache.Invalidate(parent_path(path));
+
+    const WatFSCompoundResult *created = compound.Result(0);
+
+    // somebody created it first, which only matters if we had to be first
+    if (created != NULL && created->mknod().err() == EEXIST && 
+        !(flags & O_EXCL)) {
+        return WatFSOpen(path, flags, file_handle);
+    }
+
+    const WatFSCompoundResult *opened = compound.Result(1);
+
+    // on error we set errno and return -errno, a short reply without an
+    // error is malformed
+    if (compound.ret.err() != 0 || opened == NULL) {
+        errno = compound.ret.err() ? compound.ret.err() : EIO;
+        attr_cache.Invalidate(path);
+        return -errno;
+    } else {
+        CacheAttr(path, created->mknod());
+        *file_handle = opened->open().file_handle();
         return 0;
     }
 }
 
 
-int WatFSClient::WatFSRead(const string &file_handle, int offset, int count, 
-                           char *data) {
+int WatFSClient::WatFSRead(const string &file_handle, off_t offset, 
+                           int count, char *data, uint64_t *fh) {
+
+    uint64_t first_fh = (fh != NULL) ? *fh : 0;
+    atomic<uint64_t> fresh_fh(first_fh);
+    long bytes_read = 0;
+
+    if (stripe_width <= 1 || count <= stripe_size) {
+        return StreamRead(file_handle, offset, count, data, fh);
+    }
+
+    auto transfer = make_shared<StripedTransfer>(offset, count, stripe_size,
+        [&](long stripe_offset, long size) -> long {
+            uint64_t stripe_fh = first_fh;
+            int res = StreamRead(file_handle, stripe_offset, size, 
+                                 data + (stripe_offset - offset), &stripe_fh);
+            if (stripe_fh != first_fh) {
+                fresh_fh = stripe_fh;
+            }
+            return res;
+        });
+    RunStripes(transfer);
+
+    if (fh != NULL) {
+        *fh = fresh_fh;
+    }
+
+    // the data ends at the first short stripe
+    for (long i = 0; i < transfer->Count(); i++) {
+        long res = transfer->results[i];
+        if (res < 0) {
+            errno = -res;
+            return -errno;
+        }
+        bytes_read += res;
+        if (res < transfer->StripeSize(i)) {
+            break;
+        }
+    }
+
+    return bytes_read;
+}
+
+
+int WatFSClient::StreamRead(const string &file_handle, long offset, int count, 
+                            char *data, uint64_t *fh) {
 
     WatFSReadArgs read_args;
-    WatFSReadRet read_ret;
 
-    string marshalled_file_attr;
-    string marshalled_data;
-    string buffer;
+    ByteBuffer request;
+    ByteBuffer reply;
+    bool own_buffer;
 
     int bytes_read;
+    int err;
 
 
-    read_args.set_file_handle(file_handle);
+    if (fh != NULL && *fh != 0) {
+        read_args.set_fh(*fh);
+    } else {
+        read_args.set_file_handle(file_handle);
+    }
     read_args.set_offset(offset);
     read_args.set_count(count);
+    read_args.set_chunk_size(chunk_tuner.ChunkSize(count));
+
+    SerializationTraits<WatFSReadArgs>::Serialize(read_args, &request, 
+                                                  &own_buffer);
 
 
     Status status;
 
+    auto start = chrono::steady_clock::now();
+
     /*
      * This is a bunch of nonsense made necessary by a gRPC bug (issue 4475, 
      * fixed upstream)
+     *
+     * We make the call through the generic stub so we get the raw reply 
+     * messages, and decode the data in each one straight into the caller's
+     * buffer instead of going through a WatFSReadRet.
      */
+    RetryLoop retry(&retry_policy, RETRY_IDEMPOTENT);
+
     do {
         bytes_read = 0;
-        buffer.clear();
+        err = 0;
 
         ClientContext context;
+        PendingCall pending;
+        bool ok;
 
         context.set_wait_for_ready(true);
         context.set_deadline(GetDeadline());
 
-        auto reader = stub_->WatFSRead(&context, read_args);
-        
+        async_calls.Begin();
+        PooledChannel *channel = channels.Acquire(BULK_LANE);
+
+        auto call = channel->generic_stub->PrepareCall(&context, 
+                                                       "/watfs.WatFS/WatFSRead",
+                                                       async_calls.Queue());
+
+        call->StartCall(&pending);
+        ok = async_calls.Wait(&pending);
+
+        if (ok) {
+            // send the request and half close in one go
+            call->WriteLast(request, grpc::WriteOptions(), &pending);
+            ok = async_calls.Wait(&pending);
+        }
+
         // read requested data from stream
-        while (reader->Read(&read_ret) && bytes_read < count) {
-            
-            // fail as soon as we find a problem
-            if (read_ret.count() == -1) {
-                errno = read_ret.err();
-                break;
+        while (ok) {
+            call->Read(&reply, &pending);
+            ok = async_calls.Wait(&pending);
+            if (ok) {
+                decode_read_reply(&reply, data, count, &bytes_read, &err);
             }
-            marshalled_data = read_ret.data();
-            buffer.append(marshalled_data);
-
-            // assume alloc'd correctly in caller
-            bytes_read += marshalled_data.size();
         }
 
-        status = reader->Finish();
-    } while (!status.ok());
+        call->Finish(&status, &pending);
+        async_calls.Wait(&pending);
 
-    memcpy(data, buffer.data(), bytes_read);
+        channels.Release(channel);
+        async_calls.End();
+    } while (retry.Again(status));
 
     if (!status.ok()) {
         errno = ETIMEDOUT;
         return -errno;
     }
 
+    if (err == ESTALE && RefreshHandle(file_handle, fh)) {
+        return StreamRead(file_handle, offset, count, data, NULL);
+    }
+
     // on error we set errno and return -errno
-    if (read_ret.err() != 0 || read_ret.count() == -1) {
-        errno = read_ret.err();
+    if (err != 0) {
+        errno = err;
         return -errno;
     } else {
+        chunk_tuner.RecordTransfer(bytes_read, 
+                                   chrono::steady_clock::now() - start);
         return bytes_read;
     }
 }
 
 
 int WatFSClient::WatFSWrite(const string &file_handle, const char *buffer, 
-                            long total_size, long offset) {
+                            long total_size, long offset, uint64_t *fh) {
+
+    uint64_t first_fh = (fh != NULL) ? *fh : 0;
+    atomic<uint64_t> fresh_fh(first_fh);
+    long bytes_written = 0;
+
+    if (stripe_width <= 1 || total_size <= stripe_size) {
+        return StreamWrite(file_handle, buffer, total_size, offset, fh);
+    }
+
+    auto transfer = make_shared<StripedTransfer>(offset, total_size, 
+                                                 stripe_size,
+        [&](long stripe_offset, long size) -> long {
+            uint64_t stripe_fh = first_fh;
+            int res = StreamWrite(file_handle, 
+                                  buffer + (stripe_offset - offset), size,
+                                  stripe_offset, &stripe_fh);
+            if (stripe_fh != first_fh) {
+                fresh_fh = stripe_fh;
+            }
+            return res;
+        });
+    RunStripes(transfer);
+
+    if (fh != NULL) {
+        *fh = fresh_fh;
+    }
+
+    // each stripe cached the attributes it got back, in whatever order the
+    // stripes finished
+    attr_cache.Invalidate(file_handle);
+
+    for (long i = 0; i < transfer->Count(); i++) {
+        long res = transfer->results[i];
+        if (res < 0) {
+            errno = -res;
+            return -errno;
+        }
+        bytes_written += res;
+    }
+
+    return bytes_written;
+}
+
+
+int WatFSClient::StreamWrite(const string &file_handle, const char *buffer, 
+                             long total_size, long offset, uint64_t *fh) {
     
     WatFSWriteArgs write_args;
     WatFSWriteRet write_ret;
 
     string marshalled_data;
 
+    int chunk_size = chunk_tuner.ChunkSize(total_size);
+
     Status status;
 
+    auto start = chrono::steady_clock::now();
+
+    // writes go to a fixed offset, so a repeat leaves the same bytes behind
+    RetryLoop retry(&retry_policy, RETRY_IDEMPOTENT);
+
     do {
         ClientContext context;
+        PendingCall pending;
+        bool ok;
+
         context.set_wait_for_ready(true);
         context.set_deadline(GetDeadline());
 
-        auto writer = stub_->WatFSWrite(&context, &write_ret);
+        async_calls.Begin();
+        PooledChannel *channel = channels.Acquire(BULK_LANE);
+
+        auto writer = channel->stub->PrepareAsyncWatFSWrite(
+            &context, &write_ret, async_calls.Queue());
+        writer->StartCall(&pending);
+        ok = async_calls.Wait(&pending);
 
         int bytes_sent = 0;
         int msg_sz; // the size of the message sent over the stream
-        while (bytes_sent < total_size) {
-            // we want to send at most MESSAGE_SZ bytes at a time
-            msg_sz = min(MESSAGE_SZ, (int)total_size - bytes_sent);
+        while (ok && bytes_sent < total_size) {
+            // we want to send at most chunk_size bytes at a time
+            msg_sz = min(chunk_size, (int)total_size - bytes_sent);
             // send this chunk over the stream
             
             marshalled_data.assign(buffer+bytes_sent, msg_sz);            
-            write_args.set_file_path(file_handle);
+            if (bytes_sent > 0) {
+                // the server only looks at the first message for the file
+                write_args.clear_fh();
+                write_args.clear_file_path();
+            } else if (fh != NULL && *fh != 0) {
+                write_args.set_fh(*fh);
+            } else {
+                write_args.set_file_path(file_handle);
+            }
             write_args.set_buffer(marshalled_data);
-            write_args.set_offset(offset);
+            write_args.set_offset(offset + bytes_sent);
             write_args.set_total_size(total_size);
             write_args.set_size(msg_sz);
-            if (!writer->Write(write_args)) {
-                break;
-            }
+            writer->Write(write_args, &pending);
+            ok = async_calls.Wait(&pending);
 
             bytes_sent += msg_sz;
         }
 
-        writer->WritesDone();
-        Status status = writer->Finish();
-    } while (!status.ok());
+        if (ok) {
+            writer->WritesDone(&pending);
+            async_calls.Wait(&pending);
+        }
+
+        writer->Finish(&status, &pending);
+        async_calls.Wait(&pending);
+
+        channels.Release(channel);
+        async_calls.End();
+    } while (retry.Again(status));
 
     if (!status.ok()) {
         errno = ETIMEDOUT;
         return -errno;
     }
 
+    if (write_ret.err() == ESTALE && RefreshHandle(file_handle, fh)) {
+        return StreamWrite(file_handle, buffer, total_size, offset, NULL);
+    }
+
+    block_cache.Invalidate(file_handle);
+    whole_files.Invalidate(file_handle);
+    disk_cache.Invalidate(file_handle);
+
     // on error we set errno and return -errno
     if (write_ret.err() != 0) {
         errno = write_ret.err();
+        attr_cache.Invalidate(file_handle);
         return -errno;
     } else {
+        dirty_index.RecordVerf(file_handle, write_ret.verf());
+        chunk_tuner.RecordTransfer(total_size, 
+                                   chrono::steady_clock::now() - start);
+        CacheAttr(file_handle, write_ret);
         return write_ret.size();
     }
 }
 
 
-int WatFSClient::WatFSCommit() {
+long WatFSClient::WatFSCommit(const vector<string> &paths) {
     
     WatFSCommitArgs commit_args;
     WatFSCommitRet commit_ret;
 
     commit_args.set_verf(verf);
+    for (auto &path : paths) {
+        commit_args.add_file_paths(path);
+    }
 
     Status status;
 
-    do {
-        ClientContext context;
-        context.set_wait_for_ready(true);
-        context.set_deadline(GetDeadline());
-        status = stub_->WatFSCommit(&context, commit_args, &commit_ret);
-    } while (!status.ok());
+    status = UnaryCall(&WatFS::Stub::PrepareAsyncWatFSCommit, commit_args, 
+                       &commit_ret, RETRY_IDEMPOTENT);
 
     if (!status.ok()) {
         errno = ETIMEDOUT;
@@ -263,25 +792,33 @@ int WatFSClient::WatFSCommit() {
         return -errno;
     }
 
+    if (commit_ret.err() != 0) {
+        cerr << "commit failed: " << strerror(commit_ret.err()) << endl;
+    }
+
     return commit_ret.verf();
 }
 
 
-int WatFSClient::WatFSTruncate(const string &file_path, int size) {
+int WatFSClient::WatFSTruncate(const string &file_path, int size, 
+                               uint64_t *fh) {
     WatFSTruncateArgs trunc_args;
     WatFSTruncateRet trunc_ret;
 
-    trunc_args.set_file_path(file_path);
+    if (fh != NULL && *fh != 0) {
+        trunc_args.set_fh(*fh);
+    } else {
+        trunc_args.set_file_path(file_path);
+    }
     trunc_args.set_size(size);
 
+    // writes queued before the truncate have to land before it
+    write_queue.Wait(file_path);
+
     Status status;
 
-    do {
-        ClientContext context;
-        context.set_wait_for_ready(true);
-        context.set_deadline(GetDeadline());
-        status = stub_->WatFSTruncate(&context, trunc_args, &trunc_ret);
-    } while (!status.ok());
+    status = UnaryCall(&WatFS::Stub::PrepareAsyncWatFSTruncate, trunc_args, 
+                       &trunc_ret, RETRY_IDEMPOTENT);
 
     if (!status.ok()) {
         errno = ETIMEDOUT;
@@ -289,60 +826,139 @@ int WatFSClient::WatFSTruncate(const string &file_path, int size) {
         return -errno;
     }
 
+    if (trunc_ret.err() == ESTALE && RefreshHandle(file_path, fh)) {
+        return WatFSTruncate(file_path, size);
+    }
+
+    block_cache.Invalidate(file_path);
+    whole_files.Invalidate(file_path);
+    disk_cache.Invalidate(file_path);
+
     // on error we set errno and return -errno
     if (trunc_ret.err() != 0) {
         errno = trunc_ret.err();
+        attr_cache.Invalidate(file_path);
         return -errno;
     } else {
+        // a resend after a crash mustn't grow the file again
+        dirty_index.Truncate(file_path, size);
+        CacheAttr(file_path, trunc_ret);
         return 0;
     }
 }
 
 
-int WatFSClient::WatFSReaddir(const string &file_handle, void *buffer, 
+void WatFSClient::ConfigureReaddir(int page_entries) {
+    readdir_page = max(page_entries, 0);
+}
+
+
+int WatFSClient::WatFSReaddir(OpenDir *dir, off_t offset, void *buffer, 
                               fuse_fill_dir_t filler) {
+    int res;
+
+    // anywhere but where we left off, e.g. after a rewinddir
+    if (offset != dir->position) {
+        dir->Seek(offset);
+    }
+
+    for (;;) {
+        if (dir->entries.empty()) {
+            if (dir->eof) {
+                return 0;
+            }
+
+            res = ReaddirPage(dir);
+            if (res < 0) {
+                return res;
+            }
+            continue;
+        }
+
+        DirListEntry &entry = dir->entries.front();
 
+        // the buffer is full, FUSE comes back for the rest at position
+        if (filler(buffer, entry.name.c_str(), &entry.attr, entry.cookie, 
+                   FUSE_FILL_DIR_PLUS)) {
+            return 0;
+        }
+
+        dir->position = entry.cookie;
+        dir->entries.pop_front();
+    }
+}
+
+
+int WatFSClient::ReaddirPage(OpenDir *dir) {
     WatFSReaddirArgs readdir_args;
     WatFSReaddirRet readdir_ret;
-    
-    string marshalled_attr;
-    string marshalled_dir_entry;
 
-    struct dirent dir_entry;
-    struct stat attr;
+    string dir_prefix;
+    deque<DirListEntry> page;
 
     Status status;
 
-    readdir_args.set_file_handle(file_handle);
+    readdir_args.set_file_handle(dir->path);
+    readdir_args.set_cookie(dir->next_cookie);
+    readdir_args.set_max_entries(readdir_page);
+
+    dir_prefix = dir->path;
+    if (dir_prefix.empty() || dir_prefix.back() != '/') {
+        dir_prefix += "/";
+    }
+
+    RetryLoop retry(&retry_policy, RETRY_IDEMPOTENT);
 
     do {
         ClientContext context;
+        PendingCall pending;
+        bool ok;
+
+        // a failed try is started over from the same cookie
+        page.clear();
+        readdir_ret.Clear();
+
         context.set_wait_for_ready(true);
         context.set_deadline(GetDeadline());
 
-        auto reader = stub_->WatFSReaddir(&context, readdir_args);
+        async_calls.Begin();
+        PooledChannel *channel = channels.Acquire(METADATA_LANE);
+
+        auto reader = channel->stub->PrepareAsyncWatFSReaddir(
+            &context, readdir_args, async_calls.Queue());
+        reader->StartCall(&pending);
+        ok = async_calls.Wait(&pending);
 
         // read requested directory data from stream
-        while (reader->Read(&readdir_ret)) {
+        while (ok) {
+            reader->Read(&readdir_ret, &pending);
+            if (!async_calls.Wait(&pending) || readdir_ret.err() != 0) {
+                break;
+            }
 
-            marshalled_attr = readdir_ret.attr();
-            marshalled_dir_entry = readdir_ret.dir_entry();
+            for (auto &wire_entry : readdir_ret.entries()) {
+                page.emplace_back();
+                DirListEntry &entry = page.back();
 
-            memset(&attr, 0, sizeof(struct stat));
-            memcpy(&attr, marshalled_attr.data(), sizeof(struct stat));
+                entry.name = wire_entry.name();
+                entry.cookie = wire_entry.cookie();
+                attr_from_wire(wire_entry.attr(), &entry.attr);
 
-            memset(&dir_entry, 0, sizeof(struct dirent));
-            memcpy(&dir_entry, marshalled_dir_entry.data(), 
-                   sizeof(struct stat));
-            
-            /* we add the entry from here so we don't have to deal with sending
-             * back a list
-             */
-            filler(buffer, dir_entry.d_name, &attr, 0, FUSE_FILL_DIR_PLUS);
+                if (!wire_entry.has_attr()) {
+                    // the server couldn't stat it, FUSE still wants the type
+                    entry.attr.st_mode = DTTOIF(wire_entry.type());
+                } else if (entry.name != "." && entry.name != "..") {
+                    attr_cache.Insert(dir_prefix + entry.name, &entry.attr);
+                }
+            }
         }
 
-        status = reader->Finish();
-    } while (!status.ok());
+        reader->Finish(&status, &pending);
+        async_calls.Wait(&pending);
+
+        channels.Release(channel);
+        async_calls.End();
+    } while (retry.Again(status));
 
     if (!status.ok()) {
         errno = ETIMEDOUT;
@@ -350,14 +966,21 @@ int WatFSClient::WatFSReaddir(const string &file_handle, void *buffer,
         return -errno;
     }
 
-
     // on error we set errno and return -errno
     if (readdir_ret.err() != 0) {
         errno = readdir_ret.err();
         return -errno;
-    } else {
-        return 0;
     }
+
+    dir->eof = readdir_page == 0 || (long)page.size() < readdir_page;
+    if (!page.empty()) {
+        dir->next_cookie = page.back().cookie;
+    }
+    for (auto &entry : page) {
+        dir->entries.push_back(move(entry));
+    }
+
+    return 0;
 }
 
 
@@ -371,12 +994,8 @@ int WatFSClient::WatFSMknod(const string &path, mode_t mode, dev_t rdev) {
 
     Status status;
 
-    do {
-        ClientContext context;
-        context.set_wait_for_ready(true);
-        context.set_deadline(GetDeadline());
-        status = stub_->WatFSMknod(&context, mknod_args, &mknod_ret);
-    } while (!status.ok());
+    status = UnaryCall(&WatFS::Stub::PrepareAsyncWatFSMknod, mknod_args, 
+                       &mknod_ret, RETRY_NON_IDEMPOTENT);
 
     if (!status.ok()) {
         errno = ETIMEDOUT;
@@ -384,11 +1003,15 @@ int WatFSClient::WatFSMknod(const string &path, mode_t mode, dev_t rdev) {
         return -errno;
     }
 
+    attr_cache.Invalidate(parent_path(path));
+
     // on error we set errno and return -errno
     if (mknod_ret.err() != 0) {
         errno = mknod_ret.err();
+        attr_cache.Invalidate(path);
         return -errno;
     } else {
+        CacheAttr(path, mknod_ret);
         return 0;
     }
 }
@@ -400,14 +1023,12 @@ int WatFSClient::WatFSUnlink(const string &path) {
 
     unlink_args.set_path(path);
 
+    write_queue.Wait(path);
+
     Status status;
 
-    do {
-        ClientContext context;
-        context.set_wait_for_ready(true);
-        context.set_deadline(GetDeadline());
-        status = stub_->WatFSUnlink(&context, unlink_args, &unlink_ret);
-    } while (!status.ok());
+    status = UnaryCall(&WatFS::Stub::PrepareAsyncWatFSUnlink, unlink_args, 
+                       &unlink_ret, RETRY_NON_IDEMPOTENT);
 
     if (!status.ok()) {
         errno = ETIMEDOUT;
@@ -415,11 +1036,16 @@ int WatFSClient::WatFSUnlink(const string &path) {
         return -errno;
     }
 
+    attr_cache.Invalidate(path);
+    attr_cache.Invalidate(parent_path(path));
+    block_cache.Invalidate(path);
+
     // on error we set errno and return -errno
     if (unlink_ret.err() != 0) {
         errno = unlink_ret.err();
         return -errno;
     } else {
+        dirty_index.Remove(path);
         return 0;
     }
 }
@@ -432,25 +1058,33 @@ int WatFSClient::WatFSRename(const string &from, const string &to) {
     rename_args.set_source(from);
     rename_args.set_dest(to);
 
+    // queued writes name files by path, send them before the paths change
+    write_queue.WaitAll();
+
     Status status;
 
-    do {
-        ClientContext context;
-        context.set_wait_for_ready(true);
-        context.set_deadline(GetDeadline());
-        status = stub_->WatFSRename(&context, rename_args, &rename_ret);
-    } while (!status.ok());
+    status = UnaryCall(&WatFS::Stub::PrepareAsyncWatFSRename, rename_args, 
+                       &rename_ret, RETRY_NON_IDEMPOTENT);
 
     if (!status.ok()) {
         errno = ETIMEDOUT;
         return -errno;
     }
 
+    // either name may have been a directory, so drop everything below both
+    attr_cache.InvalidateTree(from);
+    attr_cache.InvalidateTree(to);
+    attr_cache.Invalidate(parent_path(from));
+    attr_cache.Invalidate(parent_path(to));
+    block_cache.InvalidateTree(from);
+    block_cache.InvalidateTree(to);
+
     // on error we set errno and return -errno
     if (rename_ret.err() != 0) {
         errno = rename_ret.err();
         return -errno;
     } else {
+        dirty_index.Rename(from, to);
         return 0;
     }
 }
@@ -465,12 +1099,8 @@ int WatFSClient::WatFSMkdir(const string &path, mode_t mode) {
 
     Status status;
 
-    do {
-        ClientContext context;
-        context.set_wait_for_ready(true);
-        context.set_deadline(GetDeadline());
-        status = stub_->WatFSMkdir(&context, mkdir_args, &mkdir_ret);
-    } while (!status.ok());
+    status = UnaryCall(&WatFS::Stub::PrepareAsyncWatFSMkdir, mkdir_args, 
+                       &mkdir_ret, RETRY_NON_IDEMPOTENT);
 
     if (!status.ok()) {
         errno = ETIMEDOUT;
@@ -478,11 +1108,15 @@ int WatFSClient::WatFSMkdir(const string &path, mode_t mode) {
         return -errno;
     }
 
+    attr_cache.Invalidate(parent_path(path));
+
     // on error we set errno and return -errno
     if (mkdir_ret.err() != 0) {
         errno = mkdir_ret.err();
+        attr_cache.Invalidate(path);
         return -errno;
     } else {
+        CacheAttr(path, mkdir_ret);
         return 0;
     }
 }
@@ -496,12 +1130,8 @@ int WatFSClient::WatFSRmdir(const string &path) {
 
     Status status;
 
-    do {
-        ClientContext context;
-        context.set_wait_for_ready(true);
-        context.set_deadline(GetDeadline());
-        status = stub_->WatFSRmdir(&context, rmdir_args, &rmdir_ret);
-    } while (!status.ok());
+    status = UnaryCall(&WatFS::Stub::PrepareAsyncWatFSRmdir, rmdir_args, 
+                       &rmdir_ret, RETRY_NON_IDEMPOTENT);
 
     if (!status.ok()) {
         errno = ETIMEDOUT;
@@ -509,6 +1139,10 @@ int WatFSClient::WatFSRmdir(const string &path) {
         return -errno;
     }
 
+    attr_cache.InvalidateTree(path);
+    attr_cache.Invalidate(parent_path(path));
+    block_cache.InvalidateTree(path);
+
     // on error we set errno and return -errno
     if (rmdir_ret.err() != 0) {
         errno = rmdir_ret.err();
@@ -531,12 +1165,8 @@ int WatFSClient::WatFSUtimens(const string &path, struct timespec tv_access,
 
     Status status;
 
-    do {
-        ClientContext context;
-        context.set_wait_for_ready(true);
-        context.set_deadline(GetDeadline());
-        status = stub_->WatFSUtimens(&context, utimens_args, &utimens_ret);
-    } while (!status.ok());
+    status = UnaryCall(&WatFS::Stub::PrepareAsyncWatFSUtimens, utimens_args, 
+                       &utimens_ret, RETRY_IDEMPOTENT);
 
     if (!status.ok()) {
         errno = ETIMEDOUT;
@@ -547,8 +1177,405 @@ int WatFSClient::WatFSUtimens(const string &path, struct timespec tv_access,
     // on error we set errno and return -errno
     if (utimens_ret.err() != 0) {
         errno = utimens_ret.err();
+        attr_cache.Invalidate(path);
         return -errno;
     } else {
+        CacheAttr(path, utimens_ret);
+        return 0;
+    }
+}
+
+
+void WatFSClient::StartStriping(long size, int width) {
+    stripe_size = size;
+    stripe_width = width;
+
+    if (width > 1) {
+        stripe_pool.Start(width - 1);
+    }
+}
+
+
+void WatFSClient::RunStripes(const shared_ptr<StripedTransfer> &transfer) {
+    long helpers = min((long)stripe_width, transfer->Count()) - 1;
+
+    // a helper that starts late finds nothing left and returns, the
+    // transfer stays alive until it does
+    for (long i = 0; i < helpers; i++) {
+        shared_ptr<StripedTransfer> shared = transfer;
+        stripe_pool.Add([shared]() { shared->Work(); });
+    }
+
+    transfer->Work();
+    transfer->Wait();
+}
+
+
+void WatFSClient::StartWriteBehind(int depth) {
+    for (int i = 0; i < depth; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, WriteSender, this) != 0) {
+            cerr << "failed to start write thread: " << strerror(errno) 
+                 << endl;
+            break;
+        }
+        write_threads.push_back(thread);
+    }
+}
+
+
+void WatFSClient::QueueWrite(CommitData *write, uint64_t fh) {
+    // what we have cached is out of date until the write is done
+    attr_cache.Invalidate(write->path);
+    block_cache.Invalidate(write->path);
+    whole_files.Invalidate(write->path);
+    disk_cache.Invalidate(write->path);
+
+    write_queue.Add(write, fh);
+}
+
+
+int WatFSClient::FlushWrites(const string &path) {
+    return -write_queue.Flush(path);
+}
+
+
+int WatFSClient::CommitFile(const string &path) {
+    vector<WriteBatch> batches;
+
+    // small writes nobody has picked up yet go out with the commit, instead
+    // of costing a round trip of their own first
+    if (write_queue.Claim(path, COMPOUND_MAX_WRITE_SZ, WRITE_BEHIND_MAX_BATCH,
+                          &batches)) {
+        CommitWithWrites(path, batches);
+    }
+
+    int err = FlushWrites(path);
+    int res = CommitDirty(path);
+
+    return (err != 0) ? err : res;
+}
+
+
+int WatFSClient::ConfigureDirty(long max_bytes, const char *journal_path) {
+    dirty_max = max_bytes;
+
+    // writers are throttled by the cap before the queue fills up
+    if (max_bytes > 0) {
+        write_queue.SetLimit(min(max_bytes, (long)WRITE_BEHIND_MAX_QUEUED));
+    }
+
+    if (journal_path == NULL) {
+        return 0;
+    }
+
+    // the cap bounds the live data, leave room for overwritten data too
+    long journal_size = 2 * (max_bytes > 0 ? max_bytes : DIRTY_DEFAULT_MAX);
+
+    int res = journal.Open(journal_path, journal_size);
+    if (res < 0) {
+        return res;
+    }
+
+    dirty_index.SetJournal(&journal);
+
+    return 0;
+}
+
+
+void WatFSClient::ThrottleWrites(const string &path) {
+    if (dirty_max <= 0 || dirty_index.Bytes() <= dirty_max) {
+        return;
+    }
+
+    // our own file first, it is the one that is growing
+    CommitDirty(path);
+
+    for (auto &dirty_path : dirty_index.Paths()) {
+        if (dirty_index.Bytes() <= dirty_max) {
+            break;
+        }
+        CommitDirty(dirty_path);
+    }
+}
+
+
+void WatFSClient::CommitWithWrites(const string &path, 
+                                   vector<WriteBatch> &batches) {
+    CompoundCall compound;
+    unsigned long version;
+    Status status;
+
+    for (auto &batch : batches) {
+        WatFSWriteArgs *write_args = 
+            compound.Add(RETRY_IDEMPOTENT)->mutable_write();
+        write_args->set_file_path(path);
+        write_args->set_buffer(batch.data);
+        write_args->set_offset(batch.offset);
+        write_args->set_size(batch.data.size());
+        write_args->set_total_size(batch.data.size());
+    }
+
+    bool dirty = dirty_index.Dirty(path, &version);
+    if (dirty) {
+        WatFSCommitArgs *commit_args = 
+            compound.Add(RETRY_IDEMPOTENT)->mutable_commit();
+        commit_args->set_verf(verf);
+        commit_args->add_file_paths(path);
+    }
+
+    status = RunCompound(&compound);
+
+    block_cache.Invalidate(path);
+    whole_files.Invalidate(path);
+    disk_cache.Invalidate(path);
+    attr_cache.Invalidate(path);
+
+    for (size_t i = 0; i < batches.size(); i++) {
+        const WatFSCompoundResult *result = compound.Result(i);
+        int err;
+
+        if (!status.ok()) {
+            err = ETIMEDOUT;
+        } else if (result == NULL) {
+            // an earlier op failed, so this one never ran; a short reply
+            // without an error is malformed
+            err = compound.ret.err() ? compound.ret.err() : EIO;
+        } else {
+            err = result->write().err();
+        }
+
+        if (err == 0) {
+            dirty_index.RecordVerf(path, result->write().verf());
+            CacheAttr(path, result->write());
+        }
+
+        write_queue.Done(batches[i], err);
+    }
+
+    if (!status.ok() || !dirty) {
+        return;
+    }
+
+    // as in CommitDirty, the commit only covers writes the same server
+    // instance took; otherwise CommitDirty resends them
+    const WatFSCompoundResult *committed = compound.Result(batches.size());
+    if (committed != NULL && committed->commit().err() == 0 &&
+        dirty_index.SentTo(path, committed->commit().verf())) {
+        dirty_index.Clean(path, version);
+    }
+}
+
+
+int WatFSClient::CommitDirty(const string &path) {
+    unsigned long version;
+    vector<pair<long, string>> ranges;
+
+    write_queue.Wait(path);
+
+    // nothing to commit, don't bother the server
+    if (!dirty_index.Dirty(path, &version)) {
         return 0;
     }
+
+    vector<string> paths(1, path);
+
+    long commit_verf = WatFSCommit(paths);
+    int resends = 0;
+
+    // a commit only covers writes the same server instance took
+    while (commit_verf >= 0 && !dirty_index.SentTo(path, commit_verf)) {
+        // the server keeps restarting under us, keep the data for later
+        if (resends++ == DIRTY_MAX_RESENDS) {
+            return -EIO;
+        }
+
+        cerr << "Server crashed! Resend cached writes of " << path << endl;
+        cerr << "our verf: " << verf << endl;
+        cerr << "server verf: " << commit_verf << endl;
+        verf = commit_verf;
+
+        dirty_index.TakeForResend(path, &ranges);
+        for (auto &range : ranges) {
+            int res = WatFSWrite(path, range.second.data(), 
+                                 range.second.size(), range.first);
+            if (res < 0) {
+                return res;
+            }
+        }
+
+        commit_verf = WatFSCommit(paths);
+    }
+
+    // the server is out of reach, the data stays dirty for the next commit
+    if (commit_verf < 0) {
+        return commit_verf;
+    }
+
+    dirty_index.Clean(path, version);
+
+    return 0;
+}
+
+
+void *WatFSClient::WriteSender(void *arg) {
+    WatFSClient *client = (WatFSClient *)arg;
+    WriteBatch batch;
+
+    while (client->write_queue.Take(&batch, WRITE_BEHIND_MAX_BATCH)) {
+        int res = client->WatFSWrite(batch.path, batch.data.data(), 
+                                     batch.data.size(), batch.offset, 
+                                     &batch.fh);
+
+        // batches of a file finish in any order, so the attributes that
+        // came back with this one may already be out of date
+        client->attr_cache.Invalidate(batch.path);
+
+        client->write_queue.Done(batch, res < 0 ? -res : 0);
+    }
+
+    return NULL;
+}
+
+
+void *WatFSClient::ReadaheadWorker(void *arg) {
+    WatFSClient *client = (WatFSClient *)arg;
+    string data;
+
+    pthread_mutex_lock(&client->readahead_mutex);
+
+    while (!client->readahead_stopping) {
+        if (client->readahead_queue.empty()) {
+            pthread_cond_wait(&client->readahead_ready, 
+                              &client->readahead_mutex);
+            continue;
+        }
+
+        ReadaheadJob job = client->readahead_queue.front();
+        client->readahead_queue.pop_front();
+
+        pthread_mutex_unlock(&client->readahead_mutex);
+
+        unsigned long epoch;
+        // the stream may have been closed or have jumped elsewhere since
+        if (job.state->Current(job.generation) &&
+            client->block_cache.StartFetch(job.path, job.block, &epoch)) {
+
+            client->FetchBlock(job.path, &job.fh, job.block, epoch, &data);
+        }
+
+        pthread_mutex_lock(&client->readahead_mutex);
+    }
+
+    pthread_mutex_unlock(&client->readahead_mutex);
+
+    return NULL;
+}
+
+
+void WatFSClient::QueueReadahead(OpenFile *file, off_t start, off_t end, 
+                                 unsigned long generation) {
+    if (start >= end || readahead_threads.empty()) {
+        return;
+    }
+
+    pthread_mutex_lock(&readahead_mutex);
+
+    for (long block = start / BLOCK_SZ; block <= (end - 1) / BLOCK_SZ; 
+         block++) {
+
+        ReadaheadJob job;
+        job.path = file->path;
+        job.fh = file->fh;
+        job.block = block;
+        job.state = file->readahead;
+        job.generation = generation;
+        readahead_queue.push_back(job);
+    }
+
+    pthread_cond_broadcast(&readahead_ready);
+    pthread_mutex_unlock(&readahead_mutex);
+}
+
+
+int WatFSClient::ReadBlock(const string &path, uint64_t *fh, long block, 
+                           size_t offset, int count, char *data) {
+    unsigned long epoch;
+    string block_data;
+
+    int res = block_cache.Read(path, block, offset, count, data);
+    if (res >= 0) {
+        return res;
+    }
+
+    if (block_cache.StartFetch(path, block, &epoch)) {
+        res = FetchBlock(path, fh, block, epoch, &block_data);
+        if (res < 0) {
+            return res;
+        }
+
+        res = offset < block_data.size() ? 
+              min(count, (int)(block_data.size() - offset)) : 0;
+        memcpy(data, block_data.data() + offset, res);
+        return res;
+    }
+
+    // somebody may have fetched it just now
+    res = block_cache.Read(path, block, offset, count, data);
+    if (res >= 0) {
+        return res;
+    }
+
+    // the cache is disabled or the block was evicted right away
+    return WatFSRead(path, block * BLOCK_SZ + offset, count, data, fh);
+}
+
+
+int WatFSClient::FetchBlock(const string &path, uint64_t *fh, long block, 
+                            unsigned long epoch, string *data) {
+    struct stat attr;
+
+    // blocks on disk are only good while the file still has the attributes
+    // they were fetched under, which the attribute cache usually knows
+    bool on_disk = disk_cache.Enabled() && WatFSGetAttr(path, &attr) == 0 &&
+                   S_ISREG(attr.st_mode);
+
+    if (on_disk && disk_cache.Read(path, attr, block, data)) {
+        block_cache.FinishFetch(path, block, epoch, data->data(), 
+                                data->size());
+        return data->size();
+    }
+
+    data->resize(BLOCK_SZ);
+
+    int res = WatFSRead(path, block * BLOCK_SZ, BLOCK_SZ, &(*data)[0], fh);
+    if (res < 0) {
+        block_cache.FinishFetch(path, block, epoch, NULL, 0);
+        return res;
+    }
+
+    data->resize(res);
+    block_cache.FinishFetch(path, block, epoch, data->data(), res);
+
+    // the attributes are from before the read, so if the file changed in
+    // between the block just looks out of date next time
+    if (on_disk) {
+        disk_cache.Write(path, attr, block, *data);
+    }
+
+    return res;
+}
+
+
+bool WatFSClient::RefreshHandle(const string &path, uint64_t *fh) {
+    if (fh == NULL || *fh == 0) {
+        return false;
+    }
+
+    // if the lookup fails, fall back to the path until the next open
+    if (WatFSLookup(path, fh) < 0) {
+        *fh = 0;
+    }
+
+    return true;
 }
@@ -1,26 +1,40 @@
 #include <stdio.h>
 #include <ctype.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <dirent.h>
+#include <pthread.h>
 
-#include <fstream>
 #include <iostream>
 #include <memory>
 #include <string>
 #include <unordered_map>
+#include <vector>
 
 #include <grpc++/grpc++.h>
 #include <grpc++/server.h>
 #include <grpc++/server_builder.h>
 #include <grpc++/server_context.h>
 #include <grpc++/security/server_credentials.h>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/wire_format_lite.h>
 
 #include "commit_data.h"
+#include "buffer_pool.h"
+#include "dir_fd_cache.h"
+#include "fd_cache.h"
+#include "group_commit.h"
+#include "handle_table.h"
+#include "stat_cache.h"
+#include "storage_backend.h"
+#include "uring_backend.h"
+#include "wire_attr.h"
+#include "work_queue.h"
 #include "watfs.grpc.pb.h"
 
 using watfs::WatFS;
@@ -29,6 +43,8 @@ using watfs::WatFSGetAttrArgs;
 using watfs::WatFSGetAttrRet;
 using watfs::WatFSLookupArgs;
 using watfs::WatFSLookupRet;
+using watfs::WatFSOpenArgs;
+using watfs::WatFSOpenRet;
 using watfs::WatFSReadArgs;
 using watfs::WatFSReadRet;
 using watfs::WatFSWriteArgs;
@@ -39,6 +55,7 @@ using watfs::WatFSTruncateArgs;
 using watfs::WatFSTruncateRet;
 using watfs::WatFSReaddirArgs;
 using watfs::WatFSReaddirRet;
+using watfs::WatFSDirEntry;
 using watfs::WatFSMknodArgs;
 using watfs::WatFSMknodRet;
 using watfs::WatFSUnlinkArgs;
@@ -51,30 +68,123 @@ using watfs::WatFSRmdirArgs;
 using watfs::WatFSRmdirRet;
 using watfs::WatFSUtimensArgs;
 using watfs::WatFSUtimensRet;
-
+using watfs::WatFSCompoundOp;
+using watfs::WatFSCompoundResult;
+using watfs::WatFSCompoundArgs;
+using watfs::WatFSCompoundRet;
+
+using grpc::ByteBuffer;
+using grpc::CompletionQueue;
+using grpc::SerializationTraits;
 using grpc::Server;
+using grpc::ServerAsyncReader;
+using grpc::ServerAsyncResponseWriter;
+using grpc::ServerAsyncWriter;
 using grpc::ServerBuilder;
+using grpc::ServerCompletionQueue;
 using grpc::ServerContext;
-using grpc::ServerReader;
-using grpc::ServerWriter;
+using grpc::Slice;
 using grpc::Status;
 
+using google::protobuf::io::CodedOutputStream;
+using google::protobuf::internal::WireFormatLite;
+
 using namespace std;
 
+// default and smallest size of a read stream message
 #define MESSAGE_SZ          8192
+// largest stream message we accept unless told otherwise
+#define MAX_CHUNK_SZ        (1 << 20)
+// room for the other fields of a stream message around its data
+#define MESSAGE_OVERHEAD    4096
+
+// most data we buffer per write stream before writing it out
+#define WRITE_WINDOW_SZ     (1 << 20)
+
+// reads smaller than this are just copied into the reply messages
+#define ZERO_COPY_MIN_SZ    (64 << 10)
+
+// file I/O threads for each completion queue thread by default
+#define IO_THREADS_PER_CQ   4
+
+// directory entries listed at a time while streaming a readdir
+#define READDIR_BATCH       256
+
+
+// every method is served from our completion queues, the read replies are
+// put together by hand so that one is raw
+typedef WatFS::WithRawMethod_WatFSRead<WatFS::AsyncService> WatFSAsyncService;
 
 
-class WatFSServer final : public WatFS::Service {
+/*
+ * State of a write stream between messages: the file being written and the
+ * window of contiguous data that hasn't been written out yet.
+ */
+class WriteStream {
 public:
-    explicit WatFSServer(const char *root_dir) {
+    string path;
+    FdCacheEntry *file;
+    string window;
+    off_t window_offset;
+    long bytes_written;
+
+    WriteStream() : file(NULL), window_offset(0), bytes_written(0) {}
+};
+
+
+/*
+ * The unary handlers keep the signatures of the synchronous service. The
+ * call objects further down run them on the I/O thread pool and send the
+ * replies through the completion queues, and drive the streaming calls with
+ * the helpers in here.
+ */
+class WatFSServer final : public WatFSAsyncService {
+public:
+    WatFSServer(const char *root_dir, long max_chunk_size, 
+                StorageBackend *storage_backend) : 
+        verf(time(NULL)), max_chunk(max_chunk_size), handles(verf), 
+        storage(storage_backend), group_commit(&fd_cache, storage), 
+        write_window(WRITE_WINDOW_SZ) {
         // here we want to set up the server to use the specified root directory
         root_directory.assign(root_dir);
         if (root_directory.back() == '/') {
             root_directory.erase(root_directory.end()-1);  
         }
+
+        int err = dir_fds.Open(root_directory);
+        if (err != 0) {
+            cerr << "can't open root directory " << root_dir << ": " 
+                 << strerror(-err) << endl;
+            exit(1);
+        }
+        fd_cache.ResolveWith(&dir_fds);
+
         cout << "WatFS server root directory set to: " + root_directory << endl;
-    
-        verf = time(NULL);
+    }
+
+    /*
+     * start nthreads threads for the handlers to run on
+     */
+    void StartIOThreads(int nthreads) {
+        io_pool.Start(nthreads);
+    }
+
+    /*
+     * cache the attributes of up to max_entries paths, 0 to not cache them.
+     * The watches it sets up also tell the descriptor caches about names
+     * changed from outside WatFS.
+     *
+     * returns 0 on success or -errno
+     */
+    int StartStatCache(size_t max_entries) {
+        // descriptors opened by a name that changed outside WatFS would
+        // keep following what used to be there
+        stat_cache.OnNameChange([this](const string &path) {
+            fd_cache.InvalidateTree(path);
+            dir_fds.InvalidateTree(path);
+        });
+
+        return stat_cache.Start(root_directory, max_entries);
     }
 
     Status WatFSNull(ServerContext *context, const WatFSStatus *client_status,
@@ -83,6 +193,14 @@ public:
         // send our verf to the client
         server_status->set_verf(verf);
 
+        // agree on the largest stream message we'll use
+        if (client_status->max_chunk_size() > 0) {
+            server_status->set_max_chunk_size(
+                min(client_status->max_chunk_size(), max_chunk));
+        } else {
+            server_status->set_max_chunk_size(MESSAGE_SZ);
+        }
+
         cerr << "DEBUG: received ping from client" << endl;
 
         return Status::OK;
@@ -91,8 +209,8 @@ public:
 
     /*
      * The server fills in a struct stat buffer with information on whatever
-     * file is indicated by the provided file path, and this struct stat is sent
-     * back to the client. 
+     * file is indicated by the provided file path, and its attributes are
+     * sent back to the client. 
      *
      * In addition, we set an error code so the client can interpret errors
      */
@@ -101,23 +219,19 @@ public:
         
         string file_path;
         struct stat statbuf;
-        string marshalled_attr;
         
         int err;
 
         file_path = translate_pathname(args->file_path());
 
-        memset(&statbuf, 0, sizeof statbuf);
-        err = stat(file_path.c_str(), &statbuf);
-        marshalled_attr.assign((const char*)&statbuf, sizeof statbuf);
-
-        attr->set_attr(marshalled_attr);
+        err = cached_stat(file_path, &statbuf);
         if (err == -1) {
             // we want to set err so FUSE can throw informative errors
             attr->set_err(errno);
         } else {
             // no error, set err to 0
             attr->set_err(err);
+            attr_to_wire(&statbuf, attr->mutable_attr());
         }
 
         return Status::OK;
@@ -141,181 +255,87 @@ public:
 
         string file_path;
         struct stat statbuf;
-        fstream fh;
 
         int err;
 
         // concatenate the directory handle and file name to get a path
         file_path = translate_pathname(args->file_path());
 
-        err = stat(file_path.c_str(), &statbuf);
+        err = cached_stat(file_path, &statbuf);
+        if (err == -1) {
+            ret->set_err(errno);
+            return Status::OK;
+        }
         
         ret->set_err(0);
+        ret->set_file_handle(handles.Get(file_path));
 
         return Status::OK;
     }
 
 
     /*
-     * The server reads from the file given by the WatFS file handle and fills 
-     * in a struct stat buffer with information on whatever file is indicated by
-     * the provided file handle. In addition, a boolean indicating the end of 
-     * file, and the number of bytes read are sent back to the client.
-     *
-     * In addition, we set an error code so the client can interpret errors
+     * Check that the file can be opened with the access mode the client asked
+     * for, and hand back a file handle for it. The descriptors we open here
+     * stay in the fd cache, so the first read or write doesn't have to open
+     * the file again.
      */
-    Status WatFSRead(ServerContext *context, const WatFSReadArgs *args,
-                        ServerWriter<WatFSReadRet> *writer) override {
-        
-        struct stat attr;
-        int count;
-
-        string path;
-        string marshalled_data;
-
-        WatFSReadRet ret;
-
-        int bytes_sent = 0;
-        int err;
-
-        fstream fh;
-
-        path = translate_pathname(args->file_handle());
-
-        fh.open(path, ios::in | ios::binary);
-        if (fh.fail()) {
-            ret.set_err(errno);
-            writer->Write(ret);
-            perror("open");
-            fh.close();
-            return Status::OK;
-        }
-
-
-        // we want to read data as a big chunk on the server
-        char *data = new char[args->count()];
-
-        // read count bytes from file start at offset
-        fh.clear();
-        fh.seekg(args->offset(), fh.beg);
-
-        fh.read(data, args->count());
-        count = fh.gcount();
-        if (fh.bad()) {
-            // not open for reading
-            ret.set_err(errno);
-            perror("read");
-            writer->Write(ret);
-            return Status::OK;
-        }
+    Status WatFSOpen(ServerContext *context, const WatFSOpenArgs *args,
+                     WatFSOpenRet *ret) override {
 
-        // no errors reading the file
-        ret.set_err(0);
+        string file_path;
+        int access_mode;
 
-        int msg_sz; // the size of the message sent over the stream
-        while (bytes_sent < args->count()) {
-            // we want to send at most MESSAGE_SZ bytes at a time
-            msg_sz = min(MESSAGE_SZ, args->count() - bytes_sent);
-            // send this chunk over the stream
-            
-            marshalled_data.assign(data+bytes_sent, msg_sz);            
-            ret.set_data(marshalled_data);
-            ret.set_count(msg_sz);
-            writer->Write(ret);
+        file_path = translate_pathname(args->file_path());
+        access_mode = args->flags() & O_ACCMODE;
 
-            bytes_sent += msg_sz;
+        if (access_mode != O_WRONLY) {
+            if (!check_open(file_path, O_RDONLY, ret)) {
+                return Status::OK;
+            }
         }
 
-        delete data;
-        fh.close();
-
-
-        return Status::OK;
-    }
-
-
-    /*
-     * 
-     */
-    Status WatFSWrite(ServerContext *context, 
-                      ServerReader<WatFSWriteArgs> *reader, 
-                      WatFSWriteRet *ret) override {
-        
-        WatFSWriteArgs args;
-        string path;
-        string marshalled_data;
-        char *buffer;
-        int bytes_recv = 0;
-        int bytes_written = 0;
-
-        int fd;
-
-        reader->Read(&args);
-
-        buffer = (char *)malloc(args.total_size());
-
-        do {
-            memcpy(buffer+bytes_recv, args.buffer().data(), args.size());
-            bytes_recv += args.size();
-        } while (reader->Read(&args));
-
-        marshalled_data.assign(buffer);
-        path = translate_pathname(args.file_path());
-
-        // write to file right away, but don't call sync
-        fd = open(path.c_str(), O_WRONLY);
-
-        lseek(fd, args.offset(), SEEK_SET);
-        bytes_written = write(fd, buffer, bytes_recv);
-        if (bytes_written == -1) {
-            perror("write");
-            ret->set_err(errno);
-            ret->set_size(-1);
-            return Status::OK;
+        if (access_mode != O_RDONLY) {
+            if (!check_open(file_path, O_WRONLY, ret)) {
+                return Status::OK;
+            }
         }
 
-        close(fd);
-        free(buffer);
-
-        ret->set_size(bytes_written);
         ret->set_err(0);
+        ret->set_file_handle(handles.Get(file_path));
 
         return Status::OK;
     }
 
 
     /*
-     * 
+     * Flush the files named by the client to disk. Commits from concurrent
+     * clients are batched so each file is synced once per group commit.
      */
     Status WatFSCommit(ServerContext *context, const WatFSCommitArgs *args, 
                        WatFSCommitRet *ret) override {
         
-        sync();
+        vector<string> paths;
+        int err = 0;
 
-        ret->set_verf(verf);
-
-        return Status::OK;
-    }
-
-
-    /*
-     * 
-     */
-    Status WatFSTruncate(ServerContext *context, const WatFSTruncateArgs *args,
-                         WatFSTruncateRet *ret) override {
-
-        string file_path;
-
-        int err;
-
-        file_path = translate_pathname(args->file_path());
+        for (auto &path : args->file_paths()) {
+            paths.push_back(translate_pathname(path));
+        }
 
-        err = truncate(file_path.c_str(), args->size());
-        if (err == -1) {
-            perror("truncate");
+        // there is nothing to commit, and flushing the whole host instead
+        // would stall everyone else's I/O
+        if (paths.empty()) {
+            err = EINVAL;
+        } else {
+            err = group_commit.Commit(paths);
+            if (err != 0) {
+                errno = err;
+                perror("fdatasync");
+            }
         }
 
         ret->set_err(err);
+        ret->set_verf(verf);
 
         return Status::OK;
     }
@@ -324,45 +344,29 @@ public:
     /*
      * 
      */
-    Status WatFSReaddir(ServerContext *context, const WatFSReaddirArgs *args,
-                        ServerWriter<WatFSReaddirRet> *writer) override {
+    Status WatFSTruncate(ServerContext *context, const WatFSTruncateArgs *args,
+                         WatFSTruncateRet *ret) override {
 
-        DIR *dh;
-        struct stat attr;
-        struct dirent *dir_entry;
         string file_path;
-        
-        string marshalled_attr;
-        string marshalled_dir_entry;
-
-        WatFSReaddirRet ret;
 
-        file_path = translate_pathname(args->file_handle());
+        int err;
 
-        dh = opendir(file_path.c_str());
-        dir_entry = readdir(dh);
-        if (dir_entry == NULL) {
-            cerr << "DEBUG: readdir - null dir_entry!" << endl;
-            // should never happen!
-            ret.set_err(errno);
-            writer->Write(ret);
+        err = resolve_path(args->fh(), args->file_path(), &file_path);
+        if (err != 0) {
+            ret->set_err(err);
             return Status::OK;
         }
 
-        do {
-            marshalled_dir_entry.assign((const char *)dir_entry, 
-                                        sizeof(struct dirent));            
-            ret.set_dir_entry(marshalled_dir_entry);
-            
-            memset(&attr, 0, sizeof attr);
-            stat(dir_entry->d_name, &attr);
-            marshalled_attr.assign((const char *)&attr, sizeof attr);
-            ret.set_attr(marshalled_attr);
-
-            writer->Write(ret);
-        } while (dir_entry = readdir(dh));
+        fd_cache.Invalidate(file_path);
 
-        closedir(dh);
+        err = truncate_file(file_path, args->size());
+        if (err == -1) {
+            ret->set_err(errno);
+            perror("truncate");
+        } else {
+            ret->set_err(0);
+            post_op_attr(file_path, ret);
+        }
 
         return Status::OK;
     }
@@ -384,10 +388,13 @@ public:
         mode = args->mode();
         rdev = args->rdev();
 
-        if (S_ISFIFO(mode)) {
-            err = mkfifo(path.c_str(), mode);
+        ParentDir parent(&dir_fds, path);
+        if (parent.fd == -1) {
+            err = -1;
+        } else if (S_ISFIFO(mode)) {
+            err = mkfifoat(parent.fd, parent.name, mode);
         } else {
-            err = mknod(path.c_str(), mode, rdev);
+            err = mknodat(parent.fd, parent.name, mode, rdev);
         }
 
 
@@ -397,6 +404,9 @@ public:
             perror("mknod");
         } else {
             ret->set_err(0);
+            fd_cache.Invalidate(path);
+            stat_cache.InvalidateEntry(path);
+            post_op_attr(path, ret);
         }
 
         return Status::OK;
@@ -413,7 +423,17 @@ public:
 
         path = translate_pathname(args->path());
 
-        int err = unlink(path.c_str());
+        // close our descriptors first, and again after, in case a request
+        // opened the file in between
+        fd_cache.Invalidate(path);
+
+        ParentDir parent(&dir_fds, path);
+        int err = -1;
+        if (parent.fd != -1) {
+            err = unlinkat(parent.fd, parent.name, 0);
+        }
+
+        fd_cache.Invalidate(path);
 
         if (err == -1) {
             ret->set_err(errno);
@@ -421,6 +441,8 @@ public:
             cout << "DEBUG: unlink - " << path << endl;
         } else {
             ret->set_err(0);
+            stat_cache.InvalidateEntry(path);
+            handles.Remove(path);
         }
 
         return Status::OK;
@@ -439,13 +461,45 @@ public:
         source_path = translate_pathname(args->source());
         dest_path = translate_pathname(args->dest());
 
-        int err = rename(source_path.c_str(), dest_path.c_str());
+        // cached descriptors would keep following the old names
+        fd_cache.InvalidateTree(source_path);
+        fd_cache.InvalidateTree(dest_path);
+
+        ParentDir source(&dir_fds, source_path);
+        if (source.fd == -1) {
+            ret->set_err(errno);
+            return Status::OK;
+        }
+
+        ParentDir dest(&dir_fds, dest_path);
+        int err = -1;
+        if (dest.fd != -1) {
+            err = renameat(source.fd, source.name, dest.fd, dest.name);
+        }
+
+        // a request may have opened either path while we renamed
+        fd_cache.InvalidateTree(source_path);
+        fd_cache.InvalidateTree(dest_path);
 
         if (err == -1) {
             ret->set_err(errno);
             perror("rename");
             cout << "DEBUG: rename - " << source_path << endl;
         } else {
+            struct stat statbuf;
+            bool is_dir;
+
+            // and so would directory descriptors
+            dir_fds.InvalidateTree(source_path);
+            dir_fds.InvalidateTree(dest_path);
+
+            stat_cache.InvalidateEntry(source_path);
+            stat_cache.InvalidateEntry(dest_path);
+
+            is_dir = storage->StatAt(dest.fd, dest.name, &statbuf) == 0 && 
+                     S_ISDIR(statbuf.st_mode);
+            handles.Rename(source_path, dest_path, is_dir);
+
             ret->set_err(0);
         }
 
@@ -463,7 +517,11 @@ public:
 
         path = translate_pathname(args->path());
 
-        int err = mkdir(path.c_str(), args->mode());
+        ParentDir parent(&dir_fds, path);
+        int err = -1;
+        if (parent.fd != -1) {
+            err = mkdirat(parent.fd, parent.name, args->mode());
+        }
 
         if (err == -1) {
             ret->set_err(errno);
@@ -471,6 +529,8 @@ public:
             cout << "DEBUG: rmdir - " << path << endl;
         } else {
             ret->set_err(0);
+            stat_cache.InvalidateEntry(path);
+            post_op_attr(path, ret);
         }
 
         return Status::OK;
@@ -487,7 +547,15 @@ public:
 
         path = translate_pathname(args->path());
 
-        int err = rmdir(path.c_str());
+        fd_cache.InvalidateTree(path);
+
+        ParentDir parent(&dir_fds, path);
+        int err = -1;
+        if (parent.fd != -1) {
+            err = unlinkat(parent.fd, parent.name, AT_REMOVEDIR);
+        }
+
+        fd_cache.InvalidateTree(path);
 
         if (err == -1) {
             ret->set_err(errno);
@@ -496,6 +564,9 @@ public:
 
         } else {
             ret->set_err(0);
+            dir_fds.InvalidateTree(path);
+            stat_cache.InvalidateEntry(path);
+            handles.Remove(path);
         }
 
         return Status::OK;
@@ -518,8 +589,12 @@ public:
         ts[1].tv_sec = args->ts_modify_sec();
         ts[1].tv_nsec = args->ts_modify_nsec();
 
-        // update timestamp, path is relative to current working directory
-        int err = utimensat(AT_FDCWD, path.c_str(), ts, AT_SYMLINK_NOFOLLOW);
+        // update timestamp, relative to the directory holding the path
+        ParentDir parent(&dir_fds, path);
+        int err = -1;
+        if (parent.fd != -1) {
+            err = utimensat(parent.fd, parent.name, ts, AT_SYMLINK_NOFOLLOW);
+        }
 
         if (err == -1) {
             ret->set_err(errno);
@@ -527,6 +602,26 @@ public:
             cout << "DEBUG: path - " << path << endl;
         } else {
             ret->set_err(0);
+            post_op_attr(path, ret);
+        }
+
+        return Status::OK;
+    }
+
+
+    /*
+     * Run the client's ops in order on this thread, stopping at the first
+     * one that fails, and send all their results back in one reply.
+     */
+    Status WatFSCompound(ServerContext *context, const WatFSCompoundArgs *args,
+                         WatFSCompoundRet *ret) override {
+
+        for (auto &op : args->ops()) {
+            int err = run_op(context, op, ret->add_results());
+            if (err != 0) {
+                ret->set_err(err);
+                break;
+            }
         }
 
         return Status::OK;
@@ -534,38 +629,1083 @@ public:
 
 
 private:
+    friend class ReadCall;
+    friend class WriteCall;
+    friend class ReaddirCall;
+    template <class Args, class Ret> friend class UnaryCall;
+
     time_t verf;
     string root_directory;
 
+    // largest stream message we send or accept
+    long max_chunk;
+
+    // file handles we have given out, must be initialized after verf
+    HandleTable handles;
+
+    // descriptors of recently used directories, everything is resolved
+    // relative to them
+    DirFdCache dir_fds;
+
+    // open descriptors for the read and write data paths
+    FdCache fd_cache;
+
+    // does the file I/O of the data path
+    StorageBackend *storage;
+
+    // batches commits, must be initialized after fd_cache and storage
+    GroupCommit group_commit;
+
+    // per stream write buffer limit in bytes
+    size_t write_window;
+
+    // buffers for bulk reads, shared with gRPC until the data is sent
+    BufferPool read_buffers;
+
+    // runs the handlers, which block on file I/O
+    WorkQueue io_pool;
+
+    // attributes of recently stat'ed paths, saves the stat and its walk down
+    // from the root
+    StatCache stat_cache;
+
     /*
      * 
      */
     string translate_pathname(const string &pathname) {
         return root_directory + pathname;
     }
+
+    /*
+     * get the server path for a data path request, from the file handle fh if
+     * the client sent one, or from pathname otherwise.
+     *
+     * returns 0 on success or ESTALE if fh is no longer valid
+     */
+    int resolve_path(uint64_t fh, const string &pathname, string *path) {
+        if (fh == 0) {
+            path->assign(translate_pathname(pathname));
+            return 0;
+        }
+
+        return handles.Resolve(fh, path);
+    }
+
+    /*
+     * read the range requested by args into data, which must have room for
+     * args.count() bytes.
+     *
+     * returns the number of bytes read, which is short at end of file, or -1
+     * with errno set on error
+     */
+    ssize_t read_file(const WatFSReadArgs &args, char *data) {
+        string path;
+        FdCacheEntry *file;
+        ssize_t count;
+
+        errno = resolve_path(args.fh(), args.file_handle(), &path);
+        if (errno != 0) {
+            return -1;
+        }
+
+        file = fd_cache.Acquire(path, O_RDONLY);
+        if (file == NULL) {
+            perror("open");
+            return -1;
+        }
+
+        count = storage->Read(file->fd, data, args.count(), args.offset());
+        if (count == -1) {
+            perror("read");
+        }
+
+        fd_cache.Release(file);
+
+        return count;
+    }
+
+    /*
+     * write out a buffered window of a write stream at offset. Full windows
+     * are handed to the disk right away, so writeback overlaps with receiving
+     * the rest of the stream and the eventual commit has less left to do.
+     *
+     * returns 0 on success or errno on failure
+     */
+    int flush_window(int fd, const string &data, off_t offset) {
+        if (storage->Write(fd, data.data(), data.size(), offset) == -1) {
+            return errno;
+        }
+
+        if (data.size() >= write_window) {
+            sync_file_range(fd, offset, data.size(), SYNC_FILE_RANGE_WRITE);
+        }
+
+        return 0;
+    }
+
+    /*
+     * take the next message of a write stream. The first message names the
+     * file, which is opened then. Contiguous messages are coalesced in a 
+     * buffer of at most write_window bytes, which is written out whenever it
+     * fills up or the next message isn't contiguous.
+     *
+     * returns 0 on success or errno on failure, after which the stream
+     * should be finished
+     */
+    int write_message(WriteStream *stream, const WatFSWriteArgs &args) {
+        const string &data = args.buffer();
+        int err;
+
+        if (stream->file == NULL) {
+            err = resolve_path(args.fh(), args.file_path(), &stream->path);
+            if (err != 0) {
+                return err;
+            }
+
+            // write to file right away, but don't call sync
+            stream->file = fd_cache.Acquire(stream->path, O_WRONLY);
+            if (stream->file == NULL) {
+                perror("open");
+                return errno;
+            }
+
+            stream->window.reserve(min((long)write_window, 
+                                       (long)args.total_size()));
+        }
+
+        bool contiguous = (off_t)(stream->window_offset + 
+                                  stream->window.size()) == args.offset();
+
+        if (!stream->window.empty() && 
+            (!contiguous || 
+             stream->window.size() + data.size() > write_window)) {
+
+            err = flush_window(stream->file->fd, stream->window, 
+                               stream->window_offset);
+            if (err != 0) {
+                return err;
+            }
+            stream->bytes_written += stream->window.size();
+            stream->window.clear();
+        }
+
+        if (data.size() >= write_window) {
+            // big enough on its own, skip the copy into the window
+            err = flush_window(stream->file->fd, data, args.offset());
+            if (err != 0) {
+                return err;
+            }
+            stream->bytes_written += data.size();
+            return 0;
+        }
+
+        if (stream->window.empty()) {
+            stream->window_offset = args.offset();
+        }
+        stream->window.append(data);
+
+        return 0;
+    }
+
+    /*
+     * write out what is left of a write stream that ended with err (0 if it
+     * didn't fail), and fill in the reply
+     */
+    void finish_write(WriteStream *stream, int err, WatFSWriteRet *ret) {
+        ret->set_verf(verf);
+
+        if (err == 0 && !stream->window.empty()) {
+            err = flush_window(stream->file->fd, stream->window, 
+                               stream->window_offset);
+            stream->bytes_written += stream->window.size();
+        }
+
+        if (stream->file != NULL) {
+            fd_cache.Release(stream->file);
+            stream->file = NULL;
+        }
+
+        if (err != 0) {
+            errno = err;
+            perror("write");
+            ret->set_err(err);
+            ret->set_size(-1);
+            return;
+        }
+
+        ret->set_size(stream->bytes_written);
+        ret->set_err(0);
+
+        // an empty stream doesn't name a file
+        if (!stream->path.empty()) {
+            post_op_attr(stream->path, ret);
+        }
+    }
+
+    /*
+     * run one op of a compound with the handler of the matching call.
+     *
+     * returns the op's errno, or 0 if it succeeded
+     */
+    int run_op(ServerContext *context, const WatFSCompoundOp &op,
+               WatFSCompoundResult *result) {
+
+        switch (op.op_case()) {
+        case WatFSCompoundOp::kGetattr:
+            return run_op(&WatFSServer::WatFSGetAttr, context, op.getattr(),
+                          result->mutable_getattr());
+        case WatFSCompoundOp::kLookup:
+            return run_op(&WatFSServer::WatFSLookup, context, op.lookup(),
+                          result->mutable_lookup());
+        case WatFSCompoundOp::kOpen:
+            return run_op(&WatFSServer::WatFSOpen, context, op.open(),
+                          result->mutable_open());
+        case WatFSCompoundOp::kCommit:
+            return run_op(&WatFSServer::WatFSCommit, context, op.commit(),
+                          result->mutable_commit());
+        case WatFSCompoundOp::kTruncate:
+            return run_op(&WatFSServer::WatFSTruncate, context, op.truncate(),
+                          result->mutable_truncate());
+        case WatFSCompoundOp::kMknod:
+            return run_op(&WatFSServer::WatFSMknod, context, op.mknod(),
+                          result->mutable_mknod());
+        case WatFSCompoundOp::kUnlink:
+            return run_op(&WatFSServer::WatFSUnlink, context, op.unlink(),
+                          result->mutable_unlink());
+        case WatFSCompoundOp::kRename:
+            return run_op(&WatFSServer::WatFSRename, context, op.rename(),
+                          result->mutable_rename());
+        case WatFSCompoundOp::kMkdir:
+            return run_op(&WatFSServer::WatFSMkdir, context, op.mkdir(),
+                          result->mutable_mkdir());
+        case WatFSCompoundOp::kRmdir:
+            return run_op(&WatFSServer::WatFSRmdir, context, op.rmdir(),
+                          result->mutable_rmdir());
+        case WatFSCompoundOp::kUtimens:
+            return run_op(&WatFSServer::WatFSUtimens, context, op.utimens(),
+                          result->mutable_utimens());
+
+        case WatFSCompoundOp::kWrite: {
+            // a write stream that is over after its first message
+            WriteStream stream;
+            int err = write_message(&stream, op.write());
+            finish_write(&stream, err, result->mutable_write());
+            return result->write().err();
+        }
+
+        case WatFSCompoundOp::kRead: {
+            // the whole reply has to fit in one message
+            WatFSReadArgs args = op.read();
+            args.set_count(max(min((long)args.count(), max_chunk), 0L));
+
+            WatFSReadRet *read = result->mutable_read();
+            string *data = read->mutable_data();
+            data->resize(args.count());
+
+            ssize_t count = read_file(args, &(*data)[0]);
+            if (count == -1) {
+                data->clear();
+                read->set_err(errno);
+            } else {
+                data->resize(count);
+                read->set_count(count);
+                read->set_err(0);
+            }
+            return read->err();
+        }
+
+        default:
+            // an op this server doesn't know about
+            return EINVAL;
+        }
+    }
+
+    template <class Args, class Ret>
+    int run_op(Status (WatFSServer::*handler)(ServerContext *, const Args *,
+                                              Ret *),
+               ServerContext *context, const Args &args, Ret *ret) {
+        (this->*handler)(context, &args, ret);
+        return ret->err();
+    }
+
+    /*
+     * truncate the file at path to size.
+     *
+     * returns 0 on success, or -1 with errno set
+     */
+    int truncate_file(const string &path, off_t size) {
+        ParentDir parent(&dir_fds, path);
+        if (parent.fd == -1) {
+            return -1;
+        }
+
+        int fd = openat(parent.fd, parent.name, O_WRONLY | O_CLOEXEC);
+        if (fd == -1) {
+            return -1;
+        }
+
+        int err = ftruncate(fd, size);
+        if (err == -1) {
+            int saved = errno;
+            close(fd);
+            errno = saved;
+            return -1;
+        }
+
+        close(fd);
+        return 0;
+    }
+
+    /*
+     * open the directory at path, positioned at cookie.
+     *
+     * returns the directory stream, or NULL with errno set
+     */
+    DIR *open_directory(const string &path, long cookie) {
+        ParentDir parent(&dir_fds, path);
+        if (parent.fd == -1) {
+            return NULL;
+        }
+
+        int fd = openat(parent.fd, parent.name, 
+                        O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd == -1) {
+            return NULL;
+        }
+
+        DIR *dh = fdopendir(fd);
+        if (dh == NULL) {
+            int err = errno;
+            close(fd);
+            errno = err;
+            return NULL;
+        }
+
+        if (cookie != 0) {
+            seekdir(dh, cookie);
+        }
+
+        return dh;
+    }
+
+    /*
+     * list up to max more entries of dh, the directory at path, into batch,
+     * with the attributes and cookie of each. A failed readdir sets err in
+     * the batch and ends the listing.
+     *
+     * returns true if the end of the directory was reached
+     */
+    bool list_directory(const string &path, DIR *dh, long max, 
+                        WatFSReaddirRet *batch) {
+        struct stat attr;
+        struct dirent *dir_entry;
+        string prefix = path.back() == '/' ? path : path + "/";
+
+        for (long listed = 0; listed < max; listed++) {
+            errno = 0;
+            dir_entry = readdir(dh);
+            if (dir_entry == NULL) {
+                batch->set_err(errno);
+                return true;
+            }
+
+            WatFSDirEntry *entry = batch->add_entries();
+            entry->set_name(dir_entry->d_name);
+            entry->set_type(dir_entry->d_type);
+
+            // relative to the open directory, so the path isn't walked again
+            // for every entry. . and .. would only confuse the stat cache.
+            int err;
+            if (strcmp(dir_entry->d_name, ".") == 0 || 
+                strcmp(dir_entry->d_name, "..") == 0) {
+                err = storage->StatAt(dirfd(dh), dir_entry->d_name, &attr);
+            } else {
+                err = cached_stat(prefix + dir_entry->d_name, &attr, 
+                                  dirfd(dh), dir_entry->d_name);
+            }
+            if (err == 0) {
+                attr_to_wire(&attr, entry->mutable_attr());
+            }
+
+            entry->set_cookie(telldir(dh));
+        }
+
+        return false;
+    }
+
+    /*
+     * make sure path can be opened with the given access mode, leaving the
+     * descriptor in the fd cache. On failure, errno is stored in ret.
+     */
+    bool check_open(const string &path, int access_mode, WatFSOpenRet *ret) {
+        FdCacheEntry *file = fd_cache.Acquire(path, access_mode);
+        if (file == NULL) {
+            ret->set_err(errno);
+            return false;
+        }
+
+        fd_cache.Release(file);
+        return true;
+    }
+
+    /*
+     * stat path, answering from the stat cache if we can. On a miss, the
+     * stat is done relative to dirfd with name if given, or to the directory
+     * holding path otherwise, and its result cached.
+     *
+     * returns 0 on success, or -1 with errno set
+     */
+    int cached_stat(const string &path, struct stat *statbuf, 
+                    int dirfd = -1, const char *name = NULL) {
+        StatCacheToken token;
+        int err;
+
+        if (stat_cache.Lookup(path, statbuf, &err)) {
+            errno = err;
+            return err == 0 ? 0 : -1;
+        }
+
+        if (name == NULL) {
+            ParentDir parent(&dir_fds, path);
+            if (parent.fd == -1) {
+                return -1;
+            }
+            return cached_stat(path, statbuf, parent.fd, parent.name);
+        }
+
+        bool cacheable = stat_cache.Prepare(path, &token);
+
+        err = 0;
+        if (storage->StatAt(dirfd, name, statbuf) == -1) {
+            err = errno;
+        }
+
+        if (cacheable) {
+            stat_cache.Insert(path, statbuf, err, token);
+        }
+
+        if (err != 0) {
+            errno = err;
+            return -1;
+        }
+        return 0;
+    }
+
+    /*
+     * stat the object at path after a successful mutation and put the result
+     * in the attr field of ret, so the client can refresh its attribute cache
+     * from the reply. attr is left unset if the stat fails.
+     */
+    template <class Ret>
+    void post_op_attr(const string &path, Ret *ret) {
+        struct stat statbuf;
+
+        // whatever was cached is out of date now
+        stat_cache.Invalidate(path);
+
+        if (cached_stat(path, &statbuf) == -1) {
+            ret->clear_attr();
+            return;
+        }
+
+        attr_to_wire(&statbuf, ret->mutable_attr());
+    }
+};
+
+
+
+/*
+ * An RPC being served from a completion queue. Each call has at most one
+ * operation outstanding at a time, tagged with the call itself, and Proceed
+ * is called with the result once it completes.
+ */
+class CallData {
+public:
+    virtual ~CallData() {}
+
+    virtual void Proceed(bool ok) = 0;
+};
+
+
+/*
+ * A unary call. When a request arrives we ask for the next one on the same
+ * queue, run the handler on the I/O pool, and send its reply from there.
+ */
+template <class Args, class Ret>
+class UnaryCall : public CallData {
+public:
+    typedef void (WatFSServer::*RequestMethod)(
+        ServerContext *, Args *, ServerAsyncResponseWriter<Ret> *, 
+        CompletionQueue *, ServerCompletionQueue *, void *);
+    typedef Status (WatFSServer::*HandlerMethod)(ServerContext *, 
+                                                 const Args *, Ret *);
+
+    UnaryCall(WatFSServer *watfs_server, ServerCompletionQueue *call_cq,
+              RequestMethod request_method, HandlerMethod handler_method) :
+        server(watfs_server), cq(call_cq), request(request_method), 
+        handler(handler_method), responder(&context), finishing(false) {
+
+        (server->*request)(&context, &args, &responder, cq, cq, this);
+    }
+
+    void Proceed(bool ok) override {
+        // done, or the server is shutting down
+        if (finishing || !ok) {
+            delete this;
+            return;
+        }
+
+        new UnaryCall(server, cq, request, handler);
+
+        finishing = true;
+        server->io_pool.Add([this]() {
+            Status status = (server->*handler)(&context, &args, &ret);
+            responder.Finish(ret, status, this);
+        });
+    }
+
+private:
+    WatFSServer *server;
+    ServerCompletionQueue *cq;
+    RequestMethod request;
+    HandlerMethod handler;
+
+    ServerContext context;
+    Args args;
+    Ret ret;
+    ServerAsyncResponseWriter<Ret> responder;
+    bool finishing;
+};
+
+
+/*
+ * Serves WatFSRead. The server reads from the file given by the WatFS file
+ * handle and streams the data back to the client in chunks of the size the
+ * client asked for (up to max_chunk), along with the number of bytes in each
+ * chunk. In addition, we set an error code so the client can interpret 
+ * errors.
+ *
+ * This is a raw method: the requested range is read once on the I/O pool,
+ * into a pooled buffer for large reads, and each reply message is built from
+ * a small serialized header plus a slice that refers to the data in place.
+ * The buffer goes back to the pool when gRPC is done with the last slice.
+ * Small reads are read into a local string and copied into the messages.
+ */
+class ReadCall : public CallData {
+public:
+    ReadCall(WatFSServer *watfs_server, ServerCompletionQueue *call_cq) :
+        server(watfs_server), cq(call_cq), writer(&context), 
+        state(REQUESTED), buffer(NULL), data(NULL), count(0), bytes_sent(0),
+        chunk_size(MESSAGE_SZ) {
+
+        server->RequestWatFSRead(&context, &request, &writer, cq, cq, this);
+    }
+
+    ~ReadCall() {
+        if (buffer != NULL) {
+            BufferPool::Unref(buffer);
+        }
+    }
+
+    void Proceed(bool ok) override {
+        switch (state) {
+        case REQUESTED:
+            if (!ok) {
+                delete this;
+                return;
+            }
+            new ReadCall(server, cq);
+            server->io_pool.Add([this]() { Start(); });
+            break;
+
+        case WRITING:
+            if (!ok) {
+                // the client went away
+                state = FINISHING;
+                writer.Finish(Status::CANCELLED, this);
+                return;
+            }
+            WriteNext();
+            break;
+
+        case FINISHING:
+            delete this;
+            break;
+        }
+    }
+
+private:
+    enum CallState { REQUESTED, WRITING, FINISHING };
+
+    WatFSServer *server;
+    ServerCompletionQueue *cq;
+
+    ServerContext context;
+    ByteBuffer request;
+    ServerAsyncWriter<ByteBuffer> writer;
+    CallState state;
+
+    PooledBuffer *buffer;
+    string small_data;
+    char *data;
+    ssize_t count;
+    ssize_t bytes_sent;
+    long chunk_size;
+
+    // must stay alive until the write completes
+    ByteBuffer message;
+
+
+    /*
+     * read the requested range and send the first message, on the I/O pool
+     */
+    void Start() {
+        WatFSReadArgs args;
+
+        if (!SerializationTraits<WatFSReadArgs>::Deserialize(&request, 
+                                                            &args).ok()) {
+            state = FINISHING;
+            writer.Finish(Status(grpc::StatusCode::INTERNAL, 
+                                 "bad read request"), this);
+            return;
+        }
+
+        // nothing to send for empty reads
+        if (args.count() <= 0) {
+            state = FINISHING;
+            writer.Finish(Status::OK, this);
+            return;
+        }
+
+        if (args.chunk_size() > 0) {
+            chunk_size = max(min((long)args.chunk_size(), server->max_chunk), 
+                             (long)MESSAGE_SZ);
+        }
+
+        if (args.count() >= ZERO_COPY_MIN_SZ) {
+            buffer = server->read_buffers.Get(args.count());
+            data = buffer->data;
+        } else {
+            small_data.resize(args.count());
+            data = &small_data[0];
+        }
+
+        count = server->read_file(args, data);
+        if (count == -1) {
+            WatFSReadRet ret;
+            ret.set_err(errno);
+            SendMessage(ret.SerializeAsString(), NULL, 0, true);
+            return;
+        }
+
+        // nothing to send at end of file
+        if (count == 0) {
+            state = FINISHING;
+            writer.Finish(Status::OK, this);
+            return;
+        }
+
+        state = WRITING;
+        WriteNext();
+    }
+
+    void WriteNext() {
+        WatFSReadRet header;
+        int msg_sz; // the size of the message sent over the stream
+
+        // we want to send at most chunk_size bytes at a time
+        msg_sz = min((ssize_t)chunk_size, count - bytes_sent);
+
+        header.set_count(msg_sz);
+        header.set_err(0);
+
+        SendMessage(header.SerializeAsString(), data + bytes_sent, msg_sz,
+                    bytes_sent + msg_sz >= count);
+
+        bytes_sent += msg_sz;
+    }
+
+    /*
+     * send a WatFSReadRet made up of the serialized fields in header and
+     * size bytes of data as the data field, finishing the call if last is set
+     */
+    void SendMessage(string header, char *chunk, int size, bool last) {
+        Slice slices[2];
+        uint8_t prefix[16];
+        uint8_t *end;
+        size_t nslices = 1;
+
+        if (chunk != NULL) {
+            end = CodedOutputStream::WriteTagToArray(
+                WireFormatLite::MakeTag(WatFSReadRet::kDataFieldNumber, 
+                    WireFormatLite::WIRETYPE_LENGTH_DELIMITED), prefix);
+            end = CodedOutputStream::WriteVarint32ToArray(size, end);
+            header.append((const char *)prefix, end - prefix);
+
+            if (buffer != NULL) {
+                buffer->refs++;
+                slices[1] = Slice(chunk, size, BufferPool::Unref, buffer);
+            } else {
+                slices[1] = Slice(chunk, size);
+            }
+            nslices = 2;
+        }
+
+        slices[0] = Slice(header.data(), header.size());
+        message = ByteBuffer(slices, nslices);
+
+        if (last) {
+            state = FINISHING;
+            writer.WriteAndFinish(message, grpc::WriteOptions(), Status::OK,
+                                  this);
+        } else {
+            writer.Write(message, this);
+        }
+    }
 };
 
 
+/*
+ * Serves WatFSWrite, writing the client's stream to the file as it arrives
+ * (see write_message). Each message is written on the I/O pool, and we don't
+ * ask for the next one until it is, so a slow disk pushes back on the client
+ * through gRPC flow control instead of growing our memory.
+ */
+class WriteCall : public CallData {
+public:
+    WriteCall(WatFSServer *watfs_server, ServerCompletionQueue *call_cq) :
+        server(watfs_server), cq(call_cq), reader(&context), 
+        state(REQUESTED) {
+
+        server->RequestWatFSWrite(&context, &reader, cq, cq, this);
+    }
+
+    void Proceed(bool ok) override {
+        switch (state) {
+        case REQUESTED:
+            if (!ok) {
+                delete this;
+                return;
+            }
+            new WriteCall(server, cq);
+            state = READING;
+            reader.Read(&args, this);
+            break;
+
+        case READING:
+            if (!ok) {
+                // the client is done sending
+                server->io_pool.Add([this]() { Finish(0); });
+                return;
+            }
+            server->io_pool.Add([this]() {
+                int err = server->write_message(&stream, args);
+                if (err != 0) {
+                    Finish(err);
+                    return;
+                }
+                reader.Read(&args, this);
+            });
+            break;
+
+        case FINISHING:
+            delete this;
+            break;
+        }
+    }
+
+private:
+    enum CallState { REQUESTED, READING, FINISHING };
+
+    WatFSServer *server;
+    ServerCompletionQueue *cq;
+
+    ServerContext context;
+    ServerAsyncReader<WatFSWriteRet, WatFSWriteArgs> reader;
+    CallState state;
+
+    WatFSWriteArgs args;
+    WriteStream stream;
+    WatFSWriteRet ret;
+
+
+    void Finish(int err) {
+        server->finish_write(&stream, err, &ret);
+        state = FINISHING;
+        reader.Finish(ret, Status::OK, this);
+    }
+};
+
+
+/*
+ * Serves WatFSReaddir. The directory is listed on the I/O pool a batch at a
+ * time, and each batch is streamed to the client as one message from the
+ * completion queue before the next one is listed, so a huge directory never
+ * has to be held in memory at once.
+ */
+class ReaddirCall : public CallData {
+public:
+    ReaddirCall(WatFSServer *watfs_server, ServerCompletionQueue *call_cq) :
+        server(watfs_server), cq(call_cq), writer(&context), 
+        state(REQUESTED), dh(NULL), remaining(-1), listed_all(false) {
+
+        server->RequestWatFSReaddir(&context, &args, &writer, cq, cq, this);
+    }
+
+    ~ReaddirCall() {
+        if (dh != NULL) {
+            closedir(dh);
+        }
+    }
+
+    void Proceed(bool ok) override {
+        switch (state) {
+        case REQUESTED:
+            if (!ok) {
+                delete this;
+                return;
+            }
+            new ReaddirCall(server, cq);
+            state = WRITING;
+            server->io_pool.Add([this]() {
+                Open();
+                WriteBatch();
+            });
+            break;
+
+        case WRITING:
+            if (!ok) {
+                // the client went away
+                state = FINISHING;
+                writer.Finish(Status::CANCELLED, this);
+                return;
+            }
+            // readdir and stat block, keep them off the queue thread
+            server->io_pool.Add([this]() {
+                ListBatch();
+                WriteBatch();
+            });
+            break;
+
+        case FINISHING:
+            delete this;
+            break;
+        }
+    }
+
+private:
+    enum CallState { REQUESTED, WRITING, FINISHING };
+
+    WatFSServer *server;
+    ServerCompletionQueue *cq;
+
+    ServerContext context;
+    WatFSReaddirArgs args;
+    ServerAsyncWriter<WatFSReaddirRet> writer;
+    CallState state;
+
+    // server path of the directory
+    string path;
+    DIR *dh;
+    // entries the client still wants, -1 for the whole directory
+    long remaining;
+    bool listed_all;
+
+    WatFSReaddirRet batch;
+
+
+    void Open() {
+        path = server->translate_pathname(args.file_handle());
+        dh = server->open_directory(path, args.cookie());
+        if (dh == NULL) {
+            batch.set_err(errno);
+            listed_all = true;
+            return;
+        }
+
+        if (args.max_entries() > 0) {
+            remaining = args.max_entries();
+        }
+        ListBatch();
+    }
+
+    void ListBatch() {
+        long max = READDIR_BATCH;
+        if (remaining >= 0) {
+            max = min(max, remaining);
+        }
+
+        batch.Clear();
+        listed_all = server->list_directory(path, dh, max, &batch);
+
+        if (remaining >= 0) {
+            remaining -= batch.entries_size();
+            if (remaining == 0) {
+                listed_all = true;
+            }
+        }
+    }
+
+    void WriteBatch() {
+        if (listed_all) {
+            state = FINISHING;
+            writer.WriteAndFinish(batch, grpc::WriteOptions(), Status::OK, 
+                                  this);
+            return;
+        }
+
+        writer.Write(batch, this);
+    }
+};
+
+
+/*
+ * start one call of each kind on cq, so it can take new requests
+ */
+static void request_calls(WatFSServer *server, ServerCompletionQueue *cq)
+{
+    new UnaryCall<WatFSStatus, WatFSStatus>(server, cq, 
+        &WatFSServer::RequestWatFSNull, &WatFSServer::WatFSNull);
+    new UnaryCall<WatFSGetAttrArgs, WatFSGetAttrRet>(server, cq, 
+        &WatFSServer::RequestWatFSGetAttr, &WatFSServer::WatFSGetAttr);
+    new UnaryCall<WatFSLookupArgs, WatFSLookupRet>(server, cq, 
+        &WatFSServer::RequestWatFSLookup, &WatFSServer::WatFSLookup);
+    new UnaryCall<WatFSOpenArgs, WatFSOpenRet>(server, cq, 
+        &WatFSServer::RequestWatFSOpen, &WatFSServer::WatFSOpen);
+    new UnaryCall<WatFSCommitArgs, WatFSCommitRet>(server, cq, 
+        &WatFSServer::RequestWatFSCommit, &WatFSServer::WatFSCommit);
+    new UnaryCall<WatFSTruncateArgs, WatFSTruncateRet>(server, cq, 
+        &WatFSServer::RequestWatFSTruncate, &WatFSServer::WatFSTruncate);
+    new UnaryCall<WatFSMknodArgs, WatFSMknodRet>(server, cq, 
+        &WatFSServer::RequestWatFSMknod, &WatFSServer::WatFSMknod);
+    new UnaryCall<WatFSUnlinkArgs, WatFSUnlinkRet>(server, cq, 
+        &WatFSServer::RequestWatFSUnlink, &WatFSServer::WatFSUnlink);
+    new UnaryCall<WatFSRenameArgs, WatFSRenameRet>(server, cq, 
+        &WatFSServer::RequestWatFSRename, &WatFSServer::WatFSRename);
+    new UnaryCall<WatFSMkdirArgs, WatFSMkdirRet>(server, cq, 
+        &WatFSServer::RequestWatFSMkdir, &WatFSServer::WatFSMkdir);
+    new UnaryCall<WatFSRmdirArgs, WatFSRmdirRet>(server, cq, 
+        &WatFSServer::RequestWatFSRmdir, &WatFSServer::WatFSRmdir);
+    new UnaryCall<WatFSUtimensArgs, WatFSUtimensRet>(server, cq, 
+        &WatFSServer::RequestWatFSUtimens, &WatFSServer::WatFSUtimens);
+    new UnaryCall<WatFSCompoundArgs, WatFSCompoundRet>(server, cq, 
+        &WatFSServer::RequestWatFSCompound, &WatFSServer::WatFSCompound);
+
+    new ReadCall(server, cq);
+    new WriteCall(server, cq);
+    new ReaddirCall(server, cq);
+}
+
+
+/*
+ * body of the completion queue threads
+ */
+static void *poll_queue(void *arg)
+{
+    ServerCompletionQueue *cq = (ServerCompletionQueue *)arg;
+    void *tag;
+    bool ok;
+
+    while (cq->Next(&tag, &ok)) {
+        ((CallData *)tag)->Proceed(ok);
+    }
+
+    return NULL;
+}
+
+
+static struct server_options {
+    // largest stream message we negotiate with clients
+    long max_chunk_size;
+    // completion queues, each with its own thread
+    int cq_threads;
+    // threads for blocking file I/O
+    int io_threads;
+    // "uring" or "posix"
+    const char *backend;
+    // paths whose attributes are cached, 0 to not cache them
+    long stat_cache_size;
+} options;
+
 
 static void print_usage()
 {
     cout << "usage: ./watfs_grpc_server [options] <rootdir> <address:port>"
-         << endl;
+         << endl << endl
+         << "options:" << endl
+         << "    -m <bytes>    max read/write stream message size "
+         << "(default: " << MAX_CHUNK_SZ << ")" << endl
+         << "    -t <n>        completion queue threads "
+         << "(default: one per core)" << endl
+         << "    -w <n>        file I/O threads "
+         << "(default: " << IO_THREADS_PER_CQ << " per completion queue)"
+         << endl
+         << "    -b <backend>  file I/O backend, uring or posix "
+         << "(default: uring, posix if io_uring is unavailable)" << endl
+         << "    -s <n>        paths whose attributes are cached, 0 to not "
+         << "cache them (default: " << STAT_CACHE_DEFAULT_SIZE << ")" << endl;
 }
 
 
 void StartWatFSServer(const char *root_dir, const char *server_address)
 {
-    WatFSServer service(root_dir);
+    PosixBackend posix_backend;
+    UringBackend uring_backend;
+    StorageBackend *storage = &posix_backend;
+
+    if (strcmp(options.backend, "uring") == 0) {
+        int err = uring_backend.Open(URING_DEFAULT_ENTRIES);
+        if (err == 0) {
+            storage = &uring_backend;
+        } else {
+            cerr << "io_uring unavailable (" << strerror(-err) 
+                 << "), using POSIX file I/O" << endl;
+        }
+    }
+
+    WatFSServer service(root_dir, options.max_chunk_size, storage);
+
+    int err = service.StartStatCache(options.stat_cache_size);
+    if (err != 0) {
+        cerr << "inotify unavailable (" << strerror(-err) 
+             << "), not caching attributes" << endl;
+    }
+
+    vector<unique_ptr<ServerCompletionQueue>> cqs;
+    vector<pthread_t> threads;
 
     ServerBuilder builder;
     builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
+    builder.SetMaxReceiveMessageSize(options.max_chunk_size + MESSAGE_OVERHEAD);
+    builder.SetMaxSendMessageSize(options.max_chunk_size + MESSAGE_OVERHEAD);
     builder.RegisterService(&service);
+    for (int i = 0; i < options.cq_threads; i++) {
+        cqs.push_back(builder.AddCompletionQueue());
+    }
     unique_ptr<Server> server(builder.BuildAndStart());
 
-    cout << "Server listening on " << server_address << endl;
+    service.StartIOThreads(options.io_threads);
+
+    for (auto &cq : cqs) {
+        pthread_t thread;
+
+        request_calls(&service, cq.get());
+
+        if (pthread_create(&thread, NULL, poll_queue, cq.get()) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+        threads.push_back(thread);
+    }
+
+    cout << "Server listening on " << server_address << " with " 
+         << options.cq_threads << " completion queues and " 
+         << options.io_threads << " I/O threads using " 
+         << storage->Name() << " file I/O" << endl;
 
-    server->Wait();
+    for (auto thread : threads) {
+        pthread_join(thread, NULL);
+    }
 }
 
 
@@ -574,8 +1714,44 @@ int main(int argc, const char *argv[])
     const char *root_dir;
     const char *server_address;
 
-    // we don't have any options yet, just ignore them for now
-    while (getopt(argc, (char **)argv, "abc:") != -1);
+    int opt;
+
+    options.max_chunk_size = MAX_CHUNK_SZ;
+    options.cq_threads = max(sysconf(_SC_NPROCESSORS_ONLN), 1L);
+    options.io_threads = 0;
+    options.backend = "uring";
+    options.stat_cache_size = STAT_CACHE_DEFAULT_SIZE;
+
+    while ((opt = getopt(argc, (char **)argv, "m:t:w:b:s:")) != -1) {
+        switch (opt) {
+        case 'm':
+            options.max_chunk_size = max(atol(optarg), (long)MESSAGE_SZ);
+            break;
+        case 't':
+            options.cq_threads = max(atoi(optarg), 1);
+            break;
+        case 'w':
+            options.io_threads = max(atoi(optarg), 1);
+            break;
+        case 'b':
+            if (strcmp(optarg, "uring") != 0 && strcmp(optarg, "posix") != 0) {
+                print_usage();
+                return 1;
+            }
+            options.backend = optarg;
+            break;
+        case 's':
+            options.stat_cache_size = max(atol(optarg), 0L);
+            break;
+        default:
+            print_usage();
+            return 1;
+        }
+    }
+
+    if (options.io_threads == 0) {
+        options.io_threads = IO_THREADS_PER_CQ * options.cq_threads;
+    }
     
     root_dir = argv[optind++];
     if (root_dir == NULL) {